@@ -0,0 +1,18 @@
+#ifndef BENEATH_H
+#define BENEATH_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define BENEATH_HOME 0 // Confined to the user's folder
+#define BENEATH_ROOT 1 // Confined to the root directory (cd, list)
+#define BENEATH_CACHE_SIZE 32 // Directory handles kept open by a session
+
+int beneath_init(int root_fd, const char *user);
+void beneath_chdir(const char *resolved);
+int beneath_open(int scope, const char *path, int flags, mode_t mode);
+int beneath_parent(int scope, const char *path, char *name, size_t size);
+int beneath_stat(int scope, const char *path, struct stat *st, int flags);
+int beneath_openat(int dir_fd, const char *path, int flags, mode_t mode);
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef CONCURRENCY_H
 #define CONCURRENCY_H
 
-#include <semaphore.h>
+#include <pthread.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,28 +11,116 @@
 #include <fcntl.h>
 #include <errno.h>
 #include "common.h"
+#include "server.h"
+#include "ring.h"
 
 #define MAX_LOCKS 100
+#define MAX_LOCK_WAITERS 16
+#define MAX_LOCK_OWNERS 16
+#define MAX_LOCK_RANGES 32
+#define RANGE_EOF LLONG_MAX // End of a range that extends to the end of the file
+#define RANGE_GROW (RANGE_EOF - 1) // Byte taken by the writers that extend a file, so they grow it one at a time
+#define LOCK_POLL_INTERVAL_MS 500 // Safety net re-check while waiting for a grant
+#define LOCK_HIST_BUCKETS 28 // Bucket b counts durations in [2^(b-1), 2^b) microseconds
+#define LOCK_TOP_DEFAULT 10  // Paths shown by the "locks" admin command
+#define OPTIMISTIC_READ_MAX 4096 // Files up to this size are read without taking the lock
+#define OPTIMISTIC_READ_RETRIES 3
 
 typedef struct {
-    char filepath[PATH_MAX];
-    int readers_count;
-    sem_t mutex;      // Protects readers_count
-    sem_t write_sem;  // Blocks writers (and readers if writer active)
+    pid_t pid;
+    int exclusive; // 1 if waiting for a write lock
+    long long start;
+    long long end;
+} LockWaiter;
+
+typedef struct {
+    pid_t pid;
+    int refs;    // Slot references taken with get_file_lock()
+} LockOwner;
+
+/*
+ * A held byte range [start, end), node of the per-file interval tree.
+ * Nodes are linked by index because the tree lives in shared memory.
+ */
+typedef struct {
+    long long start;
+    long long end;
+    long long max_end; // Largest end in this subtree
+    long long acquired_us; // When the range was granted, for hold times
+    pid_t pid;         // Holder, 0 if the node is free
+    int exclusive;
+    int left, right, parent; // -1 if none
+} LockRange;
+
+/*
+ * Contention counters of a slot, updated with atomic increments outside the slot mutex.
+ */
+typedef struct {
+    unsigned long long acquisitions;
+    unsigned long long contended; // Acquisitions that had to wait
+    unsigned long long timeouts;
+    unsigned long long wait_total_us;
+    unsigned long long hold_total_us;
+    unsigned long long wait_hist[LOCK_HIST_BUCKETS];
+    unsigned long long hold_hist[LOCK_HIST_BUCKETS];
+} LockStats;
+
+typedef struct {
+    char filepath[PATH_MAX]; // Kept while the slot is idle, so its stats survive
+    int shared_count;    // Shared ranges held
+    int exclusive_count; // Exclusive ranges held
+    unsigned long long version; // Bumped when an exclusive range is taken or released, validates optimistic reads
+    pthread_mutex_t mutex; // Robust, protects the lock state, owners, ranges and wait queue
     int usage_count;  // Reference count for this slot
+    LockOwner owners[MAX_LOCK_OWNERS]; // Per-process slot references
+    int owners_count;
+    LockRange ranges[MAX_LOCK_RANGES]; // Interval tree of held ranges
+    int range_root;
+    int range_free;   // Free list, chained through right
+    LockWaiter waiters[MAX_LOCK_WAITERS];
+    int waiters_count;
+    LockStats stats;
 } FileLock;
 
 typedef struct {
     FileLock locks[MAX_LOCKS];
-    sem_t global_lock; // Protects the locks array allocation
+    pthread_mutex_t global_lock; // Robust, protects the locks array allocation
+    unsigned long long table_seq; // Odd while a slot is being assigned to a new path
+    unsigned long long tree_version; // Bumped when a directory or symlink is moved or deleted
+    SessionChannel channels[MAX_CLIENTS]; // Parent <-> session message rings, by session slot
 } SharedState;
 
+/*
+ * State captured at the start of an optimistic read, checked again at the end.
+ */
+typedef struct {
+    FileLock *lock; // Slot of the path, NULL if no slot tracks it
+    unsigned long long table_seq;
+    unsigned long long version;
+} ReadTicket;
+
 void init_shared_memory();
+void lock_set_session(int notify_client, int parent_fd);
 FileLock* get_file_lock(const char* path);
 void release_file_lock(FileLock* lock);
-void reader_lock(FileLock* lock);
+int range_trylock(FileLock* lock, long long start, long long len, int exclusive);
+int range_lock(FileLock* lock, long long start, long long len, int exclusive, int timeout);
+void range_unlock(FileLock* lock, long long start, long long len);
+int reader_trylock(FileLock* lock);
+int writer_trylock(FileLock* lock);
+int lock_enqueue(FileLock* lock, int exclusive, long long start, long long end);
+void lock_dequeue(FileLock* lock);
+int lock_wait_fd(FileLock* lock);
+int reader_lock(FileLock* lock, int timeout);
 void reader_unlock(FileLock* lock);
-void writer_lock(FileLock* lock);
+int writer_lock(FileLock* lock, int timeout);
 void writer_unlock(FileLock* lock);
+void release_locks_of(pid_t pid);
+void dump_lock_stats(int top_n);
+int optimistic_read_begin(const char* path, ReadTicket* ticket);
+int optimistic_read_validate(ReadTicket* ticket);
+SessionChannel* session_channel(int slot);
+unsigned long long tree_version();
+void tree_changed();
 
 #endif
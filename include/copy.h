@@ -0,0 +1,94 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <sys/select.h>
+#include "transfer.h"
+
+#define COPY_WORKERS 4 // Privileged processes that perform accepted transfers
+#define COPY_CHUNK (1 << 30) // Bytes per copy_file_range()/sendfile() call
+#define COPY_BUFFER_SIZE 65536 // Buffer of the read()/write() fallback
+#define COPY_LOCK_TIMEOUT 60 // Seconds a worker waits for the source/destination locks
+#define COPY_THREADS 4 // Threads of a worker copying the files of a tree in parallel
+#define COPY_PROGRESS_INTERVAL_MS 1000 // Time between two progress reports of a tree copy
+#define COPY_TMP_PREFIX ".xfer-" // Name of a file of a tree copy until every file is copied
+
+/*
+ * A copy handed to a worker, sent as one SOCK_SEQPACKET message.
+ */
+typedef struct {
+    int id; // Request the copy belongs to
+    int group; // Fan-out group, the copy is made from its staged source
+    char source[PATH_LENGTH];
+    char dest[PATH_LENGTH];
+    char sender[USERNAME_LENGTH];   // Owner of the folder source is opened in
+    char receiver[USERNAME_LENGTH];
+} copy_job;
+
+/*
+ * Outcome of a copy, sent back by the worker.
+ */
+typedef struct {
+    int id;
+    int status; // 0 on success, -1 on failure
+    int done;   // Files copied so far (tree copies)
+    int total;  // Files to copy (tree copies)
+    int final;  // 0 for a progress report, the worker is still busy
+} copy_result;
+
+/*
+ * A directory or a file of a tree copy.
+ */
+typedef struct {
+    char source[PATH_LENGTH]; // Relative to the source directory
+    char dest[PATH_LENGTH];   // Relative to the receiver's folder
+    int dir;                  // 1 for a directory to create, 0 for a file to copy
+    mode_t mode;              // Directory permissions
+    int state;                // 1 once the directory is created, or the file copied under its temporary name
+    long long bytes;          // Charged to the receiver for this entry
+    long long inodes;
+} copy_item;
+
+/*
+ * Entries of a tree copy, shared by the copy threads.
+ * Paths are opened relative to src_fd and home_fd without following symlinks,
+ * so neither user can send root's copies elsewhere.
+ */
+typedef struct {
+    copy_item *items; // Directories before their contents
+    int count;
+    int capacity;
+    int files;  // Items that are files
+    int next;   // Next item to take, atomic
+    int done;   // Files finished, atomic
+    int failed; // Files that could not be copied, atomic
+    int src_fd;  // Source directory
+    int home_fd; // Receiver's folder
+    uid_t uid;  // Owner of the copies
+    gid_t gid;
+    long long bytes;  // Growth of the owner's usage, for its quota
+    long long inodes;
+} copy_set;
+
+typedef struct {
+    pid_t pid;
+    int fd;   // Parent end of the worker's socketpair, -1 if not running
+    int busy; // 1 while job is being copied
+    copy_job job;
+} copy_worker;
+
+typedef struct copy_queue{
+    copy_job job;
+    struct copy_queue *next;
+} copy_queue;
+
+int copy_fd_data(int src_fd, int dest_fd);
+int copy_is_glob(const char *path);
+int copy_open_source(const char *source, const char *sender, int flags);
+int copy_open_dest(const char *dest, const char *receiver, int flags, mode_t mode);
+int copy_tree(const char *source, const char *dest, const char *sender, const char *owner, uid_t uid, gid_t gid);
+int copy_pool_init();
+int copy_pool_submit(int id, int group, const char *source, const char *dest, const char *sender, const char *receiver);
+void copy_pool_fdset(fd_set *set, int *max_fd);
+void copy_pool_handle(fd_set *set);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <limits.h>
+#include <sys/select.h>
+#include <sys/types.h>
+
+#define DIRCACHE_DIRS 32            // Directories cached at the same time
+#define DIRCACHE_ENTRIES 2048       // Entries of a cached directory, larger ones are always read from disk
+#define DIRCACHE_WATCH_WAIT_MS 100  // Time list --generation waits for the watcher to watch a new directory
+#define DIRCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                         IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * An entry of a cached directory, what list shows of it.
+ */
+typedef struct {
+    char name[NAME_MAX + 1];
+    long long size;
+    unsigned int mode;
+} dircache_entry;
+
+/*
+ * A cached directory, in the shared table.
+ * The entries are read like a seqlock: seq is odd while they are rewritten.
+ * They are valid while filled equals generation, which the watcher changes
+ * at every event in the directory.
+ */
+typedef struct {
+    unsigned long long seq;
+    unsigned long long generation; // Taken from the table counter, never reused
+    unsigned long long filled;     // Generation the entries were read at, 0 if none
+    unsigned long long used;       // Table clock at the last use, for the eviction
+    dev_t dev;                     // Directory held by the slot
+    ino_t ino;
+    pid_t writer;                  // Session rewriting the slot, 0 if none
+    int watched;                   // Set by the watcher once the changes of dev/ino are reported
+    int count;
+    dircache_entry entries[DIRCACHE_ENTRIES];
+} dircache_dir;
+
+/*
+ * Shared by the parent (the watcher) and the sessions.
+ */
+typedef struct {
+    unsigned long long generation; // Last generation handed out
+    unsigned long long clock;
+    dircache_dir dirs[DIRCACHE_DIRS];
+} dircache_table;
+
+int dircache_init();
+void dircache_fdset(fd_set *set, int *max_fd);
+void dircache_handle(fd_set *set);
+void dircache_watch(int slot, const char *path);
+
+int dircache_list(int dir_fd);
+int dircache_begin(int dir_fd, const char *path);
+void dircache_record(int slot, const char *name, long long size, unsigned int mode);
+void dircache_end(int slot, int complete);
+unsigned long long dircache_generation(int dir_fd, const char *path);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <pthread.h>
+#include <time.h>
+
+#define FIND_THREADS 4           // Walkers of a find
+#define FIND_CHUNK_SIZE 65536    // Output a walker gathers before sending it
+#define FIND_IDLE_WAIT_US 50     // Pause of a walker that found nothing to steal
+
+/*
+ * Directories waiting to be walked by a walker. The owner takes the newest
+ * one, the other walkers steal the oldest one.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    char **paths;   // Relative to the start of the find, "" for the start itself
+    int head;       // Oldest, taken by thieves
+    int tail;       // One past the newest, taken by the owner
+    int capacity;
+} find_deque;
+
+/*
+ * A find, shared by its walkers.
+ */
+typedef struct {
+    int root_fd;
+    const char *prefix;      // Path given to find, printed before the relative paths
+    const char *name;        // -name glob, NULL if none
+    int size_cmp;            // -size: -1 smaller, 0 equal, 1 larger, 2 if not given
+    long long size;
+    int newer;               // 1 if -newer was given
+    struct timespec newer_than;
+    int pending;             // Directories queued or being walked, atomic
+    int stop;                // Set when the client cancels or goes away, atomic
+    long long matches;       // atomic
+    long long dirs;          // atomic
+    long long errors;        // Directories that could not be read, atomic
+    pthread_mutex_t out_mutex;
+    find_deque deques[FIND_THREADS];
+} find_job;
+
+int find_run(find_job *job);
+
+#endif
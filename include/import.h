@@ -0,0 +1,28 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <sys/select.h>
+#include "users.h"
+
+#define IMPORT_PARALLEL 8 // useradd processes an import runs at the same time
+#define IMPORT_BATCH 64   // Provisioned users stored with one write of the user store
+#define IMPORT_PROGRESS_INTERVAL_MS 1000 // Time between two progress reports of an import
+
+/*
+ * Sent by the import worker to the parent, as one SOCK_SEQPACKET message:
+ * users provisioned since the last message, to be stored, and the progress.
+ */
+typedef struct {
+    int done;   // Lines processed so far, the ones not in a batch failed
+    int total;  // Lines to process
+    int final;  // 1 in the last message, the worker exits after it
+    int count;  // Entries of users
+    User users[IMPORT_BATCH];
+} import_batch;
+
+int import_start(const char *path);
+void import_status();
+void import_fdset(fd_set *set, int *max_fd);
+void import_handle(fd_set *set);
+
+#endif
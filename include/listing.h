@@ -0,0 +1,34 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stddef.h>
+
+#define LIST_BATCH_SIZE 65536 // Bytes of directory entries read by one getdents64()
+#define LIST_CHUNK_SIZE 65536 // Output of a listing sent to the client at once
+
+/*
+ * Reads the entries of a directory in getdents64() batches.
+ */
+typedef struct {
+    int fd;
+    size_t pos;   // Next record in buf
+    size_t len;   // Bytes of records in buf
+    char buf[LIST_BATCH_SIZE];
+} dir_stream;
+
+/*
+ * An entry returned by dir_stream_next(), name points into the stream's buffer.
+ */
+typedef struct {
+    const char *name;
+    unsigned char type;  // DT_* value, DT_UNKNOWN if the filesystem does not tell
+    long long next;      // Position after this entry, a cursor to resume from
+} dir_entry;
+
+void dir_stream_init(dir_stream *s, int fd);
+int dir_stream_seek(dir_stream *s, long long cursor);
+int dir_stream_next(dir_stream *s, dir_entry *e);
+int client_cancelled();
+int list_stream(int dir_fd, long long limit, long long cursor, int fill_slot);
+
+#endif
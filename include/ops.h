@@ -18,5 +18,9 @@ int op_download(char *args[], int arg_count);
 int op_transfer_request(char *args[], int arg_count);
 int op_accept(char *args[], int arg_count);
 int op_reject(char *args[], int arg_count);
+int op_pending(char *args[], int arg_count);
+int op_status(char *args[], int arg_count);
+int op_cancel(char *args[], int arg_count);
+int op_find(char *args[], int arg_count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,11 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+#define PATH_RESOLVED_MAX 2048 // Size of the buffers resolve_path() writes to
+
+int canon_path(const char *base, const char *path, char *out, size_t size);
+int path_within(const char *resolved, size_t len, const char *prefix, size_t prefix_len);
+
+#endif
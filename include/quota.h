@@ -0,0 +1,58 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <sys/types.h>
+#include "users.h"
+
+#define QUOTA_FILE "quotas.dat"       // Usage and limits of the users, next to users.dat
+#define QUOTA_SLOTS 65536             // Users with a quota entry, power of two
+#define QUOTA_SAVE_INTERVAL 60        // Seconds between two saves of the counters
+#define QUOTA_RECONCILE_INTERVAL 3600 // Seconds between two reconciliation scans
+
+/*
+ * Usage and limits of a user, in the shared table.
+ * The counters are only changed with atomic operations.
+ */
+typedef struct {
+    int state;              // QUOTA_EMPTY, QUOTA_CLAIMED while being filled, QUOTA_READY
+    unsigned int hash;
+    char name[USERNAME_LENGTH];
+    long long bytes;        // Size of the regular files in the user's folder
+    long long inodes;       // Files and directories in the user's folder
+    long long max_bytes;    // 0 for no limit
+    long long max_inodes;   // 0 for no limit
+} quota_entry;
+
+#define QUOTA_EMPTY 0
+#define QUOTA_CLAIMED 1
+#define QUOTA_READY 2
+
+/*
+ * Shared by the parent, the sessions and the workers.
+ */
+typedef struct {
+    unsigned long long changes; // Bumped by every update, the parent saves when it moves
+    pid_t reconciler;           // Process running a reconciliation scan, 0 if none
+    quota_entry entries[QUOTA_SLOTS];
+} quota_table;
+
+/*
+ * Record of quotas.dat.
+ */
+typedef struct {
+    char name[USERNAME_LENGTH];
+    long long bytes;
+    long long inodes;
+    long long max_bytes;
+    long long max_inodes;
+} quota_record;
+
+int quota_init(int dir_fd);
+int quota_charge(const char *user, long long bytes, long long inodes);
+int quota_set(const char *user, long long max_bytes, long long max_inodes);
+void quota_print(const char *user);
+int quota_save();
+int quota_reconcile_start();
+void quota_tick();
+
+#endif
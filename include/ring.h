@@ -0,0 +1,39 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+#ifndef IPC_RING_SIZE
+#define IPC_RING_SIZE 65536 // Bytes per ring, power of two, can be set at build time
+#endif
+
+/*
+ * Lock-free single-producer/single-consumer byte ring in shared memory.
+ * head and tail only grow, the index in data is taken modulo IPC_RING_SIZE.
+ */
+typedef struct {
+    unsigned long head; // Next byte to consume, written by the consumer only
+    char pad[64 - sizeof(unsigned long)]; // Keep producer and consumer on separate cache lines
+    unsigned long tail; // End of the published bytes, written by the producer only
+    char pad2[64 - sizeof(unsigned long)];
+    unsigned char data[IPC_RING_SIZE];
+} IpcRing;
+
+/*
+ * Control channel of a session, one ring per direction.
+ */
+typedef struct {
+    IpcRing to_parent;
+    IpcRing to_child;
+} SessionChannel;
+
+void ring_reset(IpcRing *ring);
+int ring_write(IpcRing *ring, int doorbell, const void *buf, size_t len);
+size_t ring_peek(IpcRing *ring, void *buf, size_t max);
+void ring_consume(IpcRing *ring, size_t len);
+int ring_empty(IpcRing *ring);
+void ring_doorbell(int doorbell);
+void ring_clear_doorbell(int doorbell);
+int ring_wait_doorbell(int doorbell, int timeout_ms);
+
+#endif
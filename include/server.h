@@ -12,13 +12,17 @@
 #include <sys/wait.h>
 #include "users.h"
 
-#define MAX_CLIENTS 10
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 10 // Session slots, can be set at build time (see "make bench")
+#endif
+#define IPC_BUFFER_SIZE 16384 // Bytes the parent takes from a session ring at once
 
 typedef struct {
     pid_t pid;
-    int pipe_fd_read;  // Parent reads from here (c_to_p[0])
-    int pipe_fd_write; // Parent writes to here (p_to_c[1])
-    char username[USERNAME_LENGTH];
+    int pipe_fd_read;  // Doorbell of the session-to-parent ring, the parent waits on it
+    int pipe_fd_write; // Doorbell of the parent-to-session ring, the parent rings it
+    char username[USERNAME_LENGTH]; // Set when the session reports I_M_USER
+    int next_session; // Next session of the same user, -1 if last
 } ClientSession;
 
 int handle_client(int server_socket);
@@ -27,9 +31,13 @@ int execute_command(char *command);
 int login(char *username);
 int check_path(char *path);
 int check_path_mine(char *path);
+int resolve_path_mine(char *path, char *resolved, size_t size);
 int find_path(char* dest, int dest_size, int fd);
 int resolve_path(char *base, char *path, char *resolved);
 void cleanup_children(int sig);
+int sigchld_init();
 void handle_sigchld(int sig);
+void sigchld_fdset(fd_set *set, int *max_fd);
+void reap_children(fd_set *set);
 
 #endif
\ No newline at end of file
@@ -6,9 +6,29 @@
 #include "users.h"
 
 #define PATH_LENGTH 1024
+#define PRESENCE_BUCKETS 64
+#define REQ_INDEX_BUCKETS 1024
+#define TRANSFER_TTL (7 * 24 * 3600) // Seconds a request waits for an answer before it expires
+#define TRANSFER_EXPIRY_SWEEP 60 // Seconds between two expiry sweeps
+#define TRANSFER_MAX_RECIPIENTS 64 // Users a single transfer_request can name
+#define TRANSFER_STAGING_DIR ".staging" // Staged copies of fan-out transfers, in the root directory
+
+// Pipe message encoding, see encode_transfer_msg()
+#define MSG_F_ID       0x01
+#define MSG_F_SENDER   0x02
+#define MSG_F_RECEIVER 0x04
+#define MSG_F_PATH     0x08
+#define MSG_F_ARG      0x10
+#define MSG_F_ARG2     0x20
+#define MSG_VARINT_MAX 5 // Bytes of a 32 bit varint
+#define RING_FULL_WAIT_US 1000 // Retry delay of a session whose ring to the parent is full
+#define SESSION_BACKLOG_MAX (1 << 20) // Bytes of notifications queued for a session whose ring is full, replies are always queued
+#define PARENT_REPLY_TIMEOUT_MS 30000 // Time a session waits for the parent to answer a command
+#define MSG_FRAME_MAX (1 + 3 * MSG_VARINT_MAX + 2 * (2 + USERNAME_LENGTH) + (2 + PATH_LENGTH)) // Below PIPE_BUF
 
 extern int pipe_read;
 extern int pipe_write;
+extern int session_slot;
 extern char username[USERNAME_LENGTH];
 extern ClientSession sessions[];
 
@@ -17,7 +37,7 @@ typedef struct {
     char sender[USERNAME_LENGTH];
     char receiver[USERNAME_LENGTH];
     char path[PATH_LENGTH];
-    
+    int group; // Fan-out: id of the first request of the group, 0 if the request is alone
 } transfer_request;
 
 typedef enum {
@@ -28,30 +48,70 @@ typedef enum {
     NEW_REQ,        //4
     HANDLED,        //5
     REJECTED,       //6
-    WHO_ARE_YOU     //7
+    WHO_ARE_YOU,    //7
+    PENDING,        //8
+    PENDING_END,    //9
+    REQ_CREATED,    //10
+    STATUS,         //11
+    STATUS_INFO,    //12
+    STATUS_END,     //13
+    CANCEL,         //14
+    CANCELLED,      //15
+    PROGRESS,       //16
+    WATCH_DIR       //17
 } transfer_status;
 
 typedef struct{
     transfer_status status;
     transfer_request req;
+    int arg; // NEW_REQ: group to join (-1 to start one), REQ_CREATED/CANCELLED: 0 or -1 on failure, STATUS_INFO: 1 if the copy is running, PROGRESS: files copied, PENDING_END/STATUS_END: requests there are
+    int arg2; // PROGRESS: files to copy
 } transfer_msg;
 
 typedef struct req_list{
     transfer_request req;
-    struct req_list *next;
+    int origin;       // Session that created the request, -1 if replayed from the log
+    pid_t origin_pid; // Its pid, to detect a slot reused by another session
+    time_t created;
+    int copying;      // Accepted, out of the pending queue until the copy ends
+    struct req_list *next;    // Receiver's pending queue
+    struct req_list *prev;
+    struct req_list *next_id; // Id index bucket chain
 } req_list;
 
-typedef struct dict{
-    int key;
-    int value;
-    struct dict *next;
-} dict;
+/*
+ * Presence registry entry: the sessions logged in as a user and the
+ * requests waiting for that user, so routing never has to ask every session.
+ */
+typedef struct presence{
+    char username[USERNAME_LENGTH];
+    int first_session;      // Head of the user's sessions, chained through ClientSession.next_session
+    req_list *pending_head; // Requests waiting for accept/reject, oldest first
+    req_list *pending_tail;
+    struct presence *next;  // Hash bucket chain
+} presence;
 
-int create_request(char *sender, char *receiver, char *path);
+int write_n(int fd, void *vptr, size_t n);
+int read_n(int fd, void *vptr, size_t n);
+int send_to_parent(transfer_msg *msg);
+int send_to_session(int session, transfer_msg *msg);
+int receive_transfer_msg(transfer_msg *msg, int timeout_ms);
+void transfer_flush_backlogs();
+int transfer_backlogged();
+int pending_req();
+int status_req(int id);
+int cancel_req(int id);
+int transfer_queue_init(int dir_fd);
+void transfer_expire();
+int create_request(char *sender, char *path, char *receiver, int group);
 int accept_req(int id, char *dest);
 int reject_req(int id);
 int i_am_user();
 int child_handle_msg();
 int parent_handle_msg(int i);
+void presence_leave(int session);
+int perform_transfer(char *source, char *dest, char *sender, char *receiver, int group);
+void transfer_copy_done(int id, int status);
+void transfer_copy_progress(int id, int done, int total);
 
 #endif
\ No newline at end of file
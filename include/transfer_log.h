@@ -0,0 +1,41 @@
+#ifndef TRANSFER_LOG_H
+#define TRANSFER_LOG_H
+
+#include <time.h>
+#include "transfer.h"
+
+#define TRANSFER_LOG_FILE "transfers.log"       // Append-only log of request changes
+#define TRANSFER_SNAPSHOT_FILE "transfers.snap" // Live requests at the last compaction
+#define TRANSFER_COMPACT_MIN 1024 // Log records before a compaction is considered
+
+typedef enum {
+    TLOG_ADD = 1, // Request created
+    TLOG_DEL = 2  // Request accepted, rejected or expired
+} tlog_type;
+
+/*
+ * On-disk record header, followed by sender, receiver and path (not NUL terminated).
+ */
+typedef struct {
+    unsigned char type;
+    unsigned char pad;
+    unsigned short sender_len;
+    unsigned short receiver_len;
+    unsigned short path_len;
+    int id;
+    int group; // Fan-out group, 0 if none (was padding, older logs read as 0)
+    long long created;
+} tlog_record;
+
+typedef void (*tlog_add_fn)(transfer_request *req, time_t created);
+typedef void (*tlog_del_fn)(int id);
+
+int tlog_open(int dir_fd, tlog_add_fn on_add, tlog_del_fn on_del);
+int tlog_add(transfer_request *req, time_t created);
+int tlog_del(int id);
+int tlog_should_compact(int live);
+int tlog_compact_begin(int last_id);
+int tlog_compact_add(transfer_request *req, time_t created);
+int tlog_compact_end();
+
+#endif
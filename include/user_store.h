@@ -0,0 +1,84 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include "users.h"
+
+#define USER_LOG_FILE "users.log"   // Append-only log of user changes
+#define USER_INDEX_FILE "users.idx" // Hash index of the log, mmap-ed by every process
+#define USER_LOG_MAGIC "USRLOG1"
+#define USER_INDEX_MAGIC "USRIDX1"
+#define USER_INDEX_MIN_SLOTS 1024 // Initial index slots, power of two
+#define USER_COMPACT_MIN 1024     // Dead log records before a compaction is considered
+#define USER_MAP_CHUNK (1 << 20)  // The log mapping grows by at least this much
+
+/*
+ * Log header, followed by the records.
+ * The generation changes with each compaction, the index records the one it was built from.
+ */
+typedef struct {
+    char magic[8];
+    unsigned long long gen;
+} ustore_log_header;
+
+typedef enum {
+    USTORE_ADD = 1, // User created
+    USTORE_DEL = 2  // User deleted
+} ustore_type;
+
+/*
+ * Log record, followed by the username (not NUL terminated).
+ */
+typedef struct {
+    unsigned char type;
+    unsigned char pad;
+    unsigned short name_len;
+    int id;
+    int permissions;
+} ustore_record;
+
+/*
+ * Index header, followed by capacity slots (open addressing, linear probing).
+ */
+typedef struct {
+    char magic[8];
+    unsigned long long gen;     // Log generation the index describes
+    unsigned long long log_end; // Log offset up to which records are indexed
+    unsigned int capacity;      // Slots, power of two
+    unsigned int live;          // Users
+    unsigned int used;          // Live and deleted slots
+    unsigned int dead;          // Log records that no longer describe a user
+    int next_id;
+    unsigned int pad;
+} ustore_index_header;
+
+/*
+ * Index slot: offset of the user's ADD record in the log.
+ */
+typedef struct {
+    unsigned int hash;
+    unsigned int pad;
+    unsigned long long off; // USTORE_SLOT_EMPTY, USTORE_SLOT_DELETED or a log offset
+} ustore_slot;
+
+/*
+ * Published by the parent in an anonymous shared page that the sessions
+ * inherit, so they notice changes without a syscall.
+ */
+typedef struct {
+    unsigned long long gen;       // Bumped after every change, published last
+    unsigned long long files_gen; // Bumped when the log or the index is replaced by a new file
+    unsigned long long log_size;  // Bytes of valid records in the log
+} ustore_shared;
+
+#define USTORE_SLOT_EMPTY 0
+#define USTORE_SLOT_DELETED 1 // Records start after the log header, never at 0 or 1
+
+int user_store_open(int dir_fd, int writable);
+int user_store_detach();
+int user_store_find(const char *name, User *user);
+int user_store_add(const char *name, int permissions);
+int user_store_add_batch(User *users, int count);
+int user_store_del(const char *name);
+int user_store_count();
+
+#endif
@@ -10,7 +10,7 @@
 #include <stdio.h>
 #include <pwd.h>
 
-#define MAX_USERS 25
+#define LEGACY_MAX_USERS 25 // Size of the users.dat array, read once to migrate it
 #define USERNAME_LENGTH 256
 #define USERS_FILE "users.dat"
 
@@ -20,11 +20,9 @@ typedef struct {
     int permissions;
 } User;
 
-void save_users_to_file();
 int user_exists(char *username);
 int create_user_persistance(char *username, int permissions);
 int delete_user_persistance(char *username);
-void retrive_users();
 int create_user_folder(char *username, int permissions);
 int remove_directory_recursive(int parent_fd, char *name);
 int delete_user_folder(char *username);
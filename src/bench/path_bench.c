@@ -0,0 +1,186 @@
+#include "path.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * Path resolution microbenchmark.
+ * Compares what a command paid to check and resolve a path before
+ * canon_path(): check_path_mine() rebuilt the home path and resolved the
+ * argument, then the command resolved it again, each time with strtok_r()
+ * over a copy and strcat() to rebuild it. Now resolve_path_mine() makes one
+ * pass and compares against the home prefix computed at login.
+ * Built with "make bench".
+ */
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+#define BENCH_ROOT "/srv/share/root"
+#define BENCH_USER "alice"
+#define BENCH_MAX_DEPTH 64
+
+/*
+ * resolve_path() before canon_path(), kept as the baseline.
+ */
+static int legacy_resolve_path(const char *base, const char *path, char *resolved){
+    char temp[2048];
+    char *tokens[256];
+    int token_count = 0;
+
+    strncpy(temp, base, sizeof(temp) - 1);
+    temp[sizeof(temp) - 1] = '\0';
+    if (temp[strlen(temp) - 1] != '/') {
+        strncat(temp, "/", sizeof(temp) - strlen(temp) - 1);
+    }
+    strncat(temp, path, sizeof(temp) - strlen(temp) - 1);
+
+    char *saveptr;
+    char *token = strtok_r(temp, "/", &saveptr);
+    while (token != NULL) {
+        if (strcmp(token, ".") == 0) {
+            // Ignore
+        } else if (strcmp(token, "..") == 0) {
+            if (token_count > 0) {
+                token_count--;
+            }
+        } else {
+            tokens[token_count++] = token;
+        }
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+
+    resolved[0] = '\0';
+    if (token_count == 0) {
+        strcat(resolved, "/");
+    } else {
+        for (int i = 0; i < token_count; i++) {
+            strcat(resolved, "/");
+            strcat(resolved, tokens[i]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * check_path_mine() followed by resolve_path(), as the commands did.
+ */
+static int legacy_check_and_resolve(const char *current, const char *path, char *resolved){
+    char my_path[2048];
+    char checked[2048];
+
+    legacy_resolve_path(BENCH_ROOT, BENCH_USER, my_path);
+    if (path[0] == '/') return -1;
+    legacy_resolve_path(current, path, checked);
+    size_t my_len = strlen(my_path);
+    if (strncmp(checked, my_path, my_len) != 0 || (checked[my_len] != '\0' && checked[my_len] != '/')) {
+        return -1;
+    }
+    return legacy_resolve_path(current, path, resolved);
+}
+
+/*
+ * resolve_path_mine(), with the prefix computed once.
+ */
+static int single_pass(const char *current, const char *home, size_t home_len, const char *path, char *resolved){
+    if (path[0] == '/') return -1;
+    int len = canon_path(current, path, resolved, PATH_RESOLVED_MAX);
+    if (len < 0 || !path_within(resolved, len, home, home_len)) return -1;
+    return 0;
+}
+
+/*
+ * Builds a relative path of depth components, with some "." and ".." mixed in.
+ */
+static void make_path(char *buf, size_t size, int depth){
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < depth && len + 16 < size; i++) {
+        if (i % 7 == 3) {
+            len += snprintf(buf + len, size - len, ".");
+        } else if (i % 11 == 5) {
+            len += snprintf(buf + len, size - len, "..");
+        } else {
+            len += snprintf(buf + len, size - len, "dir%d", i);
+        }
+        buf[len++] = '/';
+        buf[len] = '\0';
+    }
+    snprintf(buf + len, size - len, "file.txt");
+}
+
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]){
+    long iterations = BENCH_DEFAULT_ITERATIONS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "Invalid number of iterations\n");
+        return 1;
+    }
+
+    char current[PATH_RESOLVED_MAX];
+    char home[PATH_RESOLVED_MAX];
+    int home_len = canon_path(BENCH_ROOT, BENCH_USER, home, sizeof(home));
+    canon_path(home, "projects/2024", current, sizeof(current));
+
+    static const int depths[] = { 1, 4, 16, BENCH_MAX_DEPTH };
+    printf("%-8s %14s %14s %9s\n", "depth", "legacy ns/op", "single ns/op", "speedup");
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        char path[PATH_RESOLVED_MAX / 2];
+        char a[PATH_RESOLVED_MAX], b[PATH_RESOLVED_MAX];
+        make_path(path, sizeof(path), depths[d]);
+
+        // Both must agree before being timed
+        int ra = legacy_check_and_resolve(current, path, a);
+        int rb = single_pass(current, home, home_len, path, b);
+        if (ra != rb || (ra == 0 && strcmp(a, b) != 0)) {
+            fprintf(stderr, "Mismatch for %s: %s / %s\n", path, a, b);
+            return 1;
+        }
+
+        volatile int sink = 0;
+        long long start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            sink += legacy_check_and_resolve(current, path, a);
+        }
+        long long legacy = now_ns() - start;
+
+        start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            sink += single_pass(current, home, home_len, path, b);
+        }
+        long long single = now_ns() - start;
+        (void)sink;
+
+        printf("%-8d %14.1f %14.1f %8.1fx\n", depths[d], (double)legacy / iterations, (double)single / iterations,
+               single > 0 ? (double)legacy / single : 0.0);
+    }
+
+    // Lexical escapes are rejected by both
+    static const char *escapes[] = { "..", "../bob/x", "../../etc/passwd", "a/../../../x", "/etc/passwd" };
+    for (size_t e = 0; e < sizeof(escapes) / sizeof(escapes[0]); e++) {
+        char a[PATH_RESOLVED_MAX], b[PATH_RESOLVED_MAX];
+        int ra = legacy_check_and_resolve(home, escapes[e], a);
+        int rb = single_pass(home, home, home_len, escapes[e], b);
+        if (ra != -1 || rb != -1) {
+            fprintf(stderr, "Escape not rejected: %s (%d/%d)\n", escapes[e], ra, rb);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,432 @@
+#include "server.h"
+#include "common.h"
+#include "transfer.h"
+#include "concurrency.h"
+#include "copy.h"
+#include "transfer_log.h"
+#include <sys/eventfd.h>
+#include <time.h>
+
+/*
+ * Routing benchmark.
+ * Runs the parent's routing code (parent_handle_msg() and everything below it)
+ * in one process against simulated sessions: each session is a slot with its
+ * two shared-memory rings, driven from here instead of a forked child.
+ * No OS user, chroot or root is needed. Built with "make bench".
+ */
+
+#define BENCH_DEFAULT_MESSAGES 200000
+#define BENCH_DEFAULT_BATCH 256
+#define BENCH_SOURCE_PATH "/bench/source"
+#define BENCH_DEST_PATH "/bench/dest"
+
+// Globals of server_main.c, which is not linked in
+int root_dir_fd;
+int current_dir_fd;
+int port;
+char *ip;
+char root_dir_path[1024];
+ClientSession sessions[MAX_CLIENTS];
+pid_t server_pid;
+
+/*
+ * Stand-in for the copy pool: accepted copies complete at the end of the
+ * round, so the benchmark measures routing only.
+ */
+static int *copies = NULL;
+static int copies_count = 0;
+static int copies_capacity = 0;
+
+int copy_pool_submit(int id, int group, const char *source, const char *dest, const char *sender, const char *receiver){
+    (void)group; (void)source; (void)dest; (void)sender; (void)receiver;
+    if (copies_count == copies_capacity) {
+        copies_capacity = copies_capacity ? copies_capacity * 2 : 1024;
+        copies = realloc(copies, copies_capacity * sizeof(int));
+        if (copies == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    copies[copies_count++] = id;
+    return 0;
+}
+
+int copy_is_glob(const char *path){
+    (void)path;
+    return 0;
+}
+
+int copy_tree(const char *source, const char *dest, const char *sender, const char *owner, uid_t uid, gid_t gid){
+    (void)source; (void)dest; (void)sender; (void)owner; (void)uid; (void)gid;
+    return -1;
+}
+
+int copy_fd_data(int src_fd, int dest_fd){
+    (void)src_fd; (void)dest_fd;
+    return -1;
+}
+
+int copy_open_source(const char *source, const char *sender, int flags){
+    (void)source; (void)sender; (void)flags;
+    errno = ENOENT;
+    return -1;
+}
+
+int copy_open_dest(const char *dest, const char *receiver, int flags, mode_t mode){
+    (void)dest; (void)receiver; (void)flags; (void)mode;
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+ * Requests waiting for a simulated user, learnt from the TRANSF_REQ
+ * messages its first session receives.
+ */
+typedef struct {
+    int *ids;
+    int count;
+    int capacity;
+} bench_pending;
+
+typedef struct {
+    int sessions_n;
+    int users_n;
+    long messages;
+    int batch;
+    int accept_pct;
+    int reject_pct;
+    unsigned int seed;
+    char *dir;
+} bench_config;
+
+static bench_pending *pending;
+static long delivered[PROGRESS + 1]; // Messages received by the sessions, by type
+static FILE *out;                    // Results, stdout is silenced during the run
+static int users_n;                  // Session s belongs to user s % users_n
+static unsigned long long rng_state;
+
+static unsigned int bench_rand(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 11);
+}
+
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Makes the calling code act as session s, see send_to_parent() and receive_transfer_msg().
+ */
+static void act_as(int s){
+    session_slot = s;
+    pipe_read = sessions[s].pipe_fd_write;
+    pipe_write = sessions[s].pipe_fd_read;
+    snprintf(username, USERNAME_LENGTH, "u%d", s % users_n);
+}
+
+static void pending_push(int user, int id){
+    bench_pending *p = &pending[user];
+    if (p->count == p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : 16;
+        p->ids = realloc(p->ids, p->capacity * sizeof(int));
+        if (p->ids == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p->ids[p->count++] = id;
+}
+
+/*
+ * Empties the rings of every session, as the session children would.
+ */
+static void drain_sessions(int sessions_n){
+    transfer_msg msg;
+
+    // The parent's main loop moves the backlogged messages as the rings empty
+    do {
+        transfer_flush_backlogs();
+        for (int s = 0; s < sessions_n; s++) {
+            if (ring_empty(&session_channel(s)->to_child)) continue;
+            act_as(s);
+            ring_clear_doorbell(pipe_read);
+            while (receive_transfer_msg(&msg, 0) > 0) {
+                if (msg.status <= PROGRESS) {
+                    delivered[msg.status]++;
+                }
+                // the first session of a user keeps track of what it can accept
+                if (msg.status == TRANSF_REQ && s < users_n) {
+                    pending_push(s, msg.req.id);
+                }
+            }
+        }
+    } while (transfer_backlogged());
+}
+
+static int cmp_ll(const void *a, const void *b){
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Prints the latency percentiles of n samples, in microseconds.
+ */
+static void print_latency(const char *what, long long *lat, long n){
+    if (n == 0) return;
+    qsort(lat, n, sizeof(long long), cmp_ll);
+    fprintf(out, "%s latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", what,
+            lat[n / 2] / 1000.0, lat[n * 90 / 100] / 1000.0, lat[n * 99 / 100] / 1000.0,
+            lat[n * 999 / 1000] / 1000.0, lat[n - 1] / 1000.0);
+}
+
+/*
+ * Every session is asked WHO_ARE_YOU and answers I_M_USER, which registers it
+ * in the presence registry. Measured one session at a time.
+ */
+static void bench_handshake(int sessions_n){
+    long long *lat = malloc(sessions_n * sizeof(long long));
+    if (lat == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.status = WHO_ARE_YOU;
+
+    long long start = now_ns();
+    for (int s = 0; s < sessions_n; s++) {
+        long long t0 = now_ns();
+        send_to_session(s, &msg);
+        act_as(s);
+        child_handle_msg(); // answers with i_am_user()
+        parent_handle_msg(s);
+        lat[s] = now_ns() - t0;
+    }
+    long long total = now_ns() - start;
+
+    fprintf(out, "handshake: %d WHO_ARE_YOU/I_M_USER round trips in %.1f ms (%.0f/s)\n",
+            sessions_n, total / 1e6, sessions_n / (total / 1e9));
+    print_latency("handshake", lat, sessions_n);
+    free(lat);
+}
+
+/*
+ * Sends a random NEW_REQ, ACCEPT or REJECT from a session.
+ * Returns the session used.
+ */
+static int send_random(bench_config *cfg, long *counts){
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+
+    int op = bench_rand() % 100;
+    int user = bench_rand() % cfg->users_n;
+    if (op < cfg->accept_pct + cfg->reject_pct && pending[user].count > 0) {
+        bench_pending *p = &pending[user];
+        int k = bench_rand() % p->count;
+        msg.status = (op < cfg->accept_pct) ? ACCEPT : REJECT;
+        msg.req.id = p->ids[k];
+        p->ids[k] = p->ids[--p->count];
+        strcpy(msg.req.path, BENCH_DEST_PATH);
+        act_as(user); // the requests were delivered to the user's first session
+    } else {
+        int s = bench_rand() % cfg->sessions_n;
+        msg.status = NEW_REQ;
+        snprintf(msg.req.receiver, USERNAME_LENGTH, "u%d", user);
+        strcpy(msg.req.path, BENCH_SOURCE_PATH);
+        act_as(s);
+    }
+    strcpy(msg.req.sender, username);
+    counts[msg.status]++;
+    if (send_to_parent(&msg) < 0) {
+        fprintf(out, "session %d: send_to_parent failed\n", session_slot);
+        exit(EXIT_FAILURE);
+    }
+    return session_slot;
+}
+
+/*
+ * Rounds of cfg->batch messages from random sessions, then one pass of the
+ * parent over the sessions that sent something, then the copy completions.
+ * A message's latency runs from its send to the end of the parent_handle_msg()
+ * call that routed it.
+ */
+static void bench_routing(bench_config *cfg){
+    long long *lat = malloc(cfg->messages * sizeof(long long));
+    long long *sent_at = malloc(cfg->batch * sizeof(long long));
+    int *sent_by = malloc(cfg->batch * sizeof(int));
+    long long *done_at = calloc(cfg->sessions_n, sizeof(long long));
+    int *touched = malloc(cfg->sessions_n * sizeof(int));
+    if (lat == NULL || sent_at == NULL || sent_by == NULL || done_at == NULL || touched == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    long counts[PROGRESS + 1] = {0};
+    long n = 0, completions = 0;
+    long long parent_ns = 0, completion_ns = 0;
+    while (n < cfg->messages) {
+        int batch = (cfg->messages - n < cfg->batch) ? (int)(cfg->messages - n) : cfg->batch;
+        int touched_n = 0;
+        for (int k = 0; k < batch; k++) {
+            sent_at[k] = now_ns();
+            sent_by[k] = send_random(cfg, counts);
+            if (done_at[sent_by[k]] == 0) {
+                done_at[sent_by[k]] = -1;
+                touched[touched_n++] = sent_by[k];
+            }
+        }
+
+        long long t0 = now_ns();
+        for (int k = 0; k < touched_n; k++) {
+            if (parent_handle_msg(touched[k]) < 0) {
+                fprintf(out, "parent_handle_msg(%d) failed\n", touched[k]);
+                exit(EXIT_FAILURE);
+            }
+            done_at[touched[k]] = now_ns();
+        }
+        parent_ns += now_ns() - t0;
+        for (int k = 0; k < batch; k++) {
+            lat[n + k] = done_at[sent_by[k]] - sent_at[k];
+        }
+        for (int k = 0; k < touched_n; k++) {
+            done_at[touched[k]] = 0;
+        }
+        n += batch;
+
+        t0 = now_ns();
+        for (int k = 0; k < copies_count; k++) {
+            transfer_copy_done(copies[k], 0);
+        }
+        completion_ns += now_ns() - t0;
+        completions += copies_count;
+        copies_count = 0;
+
+        drain_sessions(cfg->sessions_n);
+    }
+
+    fprintf(out, "routing: %ld messages (%ld NEW_REQ, %ld ACCEPT, %ld REJECT) in %.1f ms of parent time: %.0f msg/s\n",
+            n, counts[NEW_REQ], counts[ACCEPT], counts[REJECT], parent_ns / 1e6, n / (parent_ns / 1e9));
+    if (completions > 0) {
+        fprintf(out, "copy completions: %ld in %.1f ms: %.0f/s\n", completions, completion_ns / 1e6, completions / (completion_ns / 1e9));
+    }
+    print_latency("routing", lat, n);
+    fprintf(out, "delivered to sessions: %ld TRANSF_REQ, %ld REQ_CREATED, %ld HANDLED, %ld REJECTED\n",
+            delivered[TRANSF_REQ], delivered[REQ_CREATED], delivered[HANDLED], delivered[REJECTED]);
+
+    free(lat);
+    free(sent_at);
+    free(sent_by);
+    free(done_at);
+    free(touched);
+}
+
+/*
+ * Gives every simulated session a slot, with both rings sharing one pair of
+ * doorbells (thousands of eventfds would only measure the fd limit).
+ */
+static void setup_sessions(int sessions_n){
+    int to_parent_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int to_child_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (to_parent_bell < 0 || to_child_bell < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = 0; s < MAX_CLIENTS; s++) {
+        memset(&sessions[s], 0, sizeof(ClientSession));
+        sessions[s].pid = -1;
+        sessions[s].next_session = -1;
+        if (s >= sessions_n) continue;
+
+        SessionChannel *ch = session_channel(s);
+        ring_reset(&ch->to_parent);
+        ring_reset(&ch->to_child);
+        sessions[s].pid = 1000000 + s; // only compared, never signalled
+        sessions[s].pipe_fd_read = to_parent_bell;
+        sessions[s].pipe_fd_write = to_child_bell;
+    }
+}
+
+static void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [-s sessions] [-u users] [-n messages] [-b batch] [-a accept%%] [-r reject%%] [-S seed] [-d log_dir]\n"
+                    "  sessions up to %d (MAX_CLIENTS), the rest of the messages are NEW_REQ\n", prog, MAX_CLIENTS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    bench_config cfg = { MAX_CLIENTS, 0, BENCH_DEFAULT_MESSAGES, BENCH_DEFAULT_BATCH, 25, 25, 1, NULL };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:u:n:b:a:r:S:d:")) != -1) {
+        switch (opt) {
+            case 's': cfg.sessions_n = atoi(optarg); break;
+            case 'u': cfg.users_n = atoi(optarg); break;
+            case 'n': cfg.messages = atol(optarg); break;
+            case 'b': cfg.batch = atoi(optarg); break;
+            case 'a': cfg.accept_pct = atoi(optarg); break;
+            case 'r': cfg.reject_pct = atoi(optarg); break;
+            case 'S': cfg.seed = (unsigned int)atoi(optarg); break;
+            case 'd': cfg.dir = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (cfg.users_n == 0) {
+        cfg.users_n = (cfg.sessions_n + 1) / 2;
+    }
+    if (cfg.sessions_n < 1 || cfg.sessions_n > MAX_CLIENTS || cfg.users_n < 1 || cfg.users_n > cfg.sessions_n ||
+        cfg.messages < 1 || cfg.batch < 1 || cfg.accept_pct < 0 || cfg.reject_pct < 0 || cfg.accept_pct + cfg.reject_pct > 100) {
+        usage(argv[0]);
+    }
+    users_n = cfg.users_n;
+    rng_state = 0x9E3779B97F4A7C15ULL ^ cfg.seed;
+
+    // The transfer log goes to tmpfs unless a directory is given, so the disk is not measured
+    char tmp_dir[] = "/dev/shm/route_bench.XXXXXX";
+    if (cfg.dir == NULL) {
+        if (mkdtemp(tmp_dir) == NULL) {
+            perror("mkdtemp");
+            exit(EXIT_FAILURE);
+        }
+        cfg.dir = tmp_dir;
+    }
+    root_dir_fd = open(cfg.dir, O_RDONLY | O_DIRECTORY);
+    if (root_dir_fd < 0) {
+        perror(cfg.dir);
+        exit(EXIT_FAILURE);
+    }
+
+    // The routing code logs every message on stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    pending = calloc(cfg.users_n, sizeof(bench_pending));
+    if (pending == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    server_pid = getpid();
+    init_shared_memory();
+    setup_sessions(cfg.sessions_n);
+    transfer_queue_init(root_dir_fd);
+
+    fprintf(out, "route_bench: %d sessions, %d users, %ld messages (%d%% ACCEPT, %d%% REJECT), batch %d, ring %d bytes\n",
+            cfg.sessions_n, cfg.users_n, cfg.messages, cfg.accept_pct, cfg.reject_pct, cfg.batch, IPC_RING_SIZE);
+    bench_handshake(cfg.sessions_n);
+    bench_routing(&cfg);
+
+    if (cfg.dir == tmp_dir) {
+        unlinkat(root_dir_fd, TRANSFER_LOG_FILE, 0);
+        unlinkat(root_dir_fd, TRANSFER_SNAPSHOT_FILE, 0);
+        rmdir(tmp_dir);
+    }
+    return 0;
+}
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE // O_PATH
+#include "server.h"
+#include "common.h"
+#include "path.h"
+#include "beneath.h"
+#include "concurrency.h"
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+
+extern int current_dir_fd;
+extern char root_dir_path[];
+extern char home_path[];
+extern size_t home_len;
+
+/*
+ * Confinement of the paths of the commands, enforced by the kernel.
+ * Paths are opened with openat2() and RESOLVE_BENEATH relative to the user's
+ * folder (or the root directory for cd and list): the kernel refuses any
+ * "..", absolute path or symlink that would leave it while it resolves the
+ * path, and RESOLVE_NO_MAGICLINKS refuses /proc style links. Operations
+ * that work on a name (mkdir, unlink, rename, chmod) open the parent
+ * directory that way and act on the last component.
+ * Kernels older than 5.6 have no openat2(): the lexical checks of
+ * check_path() and check_path_mine() are used instead, as before.
+ *
+ * The directories the paths go through are kept open in a small LRU cache
+ * of O_PATH handles, keyed by their path relative to the scope, so that
+ * the kernel only resolves the last component of a path in a deep tree.
+ * Moving or deleting a directory or a symlink bumps tree_version(), which
+ * empties the cache of every session.
+ */
+typedef struct {
+    int fd;                         // -1 if the entry is free
+    int scope;
+    unsigned long long used;        // Value of cache_clock at the last hit
+    size_t len;
+    char path[PATH_RESOLVED_MAX];   // Relative to the scope, without "." or ".." components
+} dir_handle;
+
+static int scope_fd[2] = { -1, -1 };
+static char scope_cwd[2][PATH_RESOLVED_MAX]; // Current directory relative to each scope, "." at its top
+static int have_openat2 = -1;                // Unknown until the first call
+
+static dir_handle cache[BENEATH_CACHE_SIZE];
+static unsigned long long cache_clock = 0;
+static unsigned long long cache_version = 0; // tree_version() the entries were opened at
+
+/*
+ * Opens the scope directories, at login.
+ */
+int beneath_init(int root_fd, const char *user){
+    scope_fd[BENEATH_ROOT] = openat(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    scope_fd[BENEATH_HOME] = openat(root_fd, user, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (scope_fd[BENEATH_ROOT] < 0 || scope_fd[BENEATH_HOME] < 0) {
+        perror("beneath_init");
+        return -1;
+    }
+    for (int i = 0; i < BENEATH_CACHE_SIZE; i++) {
+        cache[i].fd = -1;
+    }
+    cache_version = tree_version();
+    strcpy(scope_cwd[BENEATH_HOME], ".");
+    snprintf(scope_cwd[BENEATH_ROOT], PATH_RESOLVED_MAX, "%s", user);
+    return 0;
+}
+
+/*
+ * Records the new current directory, given resolved like current_dir_path.
+ * Called by cd, so that relative paths keep starting from it.
+ */
+void beneath_chdir(const char *resolved){
+    size_t root_len = strlen(root_dir_path);
+    const char *in_root = resolved + root_len;
+    while (*in_root == '/') in_root++;
+    snprintf(scope_cwd[BENEATH_ROOT], PATH_RESOLVED_MAX, "%s", *in_root ? in_root : ".");
+
+    size_t len = strlen(resolved);
+    if (path_within(resolved, len, home_path, home_len)) {
+        snprintf(scope_cwd[BENEATH_HOME], PATH_RESOLVED_MAX, "%s", len > home_len ? resolved + home_len + 1 : ".");
+    } else {
+        // Outside the user's folder: the kernel refuses what goes through here
+        if (snprintf(scope_cwd[BENEATH_HOME], PATH_RESOLVED_MAX, "../%s", scope_cwd[BENEATH_ROOT]) >= PATH_RESOLVED_MAX) {
+            strcpy(scope_cwd[BENEATH_HOME], "..");
+        }
+    }
+}
+
+/*
+ * Prefixes path with the current directory relative to the scope.
+ */
+static int scoped_path(int scope, const char *path, char *buf, size_t size){
+    const char *cwd = scope_cwd[scope];
+    int n = (strcmp(cwd, ".") == 0) ? snprintf(buf, size, "%s", path) : snprintf(buf, size, "%s/%s", cwd, path);
+    if (n < 0 || (size_t)n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Lexical check of the pre-openat2() kernels.
+ */
+static int lexical_check(int scope, const char *path){
+    if (scope == BENEATH_HOME ? check_path_mine((char *)path) : check_path((char *)path)) {
+        errno = EXDEV;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * openat2() with RESOLVE_BENEATH of dir_fd, and the extra resolve flags.
+ * Notes when the kernel has no openat2().
+ */
+static int open_resolve(int dir_fd, const char *path, int flags, mode_t mode, unsigned long long resolve){
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & (O_CREAT | O_TMPFILE)) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | resolve;
+    int fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        have_openat2 = 1;
+        return fd;
+    }
+    have_openat2 = 0;
+    printf("[PID: %d] openat2() not supported, paths are checked lexically\n", getpid());
+    return -1;
+}
+
+static int open_beneath(int dir_fd, const char *path, int flags, mode_t mode){
+    return open_resolve(dir_fd, path, flags, mode, 0);
+}
+
+/*
+ * Tells whether a directory path can be a cache key: no empty, "." or ".."
+ * component, whose meaning depends on the symlinks before them.
+ */
+static int cacheable(const char *dir, size_t len){
+    if (len == 0 || dir[0] == '/' || dir[len - 1] == '/') return 0;
+    const char *c = dir;
+    const char *end = dir + len;
+    while (c < end) {
+        const char *slash = memchr(c, '/', end - c);
+        size_t n = (slash ? slash : end) - c;
+        if (n == 0 || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.')) return 0;
+        c += n + 1;
+    }
+    return 1;
+}
+
+static void cache_flush(){
+    for (int i = 0; i < BENEATH_CACHE_SIZE; i++) {
+        if (cache[i].fd != -1) {
+            close(cache[i].fd);
+            cache[i].fd = -1;
+        }
+    }
+}
+
+/*
+ * Returns the cached handle of a directory of the scope, opening it on a miss
+ * in place of the least recently used entry. The handle belongs to the cache.
+ */
+static int dir_handle_get(int scope, const char *dir, size_t len){
+    unsigned long long version = tree_version();
+    if (version != cache_version) {
+        cache_flush();
+        cache_version = version;
+    }
+
+    int victim = 0;
+    for (int i = 0; i < BENEATH_CACHE_SIZE; i++) {
+        dir_handle *h = &cache[i];
+        if (h->fd != -1 && h->scope == scope && h->len == len && memcmp(h->path, dir, len) == 0) {
+            h->used = ++cache_clock;
+            return h->fd;
+        }
+        if (h->fd == -1 || (cache[victim].fd != -1 && h->used < cache[victim].used)) {
+            victim = i;
+        }
+    }
+
+    dir_handle *h = &cache[victim];
+    if (h->fd != -1) {
+        close(h->fd);
+        h->fd = -1;
+    }
+    memcpy(h->path, dir, len);
+    h->path[len] = '\0';
+    int fd = open_beneath(scope_fd[scope], h->path, O_PATH | O_DIRECTORY, 0);
+    if (fd < 0) return -1;
+    h->fd = fd;
+    h->scope = scope;
+    h->used = ++cache_clock;
+    h->len = len;
+    return fd;
+}
+
+/*
+ * Opens buf, a path relative to the scope, resolving only its last component
+ * when its directory is cached. A last component that is a symlink leaving
+ * that directory is resolved again from the top of the scope.
+ */
+static int open_scoped(int scope, const char *buf, int flags, mode_t mode){
+    const char *slash = strrchr(buf, '/');
+    if (slash != NULL && cacheable(buf, slash - buf) && strcmp(slash + 1, "..") != 0) {
+        int dir_fd = dir_handle_get(scope, buf, slash - buf);
+        if (dir_fd < 0) return -1;
+        const char *last = slash[1] ? slash + 1 : ".";
+        int fd = open_beneath(dir_fd, last, flags, mode);
+        if (fd >= 0 || errno != EXDEV) return fd;
+    }
+    return open_beneath(scope_fd[scope], buf, flags, mode);
+}
+
+/*
+ * openat() confined to a scope. path is relative to the current directory.
+ * Fails with EXDEV if it would resolve outside the scope.
+ */
+int beneath_open(int scope, const char *path, int flags, mode_t mode){
+    if (path[0] == '/') {
+        errno = EXDEV;
+        return -1;
+    }
+
+    if (have_openat2 != 0 && scope_fd[scope] >= 0) {
+        char buf[PATH_RESOLVED_MAX];
+        if (scoped_path(scope, path, buf, sizeof(buf)) < 0) return -1;
+
+        int fd = open_scoped(scope, buf, flags, mode);
+        if (have_openat2 != 0) return fd;
+    }
+
+    if (lexical_check(scope, path) < 0) return -1;
+    return openat(current_dir_fd, path, flags, mode);
+}
+
+/*
+ * Opens the directory holding the last component of path, confined to a
+ * scope, and copies that component to name. The *at() call that follows
+ * acts on name in the returned directory, without following it if it is a
+ * symlink. "." and ".." cannot be the last component.
+ * Returns a descriptor to close, or -1.
+ */
+int beneath_parent(int scope, const char *path, char *name, size_t size){
+    char dir[PATH_RESOLVED_MAX];
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--; // "a/b/" names b
+    if (len >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    char *slash = strrchr(dir, '/');
+    const char *last = slash ? slash + 1 : dir;
+    if (*last == '\0' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0 || strlen(last) >= size) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(name, last);
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        strcpy(dir, "/"); // absolute, refused by beneath_open()
+    } else {
+        *slash = '\0';
+    }
+
+    // The directory itself is what the cache holds, hand out a copy of its handle
+    if (have_openat2 == 1 && scope_fd[scope] >= 0 && dir[0] != '/') {
+        char buf[PATH_RESOLVED_MAX];
+        if (scoped_path(scope, dir, buf, sizeof(buf)) < 0) return -1;
+        size_t n = strlen(buf);
+        if (strcmp(buf, ".") == 0) {
+            return fcntl(scope_fd[scope], F_DUPFD_CLOEXEC, 0);
+        }
+        if (cacheable(buf, n)) {
+            int dir_fd = dir_handle_get(scope, buf, n);
+            return dir_fd < 0 ? -1 : fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+        }
+    }
+
+    return beneath_open(scope, dir, O_PATH | O_DIRECTORY, 0);
+}
+
+/*
+ * fstatat() confined to a scope, flags 0 or AT_SYMLINK_NOFOLLOW.
+ */
+int beneath_stat(int scope, const char *path, struct stat *st, int flags){
+    int fd = beneath_open(scope, path, O_PATH | ((flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0), 0);
+    if (fd < 0) return -1;
+    int ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Opens path under dir_fd without following any symlink, for walks that
+ * must stay in the directory they started from, and for the copies root
+ * makes in a user's folder. mode is used with O_CREAT.
+ * Without openat2() the path is opened one component at a time with O_NOFOLLOW.
+ */
+int beneath_openat(int dir_fd, const char *path, int flags, mode_t mode){
+    if (have_openat2 != 0) {
+        int fd = open_resolve(dir_fd, path, flags, mode, RESOLVE_NO_SYMLINKS);
+        if (have_openat2 != 0) return fd;
+    }
+
+    char buf[PATH_RESOLVED_MAX];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (buf[0] == '/') {
+        errno = EXDEV;
+        return -1;
+    }
+
+    int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    char *save = NULL;
+    char *name = strtok_r(buf, "/", &save);
+    while (fd >= 0 && name != NULL) {
+        char *next = strtok_r(NULL, "/", &save);
+        if (strcmp(name, "..") == 0) {
+            close(fd);
+            errno = EXDEV;
+            return -1;
+        }
+        int sub = (next == NULL) ? openat(fd, name, flags | O_NOFOLLOW | O_CLOEXEC, mode)
+                                 : openat(fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = sub;
+        name = next;
+    }
+
+    // O_PATH | O_NOFOLLOW opens a symlink itself, openat2() refuses it
+    struct stat st;
+    if (fd >= 0 && (flags & O_PATH) && fstat(fd, &st) == 0 && S_ISLNK(st.st_mode)) {
+        close(fd);
+        errno = ELOOP;
+        return -1;
+    }
+    return fd;
+}
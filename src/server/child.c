@@ -2,18 +2,22 @@
 #include "common.h"
 #include "users.h"
 #include "transfer.h"
+#include "concurrency.h"
+#include "user_store.h"
 #include <signal.h>
+#include <sys/eventfd.h>
 
 extern ClientSession sessions[MAX_CLIENTS];
 int sockfd;
-int pipe_read;
-int pipe_write;
+int pipe_read;    // Doorbell of the parent-to-session ring
+int pipe_write;   // Doorbell of the session-to-parent ring
+int session_slot; // Slot of this session, selects its rings
 
 /*
  * Manages a new client connection.
  * 1. Accepts the connection.
  * 2. Finds a free session slot.
- * 3. Creates pipes for Parent<->Child.
+ * 3. Resets the slot's message rings and creates their doorbells.
  * 4. Forks a child process to handle the session.
  * 5. Parent tracks the child pid/pipes.
  */
@@ -43,11 +47,18 @@ int handle_client(int server_socket) {
         return -1;
     }
 
-    // Create pipes
-    int p_to_c[2]; // Parent to Child
-    int c_to_p[2]; // Child to Parent
-    if (pipe(p_to_c) == -1 || pipe(c_to_p) == -1) {
-        perror("pipe");
+    // Reset the slot's rings, its previous session has been reaped
+    SessionChannel *channel = session_channel(slot);
+    ring_reset(&channel->to_child);
+    ring_reset(&channel->to_parent);
+
+    // Create doorbells, both processes keep both ends
+    int to_child_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int to_parent_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (to_child_bell == -1 || to_parent_bell == -1) {
+        perror("eventfd");
+        if (to_child_bell != -1) close(to_child_bell);
+        if (to_parent_bell != -1) close(to_parent_bell);
         close(client_socket);
         return -1;
     }
@@ -58,10 +69,8 @@ int handle_client(int server_socket) {
         // Fork failed
         perror("Fork failed");
         close(client_socket);
-        close(p_to_c[0]); 
-        close(p_to_c[1]);
-        close(c_to_p[0]); 
-        close(c_to_p[1]);
+        close(to_child_bell);
+        close(to_parent_bell);
         return -1;
     } else if (pid == 0) {
         // Child process
@@ -71,13 +80,10 @@ int handle_client(int server_socket) {
         signal(SIGINT, SIG_DFL);
         signal(SIGTERM, SIG_DFL);
 
-        // Setup pipes for child
-        close(p_to_c[1]); // Close write end of parent-to-child
-        close(c_to_p[0]); // Close read end of child-to-parent
-        
-        // Setup pipe file descriptors
-        pipe_read = p_to_c[0];
-        pipe_write = c_to_p[1];
+        // Setup doorbell file descriptors
+        pipe_read = to_child_bell;
+        pipe_write = to_parent_bell;
+        session_slot = slot;
 
         // If parent dies, send SIGKILL to this child
         prctl(PR_SET_PDEATHSIG, SIGKILL);
@@ -87,21 +93,18 @@ int handle_client(int server_socket) {
 
         sockfd = client_socket; 
         
-        retrive_users();
+        user_store_detach(); // the user directory is shared with the parent, see user_store.c
         handle_user();
         exit(0);
     } else {
         // Parent process
         close(client_socket); // Close client socket (child handles it)
         
-        // Setup pipes for parent
-        close(p_to_c[0]); // Close read end of parent-to-child
-        close(c_to_p[1]); // Close write end of child-to-parent
-
         sessions[slot].pid = pid;
-        sessions[slot].pipe_fd_read = c_to_p[0];  // Read from child
-        sessions[slot].pipe_fd_write = p_to_c[1]; // Write to child
-        printf("[PARENT] added session %d with pid %d and pipe fd %d %d\n", slot, pid, c_to_p[0], p_to_c[1]);
+        sessions[slot].pipe_fd_read = to_parent_bell; // Rung when the child writes
+        sessions[slot].pipe_fd_write = to_child_bell; // Rung when writing to the child
+        sessions[slot].next_session = -1;
+        printf("[PARENT] added session %d with pid %d and doorbells %d %d\n", slot, pid, to_parent_bell, to_child_bell);
 
         return 0; // Success
     }
@@ -212,7 +215,6 @@ int execute_command(char *command) {
             }
         } else*/
         if (strcmp(args[0], "login") == 0) { // login
-            retrive_users();
             if (!user_exists(args[1])) { // check if user exists
                 login(args[1]);
             }else{
@@ -1,10 +1,329 @@
 #include "concurrency.h"
+#include "transfer.h"
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#include <signal.h>
 
 static SharedState *shared_state = NULL;
+static int grant_fds[MAX_LOCKS]; // One eventfd per slot, inherited by every child
+static int session_notify = 0;   // Send "waiting to..." notices to the client
+static int session_pipe = -1;    // Parent pipe served while waiting for a lock
+
+/*
+ * Initializes a robust, process-shared mutex.
+ * If its holder dies, the next pthread_mutex_lock() returns EOWNERDEAD instead of hanging.
+ */
+static void init_robust_mutex(pthread_mutex_t *m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(m, &attr) != 0) {
+        perror("pthread_mutex_init failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Returns 1 if the process still exists.
+ * EPERM means it exists but belongs to another user.
+ */
+static int process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Microseconds elapsed on the monotonic clock.
+ */
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Milliseconds elapsed on the monotonic clock.
+ */
+static long long now_ms() {
+    return now_us() / 1000;
+}
+
+/*
+ * Returns the histogram bucket of a duration: 0 for 0us, b for [2^(b-1), 2^b) us.
+ */
+static int hist_bucket(unsigned long long us) {
+    int b = 0;
+    while (us > 0 && b < LOCK_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/*
+ * Adds to a shared counter without taking any lock.
+ */
+static void stat_add(unsigned long long *counter, unsigned long long v) {
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Converts an (offset, length) pair to the end of the range, 0 meaning "to end of file".
+ */
+static long long range_end(long long start, long long len) {
+    if (len <= 0 || start > RANGE_EOF - len) return RANGE_EOF;
+    return start + len;
+}
+
+/*
+ * Empties the interval tree of a slot and chains every node in the free list.
+ */
+static void range_reset(FileLock* lock) {
+    for (int i = 0; i < MAX_LOCK_RANGES; i++) {
+        lock->ranges[i].pid = 0;
+        lock->ranges[i].right = (i + 1 < MAX_LOCK_RANGES) ? i + 1 : -1;
+    }
+    lock->range_root = -1;
+    lock->range_free = 0;
+}
+
+/*
+ * Recomputes max_end of the nodes from i up to the root.
+ */
+static void range_fix_upwards(FileLock* lock, int i) {
+    LockRange *r = lock->ranges;
+    while (i != -1) {
+        r[i].max_end = r[i].end;
+        if (r[i].left != -1 && r[r[i].left].max_end > r[i].max_end) r[i].max_end = r[r[i].left].max_end;
+        if (r[i].right != -1 && r[r[i].right].max_end > r[i].max_end) r[i].max_end = r[r[i].right].max_end;
+        i = r[i].parent;
+    }
+}
+
+/*
+ * Inserts a held range in the interval tree, ordered by start.
+ * Returns the node index, -1 if the pool is full.
+ */
+static int range_insert(FileLock* lock, long long start, long long end, int exclusive) {
+    LockRange *r = lock->ranges;
+    int i = lock->range_free;
+    if (i == -1) return -1;
+    lock->range_free = r[i].right;
+
+    r[i].start = start;
+    r[i].end = end;
+    r[i].acquired_us = now_us();
+    r[i].pid = getpid();
+    r[i].exclusive = exclusive;
+    r[i].left = r[i].right = -1;
+
+    int parent = -1;
+    int cur = lock->range_root;
+    while (cur != -1) {
+        parent = cur;
+        cur = (start < r[cur].start) ? r[cur].left : r[cur].right;
+    }
+    r[i].parent = parent;
+    if (parent == -1) {
+        lock->range_root = i;
+    } else if (start < r[parent].start) {
+        r[parent].left = i;
+    } else {
+        r[parent].right = i;
+    }
+    range_fix_upwards(lock, i);
+    return i;
+}
+
+/*
+ * Puts subtree v in the place of node u.
+ */
+static void range_transplant(FileLock* lock, int u, int v) {
+    LockRange *r = lock->ranges;
+    int p = r[u].parent;
+    if (p == -1) {
+        lock->range_root = v;
+    } else if (r[p].left == u) {
+        r[p].left = v;
+    } else {
+        r[p].right = v;
+    }
+    if (v != -1) r[v].parent = p;
+}
+
+/*
+ * Unlinks node z from the interval tree and returns it to the free list.
+ */
+static void range_remove(FileLock* lock, int z) {
+    LockRange *r = lock->ranges;
+    int fix;
+
+    if (r[z].left == -1) {
+        fix = r[z].parent;
+        range_transplant(lock, z, r[z].right);
+    } else if (r[z].right == -1) {
+        fix = r[z].parent;
+        range_transplant(lock, z, r[z].left);
+    } else {
+        // Replace z with its successor y
+        int y = r[z].right;
+        while (r[y].left != -1) y = r[y].left;
+        if (r[y].parent != z) {
+            fix = r[y].parent;
+            range_transplant(lock, y, r[y].right);
+            r[y].right = r[z].right;
+            r[r[y].right].parent = y;
+        } else {
+            fix = y;
+        }
+        range_transplant(lock, z, y);
+        r[y].left = r[z].left;
+        r[r[y].left].parent = y;
+    }
+    range_fix_upwards(lock, fix);
+
+    r[z].pid = 0;
+    r[z].right = lock->range_free;
+    lock->range_free = z;
+}
+
+/*
+ * Returns 1 if a held range in subtree i overlaps [start, end) and is incompatible with the request.
+ * Subtrees whose max_end does not reach start, or that start after end, are skipped.
+ */
+static int range_conflict(FileLock* lock, int i, long long start, long long end, int exclusive) {
+    if (i == -1) return 0;
+    LockRange *n = &lock->ranges[i];
+    if (n->max_end <= start) return 0;
+    if (range_conflict(lock, n->left, start, end, exclusive)) return 1;
+    if (n->start < end && start < n->end && (exclusive || n->exclusive)) return 1;
+    if (n->start >= end) return 0;
+    return range_conflict(lock, n->right, start, end, exclusive);
+}
+
+/*
+ * Recomputes the slot counters from its owners table and interval tree.
+ */
+static void recount_slot(FileLock* lock) {
+    int exclusive = 0;
+    lock->usage_count = 0;
+    lock->shared_count = 0;
+    for (int i = 0; i < lock->owners_count; i++) {
+        lock->usage_count += lock->owners[i].refs;
+    }
+    for (int i = 0; i < MAX_LOCK_RANGES; i++) {
+        if (lock->ranges[i].pid == 0) continue;
+        if (lock->ranges[i].exclusive) exclusive++;
+        else lock->shared_count++;
+    }
+    if (__atomic_exchange_n(&lock->exclusive_count, exclusive, __ATOMIC_SEQ_CST) != exclusive) {
+        // A dead writer may have left the file half written
+        __atomic_add_fetch(&lock->version, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void notify_waiters(FileLock* lock);
+
+/*
+ * Removes owners, ranges and waiters that belong to a dead process, then rebuilds the counters.
+ * If dead_pid > 0 only that process is dropped, otherwise every holder is probed with kill(0).
+ * Must be called with lock->mutex held. Returns the number of entries dropped.
+ */
+static int sweep_slot(FileLock* lock, pid_t dead_pid) {
+    int dropped = 0;
+
+    for (int i = 0; i < lock->owners_count; ) {
+        pid_t pid = lock->owners[i].pid;
+        if ((dead_pid > 0) ? (pid == dead_pid) : !process_alive(pid)) {
+            lock->owners[i] = lock->owners[--lock->owners_count];
+            dropped++;
+        } else {
+            i++;
+        }
+    }
+    for (int i = 0; i < MAX_LOCK_RANGES; i++) {
+        pid_t pid = lock->ranges[i].pid;
+        if (pid == 0) continue;
+        if ((dead_pid > 0) ? (pid == dead_pid) : !process_alive(pid)) {
+            printf("[LOCK] Released %s [%lld, %lld) held by dead process %d\n",
+                   lock->filepath, lock->ranges[i].start, lock->ranges[i].end, pid);
+            range_remove(lock, i);
+            dropped++;
+        }
+    }
+    for (int i = 0; i < lock->waiters_count; ) {
+        pid_t pid = lock->waiters[i].pid;
+        if ((dead_pid > 0) ? (pid == dead_pid) : !process_alive(pid)) {
+            lock->waiters[i] = lock->waiters[--lock->waiters_count];
+        } else {
+            i++;
+        }
+    }
+
+    recount_slot(lock);
+    if (dropped > 0) {
+        notify_waiters(lock);
+    }
+    return dropped;
+}
+
+/*
+ * Locks the mutex of a slot.
+ * On EOWNERDEAD the previous holder died mid-update, so the state is rebuilt from the live owners.
+ */
+static void slot_mutex_lock(FileLock* lock) {
+    if (pthread_mutex_lock(&lock->mutex) == EOWNERDEAD) {
+        sweep_slot(lock, 0);
+        pthread_mutex_consistent(&lock->mutex);
+    }
+}
+
+static void slot_mutex_unlock(FileLock* lock) {
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/*
+ * Locks the global table mutex, repairing every slot if its previous holder died.
+ */
+static void global_mutex_lock() {
+    if (pthread_mutex_lock(&shared_state->global_lock) == EOWNERDEAD) {
+        for (int i = 0; i < MAX_LOCKS; i++) {
+            FileLock *lock = &shared_state->locks[i];
+            slot_mutex_lock(lock);
+            sweep_slot(lock, 0);
+            slot_mutex_unlock(lock);
+        }
+        pthread_mutex_consistent(&shared_state->global_lock);
+    }
+}
+
+static void global_mutex_unlock() {
+    pthread_mutex_unlock(&shared_state->global_lock);
+}
+
+/*
+ * Finds the owner entry of a process, creating it if requested.
+ * Must be called with lock->mutex held. Returns NULL if the table is full.
+ */
+static LockOwner* find_owner(FileLock* lock, pid_t pid, int create) {
+    for (int i = 0; i < lock->owners_count; i++) {
+        if (lock->owners[i].pid == pid) return &lock->owners[i];
+    }
+    if (!create || lock->owners_count >= MAX_LOCK_OWNERS) return NULL;
+
+    LockOwner *owner = &lock->owners[lock->owners_count++];
+    owner->pid = pid;
+    owner->refs = 0;
+    return owner;
+}
 
 /*
  * Initializes shared memory segment using mmap and sets up
- * global and per-file semaphores for concurrency control.
+ * the global and per-file robust mutexes for concurrency control.
+ * Also creates the per-slot eventfds used to deliver grant notifications.
  */
 void init_shared_memory() {
     // Create shared memory mapping
@@ -15,31 +334,59 @@ void init_shared_memory() {
     }
 
     // Initialize global lock
-    if (sem_init(&shared_state->global_lock, 1, 1) == -1) {
-        perror("sem_init global_lock failed");
-        exit(EXIT_FAILURE);
-    }
+    init_robust_mutex(&shared_state->global_lock);
 
     // Initialize all locks
     for (int i = 0; i < MAX_LOCKS; i++) {
         shared_state->locks[i].usage_count = 0;
-        shared_state->locks[i].readers_count = 0;
-        // Initialize semaphores as process-shared (2nd arg = 1)
-        if (sem_init(&shared_state->locks[i].mutex, 1, 1) == -1) {
-            perror("sem_init mutex failed");
-            exit(EXIT_FAILURE);
-        }
-        if (sem_init(&shared_state->locks[i].write_sem, 1, 1) == -1) {
-            perror("sem_init write_sem failed");
+        shared_state->locks[i].shared_count = 0;
+        shared_state->locks[i].exclusive_count = 0;
+        shared_state->locks[i].waiters_count = 0;
+        shared_state->locks[i].owners_count = 0;
+        range_reset(&shared_state->locks[i]);
+        init_robust_mutex(&shared_state->locks[i].mutex);
+
+        // Semaphore mode: each waiter consumes exactly one wakeup
+        grant_fds[i] = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+        if (grant_fds[i] == -1) {
+            perror("eventfd failed");
             exit(EXIT_FAILURE);
         }
     }
     printf("Shared memory initialized for concurrency control.\n");
 }
 
+/*
+ * Configures how this process behaves while waiting for a lock.
+ * notify_client: send "waiting to..." notices on the client socket.
+ * parent_fd: pipe whose messages keep being handled during the wait (-1 for none).
+ */
+void lock_set_session(int notify_client, int parent_fd) {
+    session_notify = notify_client;
+    session_pipe = parent_fd;
+}
+
+/*
+ * Takes a slot reference on behalf of the calling process.
+ * Must be called with the global lock held. Returns NULL if the owners table is full.
+ */
+static FileLock* ref_slot(FileLock* lock) {
+    slot_mutex_lock(lock);
+    LockOwner *owner = find_owner(lock, getpid(), 1);
+    if (owner == NULL) {
+        slot_mutex_unlock(lock);
+        fprintf(stderr, "Error: Too many processes on %s!\n", lock->filepath);
+        return NULL;
+    }
+    owner->refs++;
+    lock->usage_count++;
+    slot_mutex_unlock(lock);
+    return lock;
+}
+
 /*
  * Retrieves or creates a FileLock structure for a given path.
- * Uses a global semaphore to ensure thread-safe access to the lock array.
+ * Uses a global mutex to ensure thread-safe access to the lock array.
  */
 FileLock* get_file_lock(const char* path) {
     if (shared_state == NULL) {
@@ -47,117 +394,518 @@ FileLock* get_file_lock(const char* path) {
         return NULL;
     }
 
-    sem_wait(&shared_state->global_lock);
+    global_mutex_lock();
 
-    // Check if lock already exists for this path
+    // Check if lock already exists for this path (idle slots keep their path and stats)
     for (int i = 0; i < MAX_LOCKS; i++) {
-        if (shared_state->locks[i].usage_count > 0 && 
+        if (shared_state->locks[i].filepath[0] != '\0' &&
             strncmp(shared_state->locks[i].filepath, path, PATH_MAX) == 0) {
-            shared_state->locks[i].usage_count++;
-            sem_post(&shared_state->global_lock);
-            return &shared_state->locks[i];
+            FileLock *lock = ref_slot(&shared_state->locks[i]);
+            global_mutex_unlock();
+            return lock;
         }
     }
 
-    // Find a free slot
+    // Find a free slot: a never used one, otherwise the idle one with the fewest acquisitions
+    int victim = -1;
     for (int i = 0; i < MAX_LOCKS; i++) {
-        if (shared_state->locks[i].usage_count == 0) {
-            strncpy(shared_state->locks[i].filepath, path, PATH_MAX - 1);
-            shared_state->locks[i].filepath[PATH_MAX - 1] = '\0';
-            shared_state->locks[i].usage_count = 1;
-            shared_state->locks[i].readers_count = 0;
-            
-            // Reset semaphores
-            sem_destroy(&shared_state->locks[i].mutex);
-            sem_destroy(&shared_state->locks[i].write_sem);
-            sem_init(&shared_state->locks[i].mutex, 1, 1);
-            sem_init(&shared_state->locks[i].write_sem, 1, 1);
-
-            sem_post(&shared_state->global_lock);
-            return &shared_state->locks[i];
+        if (shared_state->locks[i].usage_count != 0) continue;
+        if (shared_state->locks[i].filepath[0] == '\0') {
+            victim = i;
+            break;
+        }
+        if (victim == -1 || shared_state->locks[i].stats.acquisitions < shared_state->locks[victim].stats.acquisitions) {
+            victim = i;
         }
     }
 
-    sem_post(&shared_state->global_lock);
-    fprintf(stderr, "Error: No more lock slots available!\n");
-    return NULL;
+    if (victim == -1) {
+        global_mutex_unlock();
+        fprintf(stderr, "Error: No more lock slots available!\n");
+        return NULL;
+    }
+
+    FileLock *lock = &shared_state->locks[victim];
+
+    // Optimistic readers scan the paths without the mutex, let them detect the change
+    __atomic_add_fetch(&shared_state->table_seq, 1, __ATOMIC_SEQ_CST);
+    strncpy(lock->filepath, path, PATH_MAX - 1);
+    lock->filepath[PATH_MAX - 1] = '\0';
+    __atomic_add_fetch(&shared_state->table_seq, 1, __ATOMIC_SEQ_CST);
+    lock->usage_count = 0;
+    lock->shared_count = 0;
+    lock->exclusive_count = 0;
+    lock->waiters_count = 0;
+    lock->owners_count = 0;
+    range_reset(lock);
+    memset(&lock->stats, 0, sizeof(LockStats));
+
+    // Drop wakeups left over from the previous owner of the slot
+    uint64_t stale;
+    while (read(grant_fds[victim], &stale, sizeof(stale)) > 0);
+
+    lock = ref_slot(lock);
+    global_mutex_unlock();
+    return lock;
 }
 
 /*
  * Releases a file lock.
- * Decreases the usage count and clears the path if the last user releases the lock.
+ * Decreases the usage count, the slot stays assigned to the path until it is reused.
  */
 void release_file_lock(FileLock* lock) {
     if (lock == NULL || shared_state == NULL) return;
 
-    sem_wait(&shared_state->global_lock);
-    
-    if (lock->usage_count > 0) {
+    global_mutex_lock();
+    slot_mutex_lock(lock);
+
+    LockOwner *owner = find_owner(lock, getpid(), 0);
+    if (owner != NULL && owner->refs > 0) {
+        owner->refs--;
         lock->usage_count--;
-        if (lock->usage_count == 0) {
-            memset(lock->filepath, 0, PATH_MAX);
+        if (owner->refs == 0) {
+            *owner = lock->owners[--lock->owners_count];
         }
     }
 
-    sem_post(&shared_state->global_lock);
+    slot_mutex_unlock(lock);
+    global_mutex_unlock();
 }
 
 /*
- * Acquires a read lock. Multiple readers can hold the lock simultaneously,
- * but the first reader blocks any writers.
+ * Returns the eventfd that receives grant notifications for this slot.
+ * It becomes readable whenever a holder releases a range while someone is queued.
  */
-void reader_lock(FileLock* lock) {
-    if (lock == NULL) return;
+int lock_wait_fd(FileLock* lock) {
+    return grant_fds[lock - shared_state->locks];
+}
 
-    int sem_value;
-    sem_getvalue(&lock->write_sem, &sem_value);
-    if (sem_value == 0) {
-        send_string("waiting to read...");
+/*
+ * Wakes every queued waiter of the slot. Must be called with lock->mutex held.
+ */
+static void notify_waiters(FileLock* lock) {
+    if (lock->waiters_count == 0) return;
+    uint64_t n = lock->waiters_count;
+    if (write(lock_wait_fd(lock), &n, sizeof(n)) != sizeof(n)) {
+        perror("eventfd write");
     }
+}
 
-    sem_wait(&lock->mutex);
-    lock->readers_count++;
-    if (lock->readers_count == 1) {
-        sem_wait(&lock->write_sem); // First reader blocks writers
+/*
+ * Registers the calling process in the wait queue of the slot.
+ * Returns 0 on success, -1 if the queue is full (the caller then falls back to polling).
+ */
+int lock_enqueue(FileLock* lock, int exclusive, long long start, long long end) {
+    if (lock == NULL) return -1;
+
+    int ret = -1;
+    slot_mutex_lock(lock);
+    if (lock->waiters_count < MAX_LOCK_WAITERS) {
+        LockWaiter *waiter = &lock->waiters[lock->waiters_count++];
+        waiter->pid = getpid();
+        waiter->exclusive = exclusive;
+        waiter->start = start;
+        waiter->end = end;
+        ret = 0;
     }
-    sem_post(&lock->mutex);
+    slot_mutex_unlock(lock);
+    return ret;
 }
 
 /*
- * Releases a read lock.
- * Decreases the reader count and releases the write semaphore if no readers remain.
+ * Removes the calling process from the wait queue of the slot.
  */
-void reader_unlock(FileLock* lock) {
+void lock_dequeue(FileLock* lock) {
     if (lock == NULL) return;
 
-    sem_wait(&lock->mutex);
-    lock->readers_count--;
-    if (lock->readers_count == 0) {
-        sem_post(&lock->write_sem); // Last reader releases writers
+    pid_t me = getpid();
+    slot_mutex_lock(lock);
+    for (int i = 0; i < lock->waiters_count; i++) {
+        if (lock->waiters[i].pid == me) {
+            lock->waiters[i] = lock->waiters[--lock->waiters_count];
+            break;
+        }
+    }
+    slot_mutex_unlock(lock);
+}
+
+/*
+ * Tries to lock the byte range [start, start + len) without blocking (len 0 = to end of file).
+ * Shared ranges may overlap each other, an exclusive range overlaps nothing.
+ * Returns 0 on success, -1 if an overlapping range is held or the range table is full.
+ */
+int range_trylock(FileLock* lock, long long start, long long len, int exclusive) {
+    if (lock == NULL) return 0;
+
+    long long end = range_end(start, len);
+    int ret = -1;
+    slot_mutex_lock(lock);
+    if (!range_conflict(lock, lock->range_root, start, end, exclusive) &&
+        range_insert(lock, start, end, exclusive) != -1) {
+        if (exclusive) {
+            // Count the writer first: a reader that sees the new version also sees it
+            // active, and the reads in flight fail validation before it touches the file
+            __atomic_add_fetch(&lock->exclusive_count, 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&lock->version, 1, __ATOMIC_SEQ_CST);
+        } else {
+            lock->shared_count++;
+        }
+        ret = 0;
+    }
+    slot_mutex_unlock(lock);
+    if (ret == 0) {
+        stat_add(&lock->stats.acquisitions, 1);
     }
-    sem_post(&lock->mutex);
+    return ret;
 }
 
 /*
- * Acquires a write lock. Blocks all other readers and writers.
+ * Releases a byte range previously locked by the calling process and wakes the waiters.
  */
-void writer_lock(FileLock* lock) {
+void range_unlock(FileLock* lock, long long start, long long len) {
     if (lock == NULL) return;
 
-    int sem_value;
-    sem_getvalue(&lock->write_sem, &sem_value);
-    if (sem_value == 0) {
-        send_string("waiting to write...");
+    long long end = range_end(start, len);
+    long long held_us = -1;
+    pid_t me = getpid();
+    slot_mutex_lock(lock);
+    for (int i = 0; i < MAX_LOCK_RANGES; i++) {
+        LockRange *r = &lock->ranges[i];
+        if (r->pid == me && r->start == start && r->end == end) {
+            if (r->exclusive) {
+                __atomic_sub_fetch(&lock->exclusive_count, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&lock->version, 1, __ATOMIC_SEQ_CST);
+            } else {
+                lock->shared_count--;
+            }
+            held_us = now_us() - r->acquired_us;
+            range_remove(lock, i);
+            notify_waiters(lock);
+            break;
+        }
     }
+    slot_mutex_unlock(lock);
 
-    sem_wait(&lock->write_sem);
+    if (held_us >= 0) {
+        stat_add(&lock->stats.hold_total_us, held_us);
+        stat_add(&lock->stats.hold_hist[hist_bucket(held_us)], 1);
+    }
 }
 
 /*
- * Releases a write lock.
- * Unblocks all readers and writers.
+ * Tries to acquire a whole-file read lock without blocking.
+ * Returns 0 on success, -1 if a writer holds any part of the file.
+ */
+int reader_trylock(FileLock* lock) {
+    return range_trylock(lock, 0, 0, 0);
+}
+
+/*
+ * Tries to acquire a whole-file write lock without blocking.
+ * Returns 0 on success, -1 if any range of the file is held.
+ */
+int writer_trylock(FileLock* lock) {
+    return range_trylock(lock, 0, 0, 1);
+}
+
+/*
+ * Releases the slot from holders that died without unlocking.
+ * Catches processes the server does not reap itself (e.g. background transfers).
+ */
+static void reap_dead_holders(FileLock* lock) {
+    global_mutex_lock();
+    slot_mutex_lock(lock);
+    sweep_slot(lock, 0);
+    slot_mutex_unlock(lock);
+    global_mutex_unlock();
+}
+
+/*
+ * Waits for a byte range without freezing the session.
+ * The process queues itself on the slot and sleeps in select() on the grant eventfd,
+ * meanwhile it keeps handling parent pipe messages (transfer notifications).
+ * Returns 0 once the range is held, -1 if timeout seconds elapse first (timeout <= 0 waits forever).
+ */
+int range_lock(FileLock* lock, long long start, long long len, int exclusive, int timeout) {
+    if (lock == NULL) return 0;
+    if (range_trylock(lock, start, len, exclusive) == 0) {
+        stat_add(&lock->stats.wait_hist[0], 1);
+        return 0;
+    }
+    long long wait_start = now_us();
+
+    if (session_notify) {
+        send_string(exclusive ? "waiting to write..." : "waiting to read...");
+    }
+
+    // Queue before re-checking, so a release after this point always wakes us
+    int queued = (lock_enqueue(lock, exclusive, start, range_end(start, len)) == 0);
+    int grant_fd = lock_wait_fd(lock);
+    long long deadline = now_ms() + (long long)timeout * 1000;
+
+    while (range_trylock(lock, start, len, exclusive) != 0) {
+        long long wait = LOCK_POLL_INTERVAL_MS;
+        if (timeout > 0) {
+            long long left = deadline - now_ms();
+            if (left <= 0) {
+                if (queued) lock_dequeue(lock);
+                stat_add(&lock->stats.timeouts, 1);
+                stat_add(&lock->stats.wait_total_us, now_us() - wait_start);
+                return -1;
+            }
+            if (left < wait) wait = left;
+        }
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(grant_fd, &readfds);
+        int max_fd = grant_fd;
+        if (session_pipe != -1) {
+            FD_SET(session_pipe, &readfds);
+            if (session_pipe > max_fd) max_fd = session_pipe;
+        }
+
+        struct timeval tv;
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+
+        int ret = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            if (queued) lock_dequeue(lock);
+            return -1;
+        }
+        if (ret == 0) {
+            reap_dead_holders(lock);
+            continue;
+        }
+
+        if (FD_ISSET(grant_fd, &readfds)) {
+            uint64_t token;
+            read(grant_fd, &token, sizeof(token)); // may lose the race to another waiter
+        }
+        if (session_pipe != -1 && FD_ISSET(session_pipe, &readfds)) {
+            child_handle_msg();
+        }
+    }
+
+    if (queued) lock_dequeue(lock);
+
+    long long waited_us = now_us() - wait_start;
+    stat_add(&lock->stats.contended, 1);
+    stat_add(&lock->stats.wait_total_us, waited_us);
+    stat_add(&lock->stats.wait_hist[hist_bucket(waited_us)], 1);
+    return 0;
+}
+
+/*
+ * Acquires a whole-file read lock, waiting at most timeout seconds.
+ * Returns 0 on success, -1 on timeout.
+ */
+int reader_lock(FileLock* lock, int timeout) {
+    return range_lock(lock, 0, 0, 0, timeout);
+}
+
+/*
+ * Releases a whole-file read lock.
+ */
+void reader_unlock(FileLock* lock) {
+    range_unlock(lock, 0, 0);
+}
+
+/*
+ * Acquires a whole-file write lock, waiting at most timeout seconds.
+ * Blocks all other readers and writers.
+ * Returns 0 on success, -1 on timeout.
+ */
+int writer_lock(FileLock* lock, int timeout) {
+    return range_lock(lock, 0, 0, 1, timeout);
+}
+
+/*
+ * Releases a whole-file write lock.
  */
 void writer_unlock(FileLock* lock) {
-    if (lock == NULL) return;
-    sem_post(&lock->write_sem);
+    range_unlock(lock, 0, 0);
+}
+
+/*
+ * Releases every range, slot reference and queued wait of a dead process.
+ * Called by the parent when it reaps a child, so the paths it held are usable immediately.
+ */
+void release_locks_of(pid_t pid) {
+    if (shared_state == NULL) return;
+
+    global_mutex_lock();
+    for (int i = 0; i < MAX_LOCKS; i++) {
+        FileLock *lock = &shared_state->locks[i];
+        if (lock->owners_count == 0 && lock->range_root == -1 && lock->waiters_count == 0) continue;
+
+        slot_mutex_lock(lock);
+        sweep_slot(lock, pid);
+        slot_mutex_unlock(lock);
+    }
+    global_mutex_unlock();
+}
+
+/*
+ * Orders slot snapshots by total wait time, then by contended acquisitions.
+ */
+static int compare_contention(const void *a, const void *b) {
+    const FileLock *la = a;
+    const FileLock *lb = b;
+    if (la->stats.wait_total_us != lb->stats.wait_total_us) {
+        return (la->stats.wait_total_us < lb->stats.wait_total_us) ? 1 : -1;
+    }
+    if (la->stats.contended != lb->stats.contended) {
+        return (la->stats.contended < lb->stats.contended) ? 1 : -1;
+    }
+    return (la->stats.acquisitions < lb->stats.acquisitions) ? 1 : (la->stats.acquisitions > lb->stats.acquisitions) ? -1 : 0;
+}
+
+/*
+ * Returns the upper bound in microseconds of the bucket holding the given percentile.
+ */
+static unsigned long long hist_percentile(const unsigned long long *hist, int pct) {
+    unsigned long long total = 0;
+    for (int b = 0; b < LOCK_HIST_BUCKETS; b++) total += hist[b];
+    if (total == 0) return 0;
+
+    unsigned long long target = (total * pct + 99) / 100;
+    unsigned long long seen = 0;
+    for (int b = 0; b < LOCK_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= target) return (b == 0) ? 0 : (1ULL << b);
+    }
+    return 1ULL << (LOCK_HIST_BUCKETS - 1);
+}
+
+/*
+ * Formats a byte range as [start, end) with EOF for open ranges.
+ */
+static void format_range(char *buf, size_t size, long long start, long long end) {
+    if (end == RANGE_EOF) snprintf(buf, size, "[%lld, EOF)", start);
+    else snprintf(buf, size, "[%lld, %lld)", start, end);
+}
+
+/*
+ * Prints the top_n most contended paths with their counters, current holders and waiters.
+ * Used by the "locks" admin command. Each slot is copied under its mutex, then printed.
+ */
+void dump_lock_stats(int top_n) {
+    if (shared_state == NULL) return;
+
+    FileLock *snapshot = malloc(sizeof(FileLock) * MAX_LOCKS);
+    if (snapshot == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    int count = 0;
+    global_mutex_lock();
+    for (int i = 0; i < MAX_LOCKS; i++) {
+        FileLock *lock = &shared_state->locks[i];
+        if (lock->filepath[0] == '\0') continue;
+        slot_mutex_lock(lock);
+        memcpy(&snapshot[count++], lock, sizeof(FileLock));
+        slot_mutex_unlock(lock);
+    }
+    global_mutex_unlock();
+
+    qsort(snapshot, count, sizeof(FileLock), compare_contention);
+    if (top_n > count) top_n = count;
+
+    printf("[LOCKS] %d paths tracked, top %d by wait time:\n", count, top_n);
+    for (int i = 0; i < top_n; i++) {
+        FileLock *lock = &snapshot[i];
+        LockStats *st = &lock->stats;
+        char range[64];
+
+        printf("%2d. %s\n", i + 1, lock->filepath);
+        printf("    acquisitions: %llu  contended: %llu  timeouts: %llu\n",
+               st->acquisitions, st->contended, st->timeouts);
+        printf("    wait: total %llums  p50 <= %lluus  p99 <= %lluus\n",
+               st->wait_total_us / 1000, hist_percentile(st->wait_hist, 50), hist_percentile(st->wait_hist, 99));
+        printf("    hold: total %llums  p50 <= %lluus  p99 <= %lluus\n",
+               st->hold_total_us / 1000, hist_percentile(st->hold_hist, 50), hist_percentile(st->hold_hist, 99));
+
+        for (int r = 0; r < MAX_LOCK_RANGES; r++) {
+            if (lock->ranges[r].pid == 0) continue;
+            format_range(range, sizeof(range), lock->ranges[r].start, lock->ranges[r].end);
+            printf("    holder: pid %d %s %s for %lldms\n", lock->ranges[r].pid,
+                   lock->ranges[r].exclusive ? "write" : "read", range,
+                   (now_us() - lock->ranges[r].acquired_us) / 1000);
+        }
+        for (int w = 0; w < lock->waiters_count; w++) {
+            format_range(range, sizeof(range), lock->waiters[w].start, lock->waiters[w].end);
+            printf("    waiter: pid %d %s %s\n", lock->waiters[w].pid,
+                   lock->waiters[w].exclusive ? "write" : "read", range);
+        }
+    }
+    free(snapshot);
+}
+
+/*
+ * Starts an optimistic (seqlock style) read of path, without taking any mutex.
+ * Captures the table sequence and the version of the slot tracking the path, if any.
+ * Returns 0 if the read may proceed, -1 if a writer is active and the caller must lock.
+ */
+int optimistic_read_begin(const char* path, ReadTicket* ticket) {
+    if (shared_state == NULL) return -1;
+
+    ticket->table_seq = __atomic_load_n(&shared_state->table_seq, __ATOMIC_ACQUIRE);
+    if (ticket->table_seq & 1) return -1; // a slot is being assigned right now
+
+    // A writer always holds a slot for its path, so no slot means no writer
+    ticket->lock = NULL;
+    ticket->version = 0;
+    for (int i = 0; i < MAX_LOCKS; i++) {
+        if (strncmp(shared_state->locks[i].filepath, path, PATH_MAX) == 0) {
+            ticket->lock = &shared_state->locks[i];
+            break;
+        }
+    }
+    if (ticket->lock == NULL) return 0;
+
+    ticket->version = __atomic_load_n(&ticket->lock->version, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ticket->lock->exclusive_count, __ATOMIC_ACQUIRE) > 0) return -1;
+    return 0;
+}
+
+/*
+ * Ends an optimistic read.
+ * Returns 0 if no writer held the path since optimistic_read_begin(), -1 if the data must be read again.
+ */
+int optimistic_read_validate(ReadTicket* ticket) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shared_state->table_seq, __ATOMIC_ACQUIRE) != ticket->table_seq) return -1;
+    if (ticket->lock == NULL) return 0;
+    if (__atomic_load_n(&ticket->lock->exclusive_count, __ATOMIC_ACQUIRE) > 0) return -1;
+    if (__atomic_load_n(&ticket->lock->version, __ATOMIC_ACQUIRE) != ticket->version) return -1;
+    return 0;
+}
+
+/*
+ * Returns the message rings of a session slot.
+ */
+SessionChannel* session_channel(int slot) {
+    return &shared_state->channels[slot];
+}
+
+/*
+ * Version of the directory tree, sessions drop their cached directory
+ * handles when it changes (see beneath.c).
+ */
+unsigned long long tree_version() {
+    if (shared_state == NULL) return 0;
+    return __atomic_load_n(&shared_state->tree_version, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called after a directory or a symlink was moved or deleted.
+ */
+void tree_changed() {
+    if (shared_state == NULL) return;
+    __atomic_add_fetch(&shared_state->tree_version, 1, __ATOMIC_SEQ_CST);
 }
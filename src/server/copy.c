@@ -0,0 +1,748 @@
+#define _GNU_SOURCE // copy_file_range()
+#include "server.h"
+#include "common.h"
+#include "transfer.h"
+#include "copy.h"
+#include "quota.h"
+#include "beneath.h"
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
+
+extern int root_dir_fd;
+extern char root_dir_path[];
+
+copy_worker copy_workers[COPY_WORKERS];
+copy_queue *copy_queue_head = NULL;
+copy_queue *copy_queue_tail = NULL;
+static int worker_fd = -1;     // In a worker: its end of the socketpair
+static int worker_job_id = 0;  // In a worker: the job being copied
+
+/*
+ * Tells whether a failed copy syscall means "not supported here" rather than an I/O error.
+ */
+static int copy_unsupported(int err){
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY || err == EPERM;
+}
+
+/*
+ * Copies the remaining contents of src_fd into dest_fd, from the current offsets.
+ * Tries the cheapest engine first and falls back on the next one:
+ * 1. FICLONE reflink, shares the extents, O(1) on btrfs/XFS
+ * 2. copy_file_range(), in-kernel copy, server-side on NFS/CIFS
+ * 3. sendfile(), in-kernel copy through the page cache
+ * 4. read()/write() loop
+ * dest_fd must be empty. Returns 0 on success, -1 on error.
+ */
+int copy_fd_data(int src_fd, int dest_fd){
+    ssize_t n;
+    int copied = 0; // 1 once an engine moved bytes, a later fallback continues from there
+
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+
+    while ((n = copy_file_range(src_fd, NULL, dest_fd, NULL, COPY_CHUNK, 0)) > 0) {
+        copied = 1;
+    }
+    if (n == 0 && copied) {
+        return 0;
+    }
+    if (n < 0 && !copy_unsupported(errno)) {
+        perror("copy_file_range");
+        return -1;
+    }
+    // n == 0 without progress may be a pseudo file that reports size 0, let the next engines check
+
+    while ((n = sendfile(dest_fd, src_fd, NULL, COPY_CHUNK)) > 0) {
+        copied = 1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (!copy_unsupported(errno)) {
+        perror("sendfile");
+        return -1;
+    }
+
+    char buffer[COPY_BUFFER_SIZE];
+    while ((n = read(src_fd, buffer, sizeof(buffer))) > 0) {
+        if (write_n(dest_fd, buffer, n) < 0) {
+            return -1;
+        }
+    }
+    if (n < 0) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Tells whether the last component of a path is a glob pattern.
+ */
+int copy_is_glob(const char *path){
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    return strpbrk(name, "*?[") != NULL;
+}
+
+/*
+ * Appends an entry to a tree copy.
+ */
+static copy_item *set_add(copy_set *set, const char *source, const char *dest, int dir){
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 256;
+        copy_item *items = realloc(set->items, capacity * sizeof(copy_item));
+        if (items == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+    copy_item *item = &set->items[set->count++];
+    memset(item, 0, sizeof(*item));
+    strncpy(item->source, source, PATH_LENGTH - 1);
+    strncpy(item->dest, dest, PATH_LENGTH - 1);
+    item->dir = dir;
+    if (!dir) set->files++;
+    return item;
+}
+
+/*
+ * Opens the folder of user and points rel to the part of path below it.
+ * path was resolved under that folder by the user's session.
+ */
+static int open_user_home(const char *path, const char *user, const char **rel){
+    size_t root_len = strlen(root_dir_path);
+    size_t user_len = strlen(user);
+    const char *name = path + root_len + 1;
+    if (user_len == 0 || strncmp(path, root_dir_path, root_len) != 0 || path[root_len] != '/' ||
+        strncmp(name, user, user_len) != 0 || (name[user_len] != '/' && name[user_len] != '\0')) {
+        printf("[COPY] %s is not in the folder of %s\n", path, user);
+        errno = EXDEV;
+        return -1;
+    }
+    *rel = name + user_len;
+    while (**rel == '/') (*rel)++;
+    if (**rel == '\0') *rel = ".";
+    return openat(root_dir_fd, user, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/*
+ * Opens the directory holding rel, a path in the receiver's folder, without
+ * following any symlink, and copies its last component to name.
+ * Returns a descriptor to close, or -1.
+ */
+static int open_dest_parent(int home_fd, const char *rel, char *name, size_t size){
+    char dir[PATH_LENGTH];
+    snprintf(dir, sizeof(dir), "%s", rel);
+    char *slash = strrchr(dir, '/');
+    const char *last = slash ? slash + 1 : dir;
+    if (*last == '\0' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0 || strlen(last) >= size) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(name, last);
+    if (slash == NULL) {
+        return fcntl(home_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    *slash = '\0';
+    return beneath_openat(home_fd, dir, O_PATH | O_DIRECTORY, 0);
+}
+
+/*
+ * Opens path, a path in the folder of user, without following any symlink.
+ * The path is resolved beneath that folder, like the entries of a tree copy:
+ * the sender's source is opened this way, and the receiver's destination of
+ * a single-file copy.
+ */
+static int open_in_home(const char *path, const char *user, int flags, mode_t mode){
+    const char *rel;
+    int home_fd = open_user_home(path, user, &rel);
+    if (home_fd < 0) return -1;
+    int fd = beneath_openat(home_fd, rel, flags, mode);
+    int err = errno;
+    close(home_fd);
+    errno = err;
+    return fd;
+}
+
+/*
+ * Opens the source of a transfer in the sender's folder.
+ */
+int copy_open_source(const char *source, const char *sender, int flags){
+    return open_in_home(source, sender, flags, 0);
+}
+
+/*
+ * Opens the destination of a single-file copy in the receiver's folder.
+ */
+int copy_open_dest(const char *dest, const char *receiver, int flags, mode_t mode){
+    return open_in_home(dest, receiver, flags, mode);
+}
+
+/*
+ * Looks up rel in the receiver's folder.
+ * Returns 0 and fills st if it exists, 1 if it does not, -1 if it cannot be
+ * used (e.g. there is a symlink on the way).
+ */
+static int dest_lookup(copy_set *set, const char *rel, struct stat *st){
+    int fd = beneath_openat(set->home_fd, rel, O_PATH, 0);
+    if (fd < 0) return errno == ENOENT ? 1 : -1;
+    int ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Plans the creation of a destination directory, unless it is there already.
+ */
+static int plan_dir(copy_set *set, const char *dest, mode_t mode){
+    struct stat st;
+    int found = dest_lookup(set, dest, &st);
+    if (found < 0 || (found == 0 && !S_ISDIR(st.st_mode))) {
+        printf("[COPY] Cannot copy a directory to %s\n", dest);
+        return -1;
+    }
+    copy_item *item = set_add(set, "", dest, 1);
+    if (item == NULL) return -1;
+    item->mode = mode & 0777;
+    item->inodes = found;
+    set->inodes += item->inodes;
+    return 0;
+}
+
+/*
+ * Plans the copy of a file. It replaces the file already at dest, if any,
+ * which the quota of the receiver takes into account.
+ */
+static int plan_file(copy_set *set, const char *source, const char *dest, long long size){
+    struct stat st;
+    int found = dest_lookup(set, dest, &st);
+    if (found < 0 || (found == 0 && !S_ISREG(st.st_mode))) {
+        printf("[COPY] Cannot copy a file to %s\n", dest);
+        return -1;
+    }
+    copy_item *item = set_add(set, source, dest, 0);
+    if (item == NULL) return -1;
+    item->bytes = size - (found == 0 ? (long long)st.st_size : 0);
+    item->inodes = found;
+    set->bytes += item->bytes;
+    set->inodes += item->inodes;
+    return 0;
+}
+
+/*
+ * Walks a source directory (source is relative to set->src_fd, "" for its top),
+ * planning its directories and files under dest. Entries whose name does not
+ * match pattern are skipped (only at this level, pattern is NULL below).
+ * Symlinks and special files are not copied. Nothing is created yet.
+ */
+static int collect_dir(copy_set *set, const char *source, const char *dest, const char *pattern){
+    int fd = source[0] ? beneath_openat(set->src_fd, source, O_RDONLY | O_DIRECTORY, 0) : openat(set->src_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        perror("[COPY] opendir");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct dirent *entry;
+    int ret = 0;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (pattern != NULL && fnmatch(pattern, entry->d_name, FNM_PERIOD) != 0) continue;
+
+        char src_path[PATH_LENGTH], dst_path[PATH_LENGTH];
+        int n = source[0] ? snprintf(src_path, sizeof(src_path), "%s/%s", source, entry->d_name)
+                          : snprintf(src_path, sizeof(src_path), "%s", entry->d_name);
+        int m = strcmp(dest, ".") != 0 ? snprintf(dst_path, sizeof(dst_path), "%s/%s", dest, entry->d_name)
+                                       : snprintf(dst_path, sizeof(dst_path), "%s", entry->d_name);
+        if (n >= (int)sizeof(src_path) || m >= (int)sizeof(dst_path)) {
+            printf("[COPY] Path too long: %s\n", entry->d_name);
+            ret = -1;
+            break;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            perror("[COPY] fstatat");
+            ret = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (plan_dir(set, dst_path, st.st_mode) < 0 || collect_dir(set, src_path, dst_path, NULL) < 0) {
+                ret = -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret = plan_file(set, src_path, dst_path, st.st_size);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+/*
+ * Temporary name of the file of item idx, in its destination directory.
+ */
+static void tmp_name(char *buf, size_t size, int idx){
+    snprintf(buf, size, COPY_TMP_PREFIX "%d-%d", getpid(), idx);
+}
+
+/*
+ * Creates a planned directory, owned by the receiver.
+ */
+static int make_dest_dir(copy_set *set, copy_item *item){
+    if (!item->inodes) return 0; // it was there already
+
+    char name[NAME_MAX + 1];
+    int dir_fd = open_dest_parent(set->home_fd, item->dest, name, sizeof(name));
+    if (dir_fd < 0) {
+        perror("[COPY] destination directory");
+        return -1;
+    }
+    int ret = -1;
+    if (mkdirat(dir_fd, name, item->mode) == 0) {
+        item->state = 1;
+        int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            ret = fchown(fd, set->uid, set->gid);
+            if (ret < 0) perror("[COPY] fchown");
+            close(fd);
+        }
+    } else {
+        perror("[COPY] mkdirat");
+    }
+    close(dir_fd);
+    return ret;
+}
+
+/*
+ * Copy thread: copies the files of the set under their temporary name until
+ * none is left.
+ */
+static void *copy_thread(void *arg){
+    copy_set *set = arg;
+    int idx;
+
+    while ((idx = __atomic_fetch_add(&set->next, 1, __ATOMIC_RELAXED)) < set->count) {
+        copy_item *item = &set->items[idx];
+        if (item->dir) continue;
+
+        char name[NAME_MAX + 1], tmp[64];
+        tmp_name(tmp, sizeof(tmp), idx);
+        int ok = 0;
+        int src_fd = beneath_openat(set->src_fd, item->source, O_RDONLY, 0);
+        int dir_fd = (src_fd >= 0) ? open_dest_parent(set->home_fd, item->dest, name, sizeof(name)) : -1;
+        if (dir_fd >= 0) {
+            int dest_fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0664);
+            if (dest_fd >= 0) {
+                ok = copy_fd_data(src_fd, dest_fd) == 0;
+                if (ok && fchown(dest_fd, set->uid, set->gid) < 0) {
+                    perror("[COPY] fchown");
+                    ok = 0;
+                }
+                close(dest_fd);
+                if (ok) {
+                    item->state = 1;
+                } else {
+                    unlinkat(dir_fd, tmp, 0);
+                }
+            }
+            close(dir_fd);
+        }
+        if (src_fd >= 0) close(src_fd);
+        if (!ok) {
+            printf("[COPY] Failed to copy %s\n", item->source);
+            __atomic_fetch_add(&set->failed, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&set->done, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * Gives the copied files their names, once every file was copied.
+ * A file that cannot be renamed is dropped and its charge refunded to owner.
+ * Returns the number of such files.
+ */
+static int commit_files(copy_set *set, const char *owner){
+    int failed = 0;
+    for (int i = 0; i < set->count; i++) {
+        copy_item *item = &set->items[i];
+        if (item->dir || !item->state) continue;
+
+        char name[NAME_MAX + 1], tmp[64];
+        tmp_name(tmp, sizeof(tmp), i);
+        int dir_fd = open_dest_parent(set->home_fd, item->dest, name, sizeof(name));
+        if (dir_fd >= 0 && renameat(dir_fd, tmp, dir_fd, name) == 0) {
+            close(dir_fd);
+            continue;
+        }
+        perror("[COPY] renameat");
+        if (dir_fd >= 0) {
+            unlinkat(dir_fd, tmp, 0);
+            close(dir_fd);
+        }
+        quota_charge(owner, -item->bytes, -item->inodes);
+        failed++;
+    }
+    return failed;
+}
+
+/*
+ * Undoes a tree copy that failed: deletes the copied files and the created
+ * directories, newest first, and refunds their charge to owner.
+ * A directory the receiver filled meanwhile stays, and stays charged.
+ */
+static void rollback(copy_set *set, const char *owner){
+    long long bytes = 0, inodes = 0;
+    for (int i = set->count - 1; i >= 0; i--) {
+        copy_item *item = &set->items[i];
+        char name[NAME_MAX + 1], tmp[64];
+        if (item->state) {
+            int dir_fd = open_dest_parent(set->home_fd, item->dest, name, sizeof(name));
+            if (dir_fd < 0) continue;
+            tmp_name(tmp, sizeof(tmp), i);
+            int ret = item->dir ? unlinkat(dir_fd, name, AT_REMOVEDIR) : unlinkat(dir_fd, tmp, 0);
+            close(dir_fd);
+            if (ret < 0) {
+                perror("[COPY] rollback");
+                continue;
+            }
+        }
+        bytes += item->bytes;
+        inodes += item->inodes;
+    }
+    quota_charge(owner, -bytes, -inodes);
+}
+
+/*
+ * Sends a progress report of the current job to the parent.
+ */
+static void send_progress(int done, int total){
+    if (worker_fd < 0) return;
+
+    copy_result res;
+    memset(&res, 0, sizeof(res));
+    res.id = worker_job_id;
+    res.done = done;
+    res.total = total;
+    res.final = 0;
+    send(worker_fd, &res, sizeof(res), MSG_NOSIGNAL);
+}
+
+/*
+ * Copies a directory tree, or the entries matching a glob, into the dest directory,
+ * as one unit:
+ * 1. the tree is walked and the copy planned, nothing is created
+ * 2. the copy is charged to the quota of owner
+ * 3. the directories are created, then COPY_THREADS threads copy the files
+ *    under temporary names through copy_fd_data(), while this thread reports progress
+ * 4. if every file was copied they get their names, otherwise everything
+ *    created is deleted and the charge refunded
+ * Everything in dest is opened relative to the receiver's folder, and the
+ * source directory (the parent of a glob) relative to the sender's folder,
+ * without following symlinks, see beneath_openat().
+ * Must run with root privileges. Returns 0 if every file was copied.
+ */
+int copy_tree(const char *source, const char *dest, const char *sender, const char *owner, uid_t uid, gid_t gid){
+    copy_set set;
+    memset(&set, 0, sizeof(set));
+    set.uid = uid;
+    set.gid = gid;
+
+    char dir[PATH_LENGTH];
+    const char *pattern = NULL;
+    strncpy(dir, source, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    if (copy_is_glob(source)) {
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) return -1;
+        *slash = '\0';
+        pattern = source + (slash - dir) + 1;
+    }
+
+    // A destination inside the source would be walked while it is filled
+    size_t dir_len = strlen(dir);
+    if (strncmp(dest, dir, dir_len) == 0 && (dest[dir_len] == '/' || dest[dir_len] == '\0')) {
+        printf("[COPY] Destination %s is inside %s\n", dest, dir);
+        return -1;
+    }
+
+    struct stat st;
+    const char *rel;
+    set.src_fd = open_in_home(dir, sender, O_RDONLY | O_DIRECTORY, 0);
+    set.home_fd = open_user_home(dest, owner, &rel);
+    int ret = -1;
+    if (set.src_fd < 0 || set.home_fd < 0 || fstat(set.src_fd, &st) < 0) {
+        perror("[COPY] source or destination directory");
+    } else if (plan_dir(&set, rel, st.st_mode) == 0 && collect_dir(&set, "", rel, pattern) == 0) {
+        ret = 0;
+    }
+    printf("[COPY] %d files to copy from %s to %s\n", set.files, source, dest);
+
+    if (ret == 0 && quota_charge(owner, set.bytes, set.inodes) < 0) {
+        printf("[COPY] Quota of %s exceeded, %lld bytes in %lld new files and directories\n", owner, set.bytes, set.inodes);
+        ret = -1;
+    } else if (ret == 0) {
+        for (int i = 0; i < set.count && ret == 0; i++) {
+            if (set.items[i].dir) ret = make_dest_dir(&set, &set.items[i]);
+        }
+
+        pthread_t threads[COPY_THREADS];
+        int started = 0;
+        for (int t = 0; ret == 0 && t < COPY_THREADS && t < set.files; t++) {
+            if (pthread_create(&threads[t], NULL, copy_thread, &set) != 0) {
+                perror("pthread_create");
+                break;
+            }
+            started++;
+        }
+        if (ret == 0 && started == 0) {
+            copy_thread(&set); // no thread could start, copy from here
+        }
+
+        // Report progress until every file is done
+        int done;
+        while (ret == 0 && (done = __atomic_load_n(&set.done, __ATOMIC_ACQUIRE)) < set.files) {
+            send_progress(done, set.files);
+            struct timespec ts = { COPY_PROGRESS_INTERVAL_MS / 1000, (COPY_PROGRESS_INTERVAL_MS % 1000) * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        if (ret == 0 && set.failed == 0) {
+            int lost = commit_files(&set, owner);
+            if (lost > 0) {
+                printf("[COPY] %d of %d files could not be given their name\n", lost, set.files);
+                ret = -1;
+            }
+        } else {
+            printf("[COPY] Undoing the copy of %s, %d of %d files failed\n", source, set.failed, set.files);
+            rollback(&set, owner);
+            ret = -1;
+        }
+    }
+
+    if (set.src_fd >= 0) close(set.src_fd);
+    if (set.home_fd >= 0) close(set.home_fd);
+    free(set.items);
+    return ret;
+}
+
+/*
+ * Body of a copy worker.
+ * Receives jobs from the parent, performs them and reports the result.
+ * Runs with the server's saved root credentials, like the parent.
+ */
+static void copy_worker_main(int fd){
+    copy_job job;
+    copy_result res;
+
+    worker_fd = fd;
+
+    while (1) {
+        ssize_t n = recv(fd, &job, sizeof(job), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            _exit(0); // parent is gone
+        }
+        if ((size_t)n < sizeof(job)) {
+            continue;
+        }
+
+        memset(&res, 0, sizeof(res));
+        res.id = job.id;
+        res.final = 1;
+        worker_job_id = job.id;
+        res.status = perform_transfer(job.source, job.dest, job.sender, job.receiver, job.group);
+        fflush(stdout);
+        if (send(fd, &res, sizeof(res), MSG_NOSIGNAL) < 0) {
+            _exit(0);
+        }
+    }
+}
+
+/*
+ * Forks the worker of slot w.
+ */
+static int spawn_worker(int w){
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork copy worker");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+
+        // Don't keep the other channels open, their peers rely on EOF
+        for (int k = 0; k < COPY_WORKERS; k++) {
+            if (copy_workers[k].fd != -1) close(copy_workers[k].fd);
+        }
+        for (int k = 0; k < MAX_CLIENTS; k++) {
+            if (sessions[k].pid != -1) {
+                close(sessions[k].pipe_fd_read);
+                close(sessions[k].pipe_fd_write);
+            }
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // If parent dies, send SIGKILL to this worker
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1) {
+            _exit(0);
+        }
+        copy_worker_main(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    copy_workers[w].pid = pid;
+    copy_workers[w].fd = sv[0];
+    copy_workers[w].busy = 0;
+    printf("[PARENT] copy worker %d started with pid %d\n", w, pid);
+    return 0;
+}
+
+/*
+ * Starts the copy workers.
+ */
+int copy_pool_init(){
+    for (int w = 0; w < COPY_WORKERS; w++) {
+        copy_workers[w].pid = -1;
+        copy_workers[w].fd = -1;
+        copy_workers[w].busy = 0;
+    }
+    for (int w = 0; w < COPY_WORKERS; w++) {
+        if (spawn_worker(w) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Hands a job to worker w.
+ */
+static int dispatch(int w, copy_job *job){
+    if (send(copy_workers[w].fd, job, sizeof(*job), MSG_NOSIGNAL) < 0) {
+        perror("send copy job");
+        return -1;
+    }
+    memcpy(&copy_workers[w].job, job, sizeof(*job));
+    copy_workers[w].busy = 1;
+    return 0;
+}
+
+/*
+ * Gives queued jobs to the idle workers.
+ */
+static void dispatch_queued(){
+    for (int w = 0; w < COPY_WORKERS && copy_queue_head != NULL; w++) {
+        if (copy_workers[w].fd == -1 || copy_workers[w].busy) continue;
+
+        copy_queue *q = copy_queue_head;
+        copy_queue_head = q->next;
+        if (copy_queue_head == NULL) copy_queue_tail = NULL;
+
+        if (dispatch(w, &q->job) < 0) {
+            transfer_copy_done(q->job.id, -1);
+        }
+        free(q);
+    }
+}
+
+/*
+ * Queues a copy. It starts as soon as a worker is idle, completion is
+ * reported through transfer_copy_done().
+ */
+int copy_pool_submit(int id, int group, const char *source, const char *dest, const char *sender, const char *receiver){
+    copy_queue *q = calloc(1, sizeof(copy_queue));
+    if (q == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    q->job.id = id;
+    q->job.group = group;
+    strncpy(q->job.source, source, PATH_LENGTH - 1);
+    strncpy(q->job.dest, dest, PATH_LENGTH - 1);
+    strncpy(q->job.sender, sender, USERNAME_LENGTH - 1);
+    strncpy(q->job.receiver, receiver, USERNAME_LENGTH - 1);
+
+    if (copy_queue_tail == NULL) {
+        copy_queue_head = q;
+    } else {
+        copy_queue_tail->next = q;
+    }
+    copy_queue_tail = q;
+
+    dispatch_queued();
+    return 0;
+}
+
+/*
+ * Adds the worker channels to the parent's select set.
+ */
+void copy_pool_fdset(fd_set *set, int *max_fd){
+    for (int w = 0; w < COPY_WORKERS; w++) {
+        if (copy_workers[w].fd != -1) {
+            FD_SET(copy_workers[w].fd, set);
+            if (copy_workers[w].fd > *max_fd) {
+                *max_fd = copy_workers[w].fd;
+            }
+        }
+    }
+}
+
+/*
+ * Collects finished copies.
+ * A worker that died fails its job and is replaced.
+ */
+void copy_pool_handle(fd_set *set){
+    for (int w = 0; w < COPY_WORKERS; w++) {
+        if (copy_workers[w].fd == -1 || !FD_ISSET(copy_workers[w].fd, set)) continue;
+
+        copy_result res;
+        ssize_t n = recv(copy_workers[w].fd, &res, sizeof(res), MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+        if (n == (ssize_t)sizeof(res)) {
+            if (!res.final) {
+                transfer_copy_progress(res.id, res.done, res.total);
+                continue;
+            }
+            copy_workers[w].busy = 0;
+            transfer_copy_done(res.id, res.status);
+            continue;
+        }
+
+        printf("[PARENT] copy worker %d (pid %d) exited\n", w, copy_workers[w].pid);
+        close(copy_workers[w].fd);
+        copy_workers[w].fd = -1;
+        copy_workers[w].pid = -1;
+        if (copy_workers[w].busy) {
+            copy_workers[w].busy = 0;
+            transfer_copy_done(copy_workers[w].job.id, -1);
+        }
+        spawn_worker(w);
+    }
+    dispatch_queued();
+}
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE // statx()
+#include "server.h"
+#include "common.h"
+#include "path.h"
+#include "transfer.h"
+#include "dircache.h"
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+extern int root_dir_fd;
+extern char root_dir_path[];
+extern char current_dir_path[];
+
+/*
+ * Metadata of the directories the sessions list, shared by all of them.
+ * A session that lists a directory in full serves it from its slot when the
+ * slot is up to date, otherwise it reads it from disk and fills the slot on
+ * the way. The parent keeps an inotify watch on every cached directory and
+ * gives its slot a new generation at each event, which makes the entries
+ * stale. Sessions ask for the watch with a WATCH_DIR message and only fill
+ * a slot once it is watched, so a change made while the entries are read is
+ * always seen. The first listing doesn't wait for the watch: a directory is
+ * served from memory from its third listing on.
+ */
+static dircache_table *table = NULL;
+static int inotify_fd = -1;                // Parent only
+static int slot_wd[DIRCACHE_DIRS];         // Parent only, watch of each slot, -1 if none
+static unsigned long long fill_generation; // Session only, generation of the slot being filled
+static int fill_overflow;                  // Session only, the directory has too many entries
+
+/*
+ * Creates the shared table and the inotify instance, before the sessions are forked.
+ */
+int dircache_init(){
+    table = mmap(NULL, sizeof(dircache_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap dircache");
+        table = NULL;
+        return -1;
+    }
+    for (int i = 0; i < DIRCACHE_DIRS; i++) {
+        slot_wd[i] = -1;
+    }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1, listings are not cached");
+    }
+    return 0;
+}
+
+static unsigned long long next_generation(){
+    return __atomic_add_fetch(&table->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Parent: the directory of a slot changed.
+ */
+static void bump(int slot){
+    __atomic_store_n(&table->dirs[slot].generation, next_generation(), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Parent: removes the watch of a slot, unless another slot holds the same directory.
+ */
+static void drop_watch(int slot){
+    int wd = slot_wd[slot];
+    slot_wd[slot] = -1;
+    for (int i = 0; i < DIRCACHE_DIRS; i++) {
+        if (slot_wd[i] == wd) return;
+    }
+    inotify_rm_watch(inotify_fd, wd);
+}
+
+/*
+ * Parent: watches the directory a session put in a slot. path is relative
+ * to the root directory. Nothing is done if the slot holds another
+ * directory by now.
+ */
+void dircache_watch(int slot, const char *path){
+    if (table == NULL || inotify_fd < 0 || slot < 0 || slot >= DIRCACHE_DIRS) return;
+    dircache_dir *d = &table->dirs[slot];
+
+    int fd = openat(root_dir_fd, path[0] ? path : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_dev != d->dev || st.st_ino != d->ino) {
+        close(fd);
+        return;
+    }
+
+    // Through the descriptor, so that the checked directory is the one watched
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    restore_privileges();
+    int wd = inotify_add_watch(inotify_fd, proc, DIRCACHE_EVENTS);
+    minimize_privileges();
+    close(fd);
+    if (wd < 0) {
+        perror("inotify_add_watch");
+        return;
+    }
+    if (slot_wd[slot] >= 0 && slot_wd[slot] != wd) {
+        drop_watch(slot);
+    }
+    slot_wd[slot] = wd;
+
+    // A session moving the slot to another directory writes dev/ino before
+    // clearing watched, so one of the two stores below is the last one
+    __atomic_store_n(&d->watched, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&d->dev, __ATOMIC_SEQ_CST) != st.st_dev || __atomic_load_n(&d->ino, __ATOMIC_SEQ_CST) != st.st_ino) {
+        __atomic_store_n(&d->watched, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void dircache_fdset(fd_set *set, int *max_fd){
+    if (inotify_fd != -1) {
+        FD_SET(inotify_fd, set);
+        if (inotify_fd > *max_fd) {
+            *max_fd = inotify_fd;
+        }
+    }
+}
+
+/*
+ * Parent: gives a new generation to the slots of the directories that changed.
+ */
+void dircache_handle(fd_set *set){
+    if (inotify_fd == -1 || !FD_ISSET(inotify_fd, set)) return;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            for (int i = 0; i < DIRCACHE_DIRS; i++) {
+                if ((ev->mask & IN_Q_OVERFLOW) || (slot_wd[i] == ev->wd && ev->wd >= 0)) {
+                    bump(i);
+                    if (ev->mask & IN_IGNORED) {
+                        slot_wd[i] = -1;
+                        __atomic_store_n(&table->dirs[i].watched, 0, __ATOMIC_SEQ_CST);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static long long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the slot holding a directory, -1 if none.
+ */
+static int find_slot(dev_t dev, ino_t ino){
+    for (int i = 0; i < DIRCACHE_DIRS; i++) {
+        dircache_dir *d = &table->dirs[i];
+        if (__atomic_load_n(&d->ino, __ATOMIC_ACQUIRE) == ino && __atomic_load_n(&d->dev, __ATOMIC_ACQUIRE) == dev) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Becomes the writer of a slot, taking it over from a session that died.
+ */
+static int claim(int slot){
+    dircache_dir *d = &table->dirs[slot];
+    pid_t none = 0;
+    if (!__atomic_compare_exchange_n(&d->writer, &none, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (none == getpid() || kill(none, 0) == 0 || errno != ESRCH ||
+            !__atomic_compare_exchange_n(&d->writer, &none, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+    }
+    if (d->seq & 1) {
+        __atomic_add_fetch(&d->seq, 1, __ATOMIC_RELEASE); // left odd by the dead writer
+    }
+    return 0;
+}
+
+static void release(int slot){
+    __atomic_store_n(&table->dirs[slot].writer, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Asks the watcher for a watch on the directory of a slot, and waits for it
+ * a little if wait is set. path is the argument of list, NULL for the
+ * current directory.
+ */
+static int request_watch(int slot, const char *path, int wait){
+    char resolved[PATH_RESOLVED_MAX];
+    size_t root_len = strlen(root_dir_path);
+    if (canon_path(current_dir_path, path ? path : ".", resolved, sizeof(resolved)) < 0 ||
+        !path_within(resolved, strlen(resolved), root_dir_path, root_len)) {
+        return -1;
+    }
+    const char *relative = resolved + root_len;
+    while (*relative == '/') relative++;
+
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.status = WATCH_DIR;
+    msg.req.id = slot;
+    strncpy(msg.req.path, relative, PATH_LENGTH - 1);
+    if (send_to_parent(&msg) < 0 || !wait) return -1;
+
+    long long deadline = now_ms() + DIRCACHE_WATCH_WAIT_MS;
+    while (!__atomic_load_n(&table->dirs[slot].watched, __ATOMIC_ACQUIRE)) {
+        if (now_ms() >= deadline) return -1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+/*
+ * Claims the slot of an open directory, moving the least recently used one
+ * to it if it has none, and makes sure it is watched. Unless wait is set,
+ * a slot that is not watched yet is not returned: the watch is requested
+ * for the next time.
+ * Returns the slot, owned by the caller until release(), or -1.
+ */
+static int acquire(int dir_fd, const char *path, int wait){
+    struct stat st;
+    if (table == NULL || fstat(dir_fd, &st) < 0) return -1;
+
+    int slot = find_slot(st.st_dev, st.st_ino);
+    if (slot >= 0 && claim(slot) < 0) return -1;
+    if (slot >= 0 && (table->dirs[slot].dev != st.st_dev || table->dirs[slot].ino != st.st_ino)) {
+        release(slot); // moved to another directory meanwhile
+        return -1;
+    }
+    if (slot < 0) {
+        int victim = -1;
+        for (int i = 0; i < DIRCACHE_DIRS; i++) {
+            if (__atomic_load_n(&table->dirs[i].writer, __ATOMIC_RELAXED) != 0) continue;
+            if (victim < 0 || table->dirs[i].used < table->dirs[victim].used) victim = i;
+        }
+        if (victim < 0 || claim(victim) < 0) return -1;
+        slot = victim;
+
+        dircache_dir *d = &table->dirs[slot];
+        __atomic_add_fetch(&d->seq, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&d->dev, st.st_dev, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&d->ino, st.st_ino, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&d->watched, 0, __ATOMIC_SEQ_CST); // after dev/ino, see dircache_watch()
+        d->generation = next_generation();
+        d->filled = 0;
+        d->count = 0;
+        d->used = __atomic_add_fetch(&table->clock, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&d->seq, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (!__atomic_load_n(&table->dirs[slot].watched, __ATOMIC_ACQUIRE) && request_watch(slot, path, wait) < 0) {
+        release(slot);
+        return -1;
+    }
+    return slot;
+}
+
+/*
+ * Sends the listing of an open directory from its slot, if it is up to
+ * date. ".." is the only entry stated again, its changes are not watched.
+ * Returns -1 if the directory must be read from disk.
+ */
+int dircache_list(int dir_fd){
+    struct stat st;
+    if (table == NULL || fstat(dir_fd, &st) < 0) return -1;
+    int slot = find_slot(st.st_dev, st.st_ino);
+    if (slot < 0) return -1;
+    dircache_dir *d = &table->dirs[slot];
+
+    unsigned long long seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+    unsigned long long generation = __atomic_load_n(&d->generation, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || !__atomic_load_n(&d->watched, __ATOMIC_ACQUIRE) || d->filled != generation) return -1;
+
+    int count = d->count;
+    if (count < 0 || count > DIRCACHE_ENTRIES) return -1;
+    size_t size = 8 + (size_t)count * (NAME_MAX + 64);
+    char *out = malloc(size);
+    if (out == NULL) return -1;
+
+    size_t len = snprintf(out, size, "ok-\n");
+    for (int i = 0; i < count; i++) {
+        dircache_entry *e = &d->entries[i];
+        long long entry_size = e->size;
+        unsigned int mode = e->mode;
+        struct statx stx;
+        if (strncmp(e->name, "..", 3) == 0 && statx(dir_fd, "..", AT_STATX_DONT_SYNC, STATX_SIZE | STATX_MODE, &stx) == 0) {
+            entry_size = stx.stx_size;
+            mode = stx.stx_mode;
+        }
+        len += snprintf(out + len, size - len, "%.*s\tSize: %lld\tPerms: %o\n", NAME_MAX, e->name, entry_size, mode & 0777);
+    }
+
+    // Nothing was rewritten or changed on disk while copying
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&d->seq, __ATOMIC_ACQUIRE) != seq || __atomic_load_n(&d->generation, __ATOMIC_ACQUIRE) != generation ||
+        d->dev != st.st_dev || d->ino != st.st_ino) {
+        free(out);
+        return -1;
+    }
+    d->used = __atomic_add_fetch(&table->clock, 1, __ATOMIC_RELAXED);
+
+    send_string(out);
+    free(out);
+    return 0;
+}
+
+/*
+ * Prepares the slot of a directory about to be read from disk, the entries
+ * are then given with dircache_record() and dircache_end().
+ * Returns the slot, or -1 if the listing is not cached.
+ */
+int dircache_begin(int dir_fd, const char *path){
+    int slot = acquire(dir_fd, path, 0);
+    if (slot < 0) return -1;
+
+    dircache_dir *d = &table->dirs[slot];
+    fill_generation = __atomic_load_n(&d->generation, __ATOMIC_SEQ_CST);
+    fill_overflow = 0;
+    __atomic_add_fetch(&d->seq, 1, __ATOMIC_SEQ_CST);
+    d->filled = 0;
+    d->count = 0;
+    return slot;
+}
+
+void dircache_record(int slot, const char *name, long long size, unsigned int mode){
+    dircache_dir *d = &table->dirs[slot];
+    if (d->count == DIRCACHE_ENTRIES) {
+        fill_overflow = 1;
+        return;
+    }
+    dircache_entry *e = &d->entries[d->count++];
+    strncpy(e->name, name, NAME_MAX);
+    e->name[NAME_MAX] = '\0';
+    e->size = size;
+    e->mode = mode;
+}
+
+/*
+ * Publishes the entries read since dircache_begin(). They are kept only if
+ * the whole directory was read and no change was reported meanwhile.
+ */
+void dircache_end(int slot, int complete){
+    dircache_dir *d = &table->dirs[slot];
+    if (complete && !fill_overflow && __atomic_load_n(&d->generation, __ATOMIC_SEQ_CST) == fill_generation) {
+        d->filled = fill_generation;
+    } else {
+        d->count = 0;
+    }
+    d->used = __atomic_add_fetch(&table->clock, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&d->seq, 1, __ATOMIC_SEQ_CST);
+    release(slot);
+}
+
+/*
+ * Returns the generation of an open directory, which changes whenever its
+ * entries do, or 0 if it cannot be watched.
+ */
+unsigned long long dircache_generation(int dir_fd, const char *path){
+    int slot = acquire(dir_fd, path, 1);
+    if (slot < 0) return 0;
+    unsigned long long generation = __atomic_load_n(&table->dirs[slot].generation, __ATOMIC_SEQ_CST);
+    release(slot);
+    return generation;
+}
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE // statx()
+#include "server.h"
+#include "common.h"
+#include "path.h"
+#include "beneath.h"
+#include "listing.h"
+#include "find.h"
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+/*
+ * A walker thread and its output.
+ */
+typedef struct {
+    find_job *job;
+    int id;
+    size_t len;
+    char *out;
+    dir_stream *stream;
+} find_walker;
+
+/*
+ * Queues a directory on a walker's deque. Takes ownership of path.
+ */
+static int deque_push(find_job *job, int id, char *path){
+    find_deque *q = &job->deques[id];
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail == q->capacity) {
+        if (q->head > 0) {
+            memmove(q->paths, q->paths + q->head, (q->tail - q->head) * sizeof(char *));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            int capacity = q->capacity ? q->capacity * 2 : 64;
+            char **grown = realloc(q->paths, capacity * sizeof(char *));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&q->mutex);
+                return -1;
+            }
+            q->paths = grown;
+            q->capacity = capacity;
+        }
+    }
+    q->paths[q->tail++] = path;
+    __atomic_add_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+/*
+ * Takes the newest directory of a walker's own deque, or steals the oldest
+ * one of another walker. Returns NULL if every deque is empty.
+ */
+static char *deque_take(find_job *job, int id){
+    for (int k = 0; k < FIND_THREADS; k++) {
+        find_deque *q = &job->deques[(id + k) % FIND_THREADS];
+        char *path = NULL;
+        pthread_mutex_lock(&q->mutex);
+        if (q->head < q->tail) {
+            path = (k == 0) ? q->paths[--q->tail] : q->paths[q->head++];
+            if (q->head == q->tail) {
+                q->head = q->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&q->mutex);
+        if (path != NULL) return path;
+    }
+    return NULL;
+}
+
+/*
+ * Sends a walker's output, and checks whether the client cancelled.
+ */
+static void flush_output(find_walker *w){
+    find_job *job = w->job;
+    if (w->len == 0) return;
+    pthread_mutex_lock(&job->out_mutex);
+    if (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        if (send_string(w->out) < 0 || client_cancelled()) {
+            __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&job->out_mutex);
+    w->len = 0;
+}
+
+static void emit(find_walker *w, const char *relative){
+    size_t need = strlen(w->job->prefix) + strlen(relative) + 3;
+    if (w->len + need >= FIND_CHUNK_SIZE) {
+        flush_output(w);
+    }
+    w->len += snprintf(w->out + w->len, FIND_CHUNK_SIZE - w->len, "%s/%s\n", w->job->prefix, relative);
+    __atomic_add_fetch(&w->job->matches, 1, __ATOMIC_RELAXED);
+}
+
+static int newer_than(const struct statx_timestamp *t, const struct timespec *ref){
+    return t->tv_sec > ref->tv_sec || (t->tv_sec == ref->tv_sec && (long)t->tv_nsec > ref->tv_nsec);
+}
+
+/*
+ * Walks one directory: prints the entries that match, queues the subdirectories.
+ * Symlinks are reported but never followed.
+ */
+static void walk_dir(find_walker *w, const char *path){
+    find_job *job = w->job;
+    int fd = path[0] ? beneath_openat(job->root_fd, path, O_RDONLY | O_DIRECTORY, 0) : dup(job->root_fd);
+    if (fd < 0) {
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&job->dirs, 1, __ATOMIC_RELAXED);
+
+    int need_stat = job->size_cmp != 2 || job->newer;
+    unsigned int mask = STATX_TYPE | (job->size_cmp != 2 ? STATX_SIZE : 0) | (job->newer ? STATX_MTIME : 0);
+    size_t path_len = strlen(path);
+    char child[PATH_RESOLVED_MAX];
+    dir_entry e;
+
+    dir_stream_init(w->stream, fd);
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED) && dir_stream_next(w->stream, &e) > 0) {
+        if (strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0) continue;
+        int n = path_len ? snprintf(child, sizeof(child), "%s/%s", path, e.name) : snprintf(child, sizeof(child), "%s", e.name);
+        if (n < 0 || (size_t)n >= sizeof(child)) continue;
+
+        // The name costs nothing, the attributes one statx() when asked for
+        int is_dir = e.type == DT_DIR;
+        int match = job->name == NULL || fnmatch(job->name, e.name, 0) == 0;
+        if ((match && need_stat) || e.type == DT_UNKNOWN) {
+            struct statx stx;
+            if (statx(fd, e.name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) < 0) continue;
+            is_dir = S_ISDIR(stx.stx_mode);
+            if (job->size_cmp != 2) {
+                long long size = (long long)stx.stx_size;
+                match = match && ((job->size_cmp < 0 && size < job->size) || (job->size_cmp == 0 && size == job->size) ||
+                                  (job->size_cmp > 0 && size > job->size));
+            }
+            if (job->newer) {
+                match = match && newer_than(&stx.stx_mtime, &job->newer_than);
+            }
+        }
+        if (match) {
+            emit(w, child);
+        }
+        if (is_dir) {
+            char *copy = strdup(child);
+            if (copy == NULL || deque_push(job, w->id, copy) < 0) {
+                free(copy);
+                __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Walker thread: walks its own directories, steals from the others when it
+ * has none, and stops when no directory is left anywhere.
+ */
+static void *find_thread(void *arg){
+    find_walker *w = arg;
+    find_job *job = w->job;
+
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        char *path = deque_take(job, w->id);
+        if (path == NULL) {
+            if (__atomic_load_n(&job->pending, __ATOMIC_SEQ_CST) == 0) break;
+            struct timespec ts = { 0, FIND_IDLE_WAIT_US * 1000L };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        walk_dir(w, path);
+        free(path);
+        __atomic_sub_fetch(&job->pending, 1, __ATOMIC_SEQ_CST);
+
+        // A find with few matches sends nothing for a long time, check for cancel anyway
+        if (w->id == 0 && pthread_mutex_trylock(&job->out_mutex) == 0) {
+            if (client_cancelled()) {
+                __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&job->out_mutex);
+        }
+    }
+    flush_output(w);
+    return NULL;
+}
+
+/*
+ * Walks the tree under job->root_fd with FIND_THREADS walkers and streams
+ * the paths that match to the client, then a "found:" line with the totals.
+ * The caller fills the filters of job, the rest is set here.
+ */
+int find_run(find_job *job){
+    find_walker walkers[FIND_THREADS];
+    pthread_t threads[FIND_THREADS];
+    int ret = 0;
+
+    job->pending = 0;
+    job->stop = 0;
+    job->matches = 0;
+    job->dirs = 0;
+    job->errors = 0;
+    pthread_mutex_init(&job->out_mutex, NULL);
+    for (int t = 0; t < FIND_THREADS; t++) {
+        memset(&job->deques[t], 0, sizeof(find_deque));
+        pthread_mutex_init(&job->deques[t].mutex, NULL);
+        walkers[t].job = job;
+        walkers[t].id = t;
+        walkers[t].len = 0;
+        walkers[t].out = malloc(FIND_CHUNK_SIZE);
+        walkers[t].stream = malloc(sizeof(dir_stream));
+        if (walkers[t].out == NULL || walkers[t].stream == NULL) ret = -1;
+    }
+
+    char *start = strdup("");
+    if (ret == 0 && (start == NULL || deque_push(job, 0, start) < 0)) {
+        free(start);
+        ret = -1;
+    }
+    if (ret < 0) {
+        send_string("err-Out of memory");
+    } else {
+        send_string("ok-");
+        int started = 0;
+        for (int t = 0; t < FIND_THREADS; t++) {
+            if (pthread_create(&threads[t], NULL, find_thread, &walkers[t]) != 0) {
+                perror("pthread_create");
+                break;
+            }
+            started++;
+        }
+        if (started == 0) {
+            find_thread(&walkers[0]); // no thread could start, walk from here
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        char msg[256];
+        if (job->stop) {
+            snprintf(msg, sizeof(msg), "err-Find cancelled after %lld matches", job->matches);
+        } else {
+            snprintf(msg, sizeof(msg), "found: %lld matches in %lld directories, %lld unreadable", job->matches, job->dirs, job->errors);
+        }
+        send_string(msg);
+    }
+
+    for (int t = 0; t < FIND_THREADS; t++) {
+        find_deque *q = &job->deques[t];
+        for (int i = q->head; i < q->tail; i++) {
+            free(q->paths[i]); // left by a cancelled find
+        }
+        free(q->paths);
+        pthread_mutex_destroy(&q->mutex);
+        free(walkers[t].out);
+        free(walkers[t].stream);
+    }
+    pthread_mutex_destroy(&job->out_mutex);
+    return ret;
+}
@@ -0,0 +1,330 @@
+#include "server.h"
+#include "common.h"
+#include "users.h"
+#include "user_store.h"
+#include "import.h"
+#include <time.h>
+
+extern ClientSession sessions[];
+
+/*
+ * A line of the import file.
+ */
+typedef struct {
+    char username[USERNAME_LENGTH];
+    int permissions;
+    pid_t pid; // useradd running for it, -1 otherwise
+} import_entry;
+
+static pid_t import_pid = -1; // Worker of the running import, -1 if none
+static int import_fd = -1;    // Parent end of the worker's socketpair
+static int import_done = 0;  // Lines processed, each one is either created or failed
+static int import_total = 0;
+static int import_added = 0; // Users stored
+
+static long long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Reads the "<username> <permissions>" lines of the file, blank lines and
+ * lines starting with '#' are ignored. Malformed lines are kept with
+ * permissions -1, so that they are reported as failed.
+ */
+static import_entry *read_entries(FILE *f, int *count){
+    import_entry *entries = NULL;
+    int capacity = 0;
+    char line[BUFFER_SIZE];
+
+    *count = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *name = strtok(line, " \t\r\n");
+        if (name == NULL || name[0] == '#') continue;
+        char *perms = strtok(NULL, " \t\r\n");
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            import_entry *grown = realloc(entries, capacity * sizeof(import_entry));
+            if (grown == NULL) {
+                perror("realloc");
+                break;
+            }
+            entries = grown;
+        }
+        import_entry *e = &entries[(*count)++];
+        memset(e, 0, sizeof(*e));
+        e->pid = -1;
+        e->permissions = -1;
+        if (strlen(name) >= USERNAME_LENGTH || strchr(name, '/') != NULL || name[0] == '.' ||
+            check_permissions(perms) < 0 || strtok(NULL, " \t\r\n") != NULL) {
+            printf("[IMPORT] invalid line for %.32s\n", name);
+            continue;
+        }
+        strcpy(e->username, name);
+        e->permissions = (int)strtol(perms, NULL, 8);
+    }
+    return entries;
+}
+
+/*
+ * Tells whether entry i can be provisioned: valid, not a user yet and not
+ * listed earlier in the file.
+ */
+static int entry_valid(import_entry *entries, int i){
+    if (entries[i].permissions < 0) return 0;
+    if (user_exists(entries[i].username) == 0) {
+        printf("[IMPORT] %s already exists\n", entries[i].username);
+        return 0;
+    }
+    for (int k = 0; k < i; k++) {
+        if (strcmp(entries[k].username, entries[i].username) == 0) {
+            printf("[IMPORT] %s is listed twice\n", entries[i].username);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Starts useradd for an entry without waiting for it.
+ */
+static pid_t spawn_useradd(import_entry *e){
+    restore_privileges();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork useradd");
+        minimize_privileges();
+        return -1;
+    }
+    if (pid == 0) {
+        char gid_str[16];
+        snprintf(gid_str, sizeof(gid_str), "%d", get_real_gid());
+        execlp("useradd", "useradd", "-m", "-g", gid_str, e->username, NULL);
+        perror("execlp useradd failed");
+        _exit(1);
+    }
+    minimize_privileges();
+    return pid;
+}
+
+static void send_batch(int fd, import_batch *batch){
+    if (send(fd, batch, sizeof(*batch), MSG_NOSIGNAL) < 0) {
+        perror("send import batch");
+    }
+    batch->count = 0;
+}
+
+/*
+ * Body of the import worker: runs up to IMPORT_PARALLEL useradd at a time,
+ * creates the folder of each new OS user and hands the provisioned users to
+ * the parent in batches. The parent alone writes the user store.
+ */
+static void import_worker_main(FILE *f, int fd){
+    int count;
+    import_entry *entries = read_entries(f, &count);
+    fclose(f);
+
+    import_batch *batch = calloc(1, sizeof(import_batch));
+    if (batch == NULL) {
+        perror("calloc");
+        return;
+    }
+    batch->total = count;
+
+    restore_privileges();
+    int root = geteuid() == 0;
+    minimize_privileges();
+    if (!root) {
+        printf("[IMPORT] Not root, skipping OS user creation\n");
+    }
+
+    int next = 0;
+    int running = 0;
+    long long last_report = now_ms();
+    while (next < count || running > 0) {
+        // Keep IMPORT_PARALLEL useradd running
+        while (running < IMPORT_PARALLEL && next < count) {
+            import_entry *e = &entries[next];
+            if (root && entry_valid(entries, next) && (e->pid = spawn_useradd(e)) > 0) {
+                running++;
+            } else {
+                batch->done++;
+            }
+            next++;
+        }
+        if (running == 0) break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid useradd");
+            break;
+        }
+        import_entry *e = NULL;
+        for (int i = 0; i < next && e == NULL; i++) {
+            if (entries[i].pid == pid) e = &entries[i];
+        }
+        if (e == NULL) continue;
+        e->pid = -1;
+        running--;
+        batch->done++;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("[IMPORT] useradd failed for %s\n", e->username);
+        } else if (create_user_folder(e->username, e->permissions) < 0) {
+            delete_os_user(e->username);
+        } else {
+            User *u = &batch->users[batch->count++];
+            memset(u, 0, sizeof(*u));
+            strcpy(u->username, e->username);
+            u->permissions = e->permissions;
+        }
+
+        if (batch->count == IMPORT_BATCH || now_ms() - last_report >= IMPORT_PROGRESS_INTERVAL_MS) {
+            send_batch(fd, batch);
+            last_report = now_ms();
+        }
+    }
+
+    batch->done = count;
+    batch->final = 1;
+    send_batch(fd, batch);
+    free(batch);
+    free(entries);
+    fflush(stdout);
+}
+
+/*
+ * Starts importing the users listed in a file, in a forked worker.
+ * Returns -1 if an import is already running or the file cannot be read.
+ */
+int import_start(const char *path){
+    if (import_fd != -1) {
+        printf("err-an import is already running\n");
+        return -1;
+    }
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("fopen import file");
+        return -1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        fclose(f);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork import worker");
+        fclose(f);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+
+        // Don't keep the session channels open, their peers rely on EOF
+        for (int k = 0; k < MAX_CLIENTS; k++) {
+            if (sessions[k].pid != -1) {
+                close(sessions[k].pipe_fd_read);
+                close(sessions[k].pipe_fd_write);
+            }
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL); // the worker reaps its useradd itself
+
+        // If parent dies, send SIGKILL to this worker
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1) {
+            _exit(0);
+        }
+        user_store_detach(); // read only here, the parent stores the batches
+        import_worker_main(f, sv[1]);
+        _exit(0);
+    }
+
+    fclose(f);
+    close(sv[1]);
+    import_pid = pid;
+    import_fd = sv[0];
+    import_done = 0;
+    import_total = 0;
+    import_added = 0;
+    printf("[IMPORT] importing users from %s (pid %d)\n", path, pid);
+    return 0;
+}
+
+/*
+ * Prints the progress of the running import.
+ */
+void import_status(){
+    if (import_fd == -1) {
+        printf("no import running\n");
+        return;
+    }
+    printf("[IMPORT] %d/%d users processed, %d created, %d failed\n", import_done, import_total, import_added, import_done - import_added);
+}
+
+void import_fdset(fd_set *set, int *max_fd){
+    if (import_fd != -1) {
+        FD_SET(import_fd, set);
+        if (import_fd > *max_fd) {
+            *max_fd = import_fd;
+        }
+    }
+}
+
+/*
+ * Stores the users provisioned by the worker, one user store write per batch,
+ * and reports the progress.
+ */
+void import_handle(fd_set *set){
+    if (import_fd == -1 || !FD_ISSET(import_fd, set)) return;
+
+    static import_batch batch;
+    ssize_t n = recv(import_fd, &batch, sizeof(batch), MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+
+    if (n != (ssize_t)sizeof(batch)) {
+        printf("[IMPORT] worker (pid %d) exited before finishing: %d/%d users processed, %d created\n",
+               import_pid, import_done, import_total, import_added);
+        close(import_fd);
+        import_fd = -1;
+        import_pid = -1;
+        return;
+    }
+
+    if (batch.count > 0) {
+        int added = user_store_add_batch(batch.users, batch.count);
+        if (added < 0) {
+            printf("[IMPORT] failed to store %d users\n", batch.count);
+            added = 0;
+        }
+        for (int i = 0; i < batch.count && added > 0; i++) {
+            if (batch.users[i].id == -1) {
+                printf("[IMPORT] %s not stored\n", batch.users[i].username);
+            }
+        }
+        import_added += added;
+    }
+    import_done = batch.done;
+    import_total = batch.total;
+
+    if (batch.final) {
+        printf("[IMPORT] done: %d users created, %d failed\n", import_added, import_done - import_added);
+        close(import_fd);
+        import_fd = -1;
+        import_pid = -1;
+        return;
+    }
+    import_status();
+}
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE // statx()
+#include "server.h"
+#include "common.h"
+#include "listing.h"
+#include "dircache.h"
+#include <poll.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+extern int sockfd;
+
+/*
+ * Record written by getdents64().
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void dir_stream_init(dir_stream *s, int fd){
+    s->fd = fd;
+    s->pos = 0;
+    s->len = 0;
+}
+
+/*
+ * Moves the stream to a position returned in dir_entry.next.
+ * Returns -1 if the filesystem refuses it.
+ */
+int dir_stream_seek(dir_stream *s, long long cursor){
+    s->pos = 0;
+    s->len = 0;
+    return lseek(s->fd, cursor, SEEK_SET) == -1 ? -1 : 0;
+}
+
+/*
+ * Returns the next entry of the directory: 1 with e filled, 0 at the end,
+ * -1 on error. The name stays valid until the next call.
+ */
+int dir_stream_next(dir_stream *s, dir_entry *e){
+    if (s->pos >= s->len) {
+        long n = syscall(SYS_getdents64, s->fd, s->buf, sizeof(s->buf));
+        if (n <= 0) return n == 0 ? 0 : -1;
+        s->len = n;
+        s->pos = 0;
+    }
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(s->buf + s->pos);
+    s->pos += d->d_reclen;
+    e->name = d->d_name;
+    e->type = d->d_type;
+    e->next = d->d_off;
+    return 1;
+}
+
+/*
+ * Tells whether the client sent "cancel" while a long reply was streamed.
+ * Anything else it sent is left for the command loop.
+ */
+int client_cancelled(){
+    struct pollfd p = { .fd = sockfd, .events = POLLIN };
+    if (poll(&p, 1, 0) <= 0) return 0;
+
+    char peek[16];
+    ssize_t n = recv(sockfd, peek, sizeof(peek) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0) return 0;
+    peek[n] = '\0';
+    size_t len = strcspn(peek, "\r\n");
+    if (len != 6 || strncmp(peek, "cancel", 6) != 0 || peek[len] == '\0') return 0;
+    if (peek[len] == '\r' && peek[len + 1] == '\n') len++;
+    recv(sockfd, peek, len + 1, 0);
+    return 1;
+}
+
+/*
+ * Streams the entries of an open directory to the client, from cursor (0
+ * for the start), at most limit of them (0 for all). Entries are read in
+ * getdents64() batches and statx() only asks for the size and the mode.
+ * Output goes out every LIST_CHUNK_SIZE bytes. When entries remain after
+ * limit, the last line gives the cursor to resume from. The client can stop
+ * a long listing with "cancel". The entries sent also go to the directory
+ * cache slot fill_slot, unless it is -1. dir_fd is left open.
+ */
+int list_stream(int dir_fd, long long limit, long long cursor, int fill_slot){
+    dir_stream *s = malloc(sizeof(dir_stream));
+    char *out = malloc(LIST_CHUNK_SIZE);
+    if (s == NULL || out == NULL) {
+        perror("malloc");
+        free(s);
+        free(out);
+        send_string("err-Error listing directory");
+        if (fill_slot != -1) dircache_end(fill_slot, 0);
+        return -1;
+    }
+    dir_stream_init(s, dir_fd);
+    if (cursor > 0 && dir_stream_seek(s, cursor) == -1) {
+        free(s);
+        free(out);
+        if (fill_slot != -1) dircache_end(fill_slot, 0);
+        send_string("err-Invalid cursor");
+        return -1;
+    }
+
+    size_t len = snprintf(out, LIST_CHUNK_SIZE, "ok-\n");
+    long long listed = 0;
+    long long position = cursor; // After the last entry sent
+    int more = 0;
+    int cancelled = 0;
+    int ret;
+    dir_entry e;
+
+    while ((ret = dir_stream_next(s, &e)) > 0) {
+        if (limit > 0 && listed == limit) {
+            more = 1;
+            break;
+        }
+        struct statx stx;
+        if (statx(dir_fd, e.name, AT_STATX_DONT_SYNC, STATX_SIZE | STATX_MODE, &stx) == -1) {
+            position = e.next;
+            continue;
+        }
+
+        char line[512];
+        int n = snprintf(line, sizeof(line), "%s\tSize: %lld\tPerms: %o\n", e.name, (long long)stx.stx_size, stx.stx_mode & 0777);
+        if (len + n >= LIST_CHUNK_SIZE) {
+            send_string(out);
+            len = 0;
+            if (client_cancelled()) {
+                cancelled = 1;
+                break;
+            }
+        }
+        memcpy(out + len, line, n + 1);
+        len += n;
+        if (fill_slot != -1) {
+            dircache_record(fill_slot, e.name, (long long)stx.stx_size, stx.stx_mode);
+        }
+        listed++;
+        position = e.next;
+    }
+    if (ret < 0) {
+        perror("getdents64");
+        len += snprintf(out + len, LIST_CHUNK_SIZE - len, "err-Error reading directory\n");
+    }
+
+    if (cancelled) {
+        len = snprintf(out, LIST_CHUNK_SIZE, "err-Listing cancelled, resume with --cursor %lld\n", position);
+    } else if (more) {
+        len += snprintf(out + len, LIST_CHUNK_SIZE - len, "cursor: %lld\n", position);
+    }
+    if (fill_slot != -1) {
+        dircache_end(fill_slot, ret == 0 && !more && !cancelled);
+    }
+    if (len > 0) {
+        send_string(out);
+    }
+
+    free(s);
+    free(out);
+    return ret < 0 ? -1 : 0;
+}
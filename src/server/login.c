@@ -3,6 +3,9 @@
 #include "users.h"
 #include "ops.h"
 #include "transfer.h"
+#include "concurrency.h"
+#include "path.h"
+#include "beneath.h"
 #include <sys/prctl.h>
 #include <signal.h>
 
@@ -13,6 +16,8 @@ extern int pipe_read;
 extern char root_dir_path[];
 char username[USERNAME_LENGTH];
 char current_dir_path[1024+USERNAME_LENGTH+2];
+char home_path[PATH_RESOLVED_MAX]; // Resolved path of the user's directory, set at login
+size_t home_len = 0;
 
 
 int login(char *usern) {
@@ -76,10 +81,18 @@ int login(char *usern) {
 
     snprintf(current_dir_path, sizeof(current_dir_path), "%s/%s", root_dir_path, username);
     printf("current_dir_path: %s\n", current_dir_path);
+
+    // Paths of the commands are checked against this prefix, see resolve_path_mine()
+    int len = canon_path(root_dir_path, username, home_path, sizeof(home_path));
+    home_len = len < 0 ? 0 : len;
+    if (beneath_init(root_dir_fd, username) == -1) {
+        return -1;
+    }
     
     send_string("Login successful\n");
 
     i_am_user(); // to handle transfer_requests
+    lock_set_session(1, pipe_read); // keep handling parent messages during lock waits
 
     fd_set readfds;
     int max_fd;
@@ -178,6 +191,18 @@ int login(char *usern) {
             else if (strcmp(args[0], "reject") == 0) {
                 op_reject(&args[1], arg_count);
             }
+            else if (strcmp(args[0], "pending") == 0) {
+                op_pending(&args[1], arg_count);
+            }
+            else if (strcmp(args[0], "status") == 0) {
+                op_status(&args[1], arg_count);
+            }
+            else if (strcmp(args[0], "cancel") == 0) {
+                op_cancel(&args[1], arg_count);
+            }
+            else if (strcmp(args[0], "find") == 0) {
+                op_find(&args[1], arg_count);
+            }
             else if (strcmp(args[0], "exit") == 0) {
                 exit(0);
             }
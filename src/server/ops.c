@@ -4,10 +4,27 @@
 #include "server.h"
 #include "transfer.h"
 #include "concurrency.h"
+#include "copy.h"
+#include "quota.h"
+#include "beneath.h"
+#include "listing.h"
+#include "dircache.h"
+#include "find.h"
+#include "path.h"
 #include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
 
 #define PATH_LENGTH 1024
 
+// Seconds each command waits for a contended file lock before giving up
+#define MOVE_LOCK_TIMEOUT 10
+#define DELETE_LOCK_TIMEOUT 10
+#define READ_LOCK_TIMEOUT 30
+#define WRITE_LOCK_TIMEOUT 30
+#define UPLOAD_LOCK_TIMEOUT 60
+#define DOWNLOAD_LOCK_TIMEOUT 60
+
 extern int root_dir_fd;
 extern int current_dir_fd;
 extern int sockfd;
@@ -31,15 +48,7 @@ int op_create(char *args[], int arg_count) {
         return -1;
     }
 
-    // Identify target path
-    char *target_path = (strcmp(args[0], "-d") == 0) ? args[1] : args[0];
-    
-    // Validate path
-    if (check_path_mine(target_path) != 0) {
-        send_string("err-Invalid path");
-        return -1;
-    }
-
+    // The path is confined to the user's folder by the kernel, see beneath.c
     // Check if the client wants to create a directory or a file
     if (strcmp(args[0], "-d") == 0) {
         if (arg_count < 3) {
@@ -54,16 +63,32 @@ int op_create(char *args[], int arg_count) {
         }
         mode_t mode = (mode_t)strtol(args[2], NULL, 8);
 
+        char name[NAME_MAX + 1];
+        int parent_fd = beneath_parent(BENEATH_HOME, args[1], name, sizeof(name));
+        if (parent_fd == -1) {
+            send_string("err-Invalid path");
+            return -1;
+        }
+
+        if (quota_charge(username, 0, 1) < 0) {
+            close(parent_fd);
+            send_string("err-Quota exceeded");
+            return -1;
+        }
+
         mode_t old_umask = umask(0000); // removed the mask
 
         // Create directory
-        if (mkdirat(current_dir_fd, args[1], mode) == -1) {
+        if (mkdirat(parent_fd, name, mode) == -1) {
+            quota_charge(username, 0, -1);
+            close(parent_fd);
             send_string("err-Error creating directory");
             perror("Error creating directory");
             return -1;
         }
 
         umask(old_umask); // restore the mask
+        close(parent_fd);
 
         snprintf(msg, sizeof(msg), "ok-Directory %s created successfully with permissions %o.", args[1], mode);
         send_string(msg);
@@ -74,12 +99,18 @@ int op_create(char *args[], int arg_count) {
         }
         mode_t mode = (mode_t)strtol(args[1], NULL, 8);
 
+        if (quota_charge(username, 0, 1) < 0) {
+            send_string("err-Quota exceeded");
+            return -1;
+        }
+
         mode_t old_umask = umask(0000);
 
         // Create file
-        int fd = openat(current_dir_fd, args[0], O_CREAT | O_WRONLY | O_EXCL, mode);
+        int fd = beneath_open(BENEATH_HOME, args[0], O_CREAT | O_WRONLY | O_EXCL, mode);
         if (fd == -1) {
-            send_string("err-Error creating file");
+            quota_charge(username, 0, -1);
+            send_string(errno == EXDEV ? "err-Invalid path" : "err-Error creating file");
             perror("Error creating file");
             return -1;
         }
@@ -115,17 +146,23 @@ int op_changemod(char *args[], int arg_count) {
 
     mode_t mode = (mode_t)strtol(args[1], NULL, 8);
 
-    if (check_path_mine(args[0]) != 0) {
+    char name[NAME_MAX + 1];
+    int parent_fd = beneath_parent(BENEATH_HOME, args[0], name, sizeof(name));
+    if (parent_fd == -1) {
         send_string("err-Invalid path");
         return -1;
     }
 
-    // Change permissions
-    if (fchmodat(current_dir_fd, args[0], mode, 0) == -1) {
+    // Change permissions, a symlink could lead out of the user's folder
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || S_ISLNK(st.st_mode) ||
+        fchmodat(parent_fd, name, mode, 0) == -1) {
         perror("chmod failed");
+        close(parent_fd);
         send_string("err-Error changing permissions");
         return -1;
     }
+    close(parent_fd);
 
     snprintf(msg, sizeof(msg), "ok-Permissions for %s changed to %o.", args[0], mode);
     send_string(msg);
@@ -143,20 +180,17 @@ int op_move(char *args[], int arg_count) {
         return -1;
     }
 
-    if (check_path_mine(args[0]) != 0) {
+    // Resolve paths
+    char source_path[PATH_MAX];
+    char destination_path[PATH_MAX];
+    if (resolve_path_mine(args[0], source_path, sizeof(source_path)) != 0) {
         send_string("err-Invalid source path");
         return -1;
     }
-    if (check_path_mine(args[1]) != 0) {
+    if (resolve_path_mine(args[1], destination_path, sizeof(destination_path)) != 0) {
         send_string("err-Invalid destination path");
         return -1;
     }
-    
-    // Resolve paths
-    char source_path[PATH_MAX];
-    char destination_path[PATH_MAX];
-    resolve_path(current_dir_path, args[0], source_path);
-    resolve_path(current_dir_path, args[1], destination_path);
 
     // Get file locks, for concurrency
     FileLock *source_lock = get_file_lock(source_path);
@@ -171,12 +205,37 @@ int op_move(char *args[], int arg_count) {
     }
 
     // Locks for concurrency
-    writer_lock(source_lock);
-    writer_lock(destination_lock);
+    if (writer_lock(source_lock, MOVE_LOCK_TIMEOUT) != 0) {
+        release_file_lock(source_lock);
+        release_file_lock(destination_lock);
+        send_string("err-Timed out waiting for the file lock");
+        return -1;
+    }
+    if (writer_lock(destination_lock, MOVE_LOCK_TIMEOUT) != 0) {
+        writer_unlock(source_lock);
+        release_file_lock(source_lock);
+        release_file_lock(destination_lock);
+        send_string("err-Timed out waiting for the file lock");
+        return -1;
+    }
 
-    // Move file
-    if (renameat(current_dir_fd, args[0], current_dir_fd, args[1]) == -1) {
+    // Move file, between the two parent directories opened within the user's folder
+    char source_name[NAME_MAX + 1];
+    char destination_name[NAME_MAX + 1];
+    int source_dir = beneath_parent(BENEATH_HOME, args[0], source_name, sizeof(source_name));
+    int destination_dir = beneath_parent(BENEATH_HOME, args[1], destination_name, sizeof(destination_name));
+    struct stat st, replaced_st;
+    int replaced = 0;
+    if (source_dir != -1 && destination_dir != -1 &&
+        fstatat(destination_dir, destination_name, &replaced_st, AT_SYMLINK_NOFOLLOW) == 0) {
+        replaced = 1;
+    }
+    if (source_dir == -1 || destination_dir == -1 ||
+        fstatat(source_dir, source_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        renameat(source_dir, source_name, destination_dir, destination_name) == -1) {
         perror("rename failed");
+        if (source_dir != -1) close(source_dir);
+        if (destination_dir != -1) close(destination_dir);
         send_string("err-Error moving file");
         writer_unlock(source_lock);
         release_file_lock(source_lock);
@@ -185,6 +244,17 @@ int op_move(char *args[], int arg_count) {
         return -1;
     }
 
+    close(source_dir);
+    close(destination_dir);
+    if (!S_ISREG(st.st_mode)) {
+        tree_changed(); // cached directory handles may point elsewhere now
+    }
+
+    // The entry the move replaced is gone, give back what it counted for, as op_delete() does
+    if (replaced && (replaced_st.st_dev != st.st_dev || replaced_st.st_ino != st.st_ino)) {
+        quota_charge(username, S_ISREG(replaced_st.st_mode) ? -(long long)replaced_st.st_size : 0, -1);
+    }
+
     // Unlock files
     writer_unlock(source_lock);
     release_file_lock(source_lock);
@@ -229,14 +299,12 @@ int op_upload(char *args[], int arg_count) {
         dest_path_str = args[1];
     }
 
-    if (check_path_mine(dest_path_str) != 0) {
+    char resolved[2048];
+    if (resolve_path_mine(dest_path_str, resolved, sizeof(resolved)) != 0) {
         send_string("err-Invalid path");
         return -1;
     }
 
-    char resolved[2048];
-    resolve_path(current_dir_path, dest_path_str, resolved);
-
     // If background, create new process that handles it
     if (background) {
         pid_t pid = fork();
@@ -249,6 +317,7 @@ int op_upload(char *args[], int arg_count) {
             return 0;
         }
         // Only child process continues below
+        lock_set_session(1, -1); // parent pipe messages belong to the session
     }
     
     // Create socket for data transfer
@@ -321,11 +390,32 @@ int op_upload(char *args[], int arg_count) {
 
     // Prepare to write file
     FileLock *lock = get_file_lock(resolved);
-    writer_lock(lock);
+    if (writer_lock(lock, UPLOAD_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        close(new_socket);
+        close(server_fd);
+        send_string("err-Timed out waiting for the file lock");
+        if (background) exit(1);
+        return -1;
+    }
 
-    int fd = openat(current_dir_fd, dest_path_str, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // Charge the new file, or give back the size of the one it replaces
+    struct stat old_st;
+    int existed = beneath_stat(BENEATH_HOME, dest_path_str, &old_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(old_st.st_mode);
+    if (!existed && quota_charge(username, 0, 1) < 0) {
+        close(new_socket);
+        send_string("err-Quota exceeded");
+        close(server_fd);
+        writer_unlock(lock);
+        release_file_lock(lock);
+        if (background) exit(1);
+        return -1;
+    }
+
+    int fd = beneath_open(BENEATH_HOME, dest_path_str, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
         perror("openat failed");
+        if (!existed) quota_charge(username, 0, -1);
         close(new_socket);
         send_string("err-Server error opening file");
         close(server_fd);
@@ -335,15 +425,24 @@ int op_upload(char *args[], int arg_count) {
         return -1;
     }
 
+    if (existed) quota_charge(username, -old_st.st_size, 0);
+
     // sleep 10 seconds to simulate the background operation
     if (background) sleep(10);
     
-    // Receive and write file data
+    // Receive and write file data, charging each chunk before it is written
     char buffer[BUFFER_SIZE];
     int n;
+    int over_quota = 0;
     while ((n = recv(new_socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (write(fd, buffer, n) != n) {
+        if (quota_charge(username, n, 0) < 0) {
+            over_quota = 1;
+            break;
+        }
+        ssize_t w = write(fd, buffer, n);
+        if (w != n) {
             perror("write failed");
+            quota_charge(username, (w > 0 ? w : 0) - n, 0);
             break;
         }
     }
@@ -360,6 +459,16 @@ int op_upload(char *args[], int arg_count) {
     writer_unlock(lock);
     release_file_lock(lock);
 
+    if (over_quota) {
+        send_string("err-Quota exceeded, upload incomplete");
+        printf("[PID: %d] Upload stopped, quota of %s exceeded: %s\n", getpid(), username, dest_path_str);
+        if (background) {
+            close(sockfd);
+            exit(1);
+        }
+        return -1;
+    }
+
     if (!background) {
         send_string("ok-Upload successful.");
         printf("[PID: %d] Upload finished: %s -> %s\n", getpid(), client_path_str, dest_path_str);
@@ -406,13 +515,11 @@ int op_download(char *args[], int arg_count) {
         server_path_str = args[0];
     }
 
-    if (check_path_mine(server_path_str) != 0) {
+    char resolved[2048];
+    if (resolve_path_mine(server_path_str, resolved, sizeof(resolved)) != 0) {
         send_string("err-Invalid path");
         return -1;
     }
-
-    char resolved[2048];
-    resolve_path(current_dir_path, server_path_str, resolved);
     
     // if background, fork() 
     if (background) {
@@ -426,14 +533,20 @@ int op_download(char *args[], int arg_count) {
             return 0;
         }
         // Only Child process continues below
+        lock_set_session(1, -1); // parent pipe messages belong to the session
     }
 
     // get file lock
     FileLock *lock = get_file_lock(resolved);
-    reader_lock(lock);
+    if (reader_lock(lock, DOWNLOAD_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        send_string("err-Timed out waiting for the file lock");
+        if (background) exit(1);
+        return -1;
+    }
 
     // open file
-    int fd = openat(current_dir_fd, server_path_str, O_RDONLY);
+    int fd = beneath_open(BENEATH_HOME, server_path_str, O_RDONLY, 0);
     if (fd == -1) {
         perror("openat failed");
         reader_unlock(lock);
@@ -570,15 +683,11 @@ int op_cd(char *args[], int arg_count) {
         return -1;
     }
     
-    if (check_path(args[0]) != 0) {
-        send_string("err-Invalid path");
-        return -1;
-    }
-
-    int new_fd = openat(current_dir_fd, args[0], O_RDONLY | O_DIRECTORY);
+    // Anywhere in the root directory, confined by the kernel
+    int new_fd = beneath_open(BENEATH_ROOT, args[0], O_RDONLY | O_DIRECTORY, 0);
     if (new_fd == -1) {
         perror("openat failed");
-        send_string("err-Error changing directory");
+        send_string(errno == EXDEV ? "err-Invalid path" : "err-Error changing directory");
         return -1;
     }
     close(current_dir_fd);
@@ -589,6 +698,7 @@ int op_cd(char *args[], int arg_count) {
     resolve_path(current_dir_path, args[0], resolved);
     strncpy(current_dir_path, resolved, 1281);
     current_dir_path[1281] = '\0';
+    beneath_chdir(current_dir_path);
     
     printf("[PID: %d] Changed directory to: %s\n", getpid(), current_dir_path);
     send_string("ok-Directory changed successfully.");
@@ -599,9 +709,39 @@ int op_cd(char *args[], int arg_count) {
  * Lists the contents of the specified directory.
  */
 int op_list(char *args[], int arg_count) {
+    long long limit = 0;
+    long long cursor = 0;
+    int generation = 0;
+    char *path = NULL;
+
+    // list [--limit N] [--cursor C] [--generation] [path]
+    for (int i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "--generation") == 0) {
+            generation = 1;
+        } else if ((strcmp(args[i], "--limit") == 0 || strcmp(args[i], "--cursor") == 0) && i + 1 < arg_count) {
+            char *end;
+            long long value = strtoll(args[i + 1], &end, 10);
+            if (*end != '\0' || value < 0) {
+                send_string("err-Usage: list [--limit N] [--cursor C] [--generation] [path]");
+                return -1;
+            }
+            if (args[i][2] == 'l') {
+                limit = value;
+            } else {
+                cursor = value;
+            }
+            i++;
+        } else if (path == NULL && args[i][0] != '-') {
+            path = args[i];
+        } else {
+            send_string("err-Usage: list [--limit N] [--cursor C] [--generation] [path]");
+            return -1;
+        }
+    }
+
     int dir_fd;
-    if (arg_count == 0) {
-        // if there aren't arguments, open the current directory
+    if (path == NULL) {
+        // if there isn't a path, open the current directory
         dir_fd = openat(current_dir_fd, ".", O_RDONLY | O_DIRECTORY);
         if (dir_fd == -1) {
             perror("openat failed");
@@ -609,100 +749,155 @@ int op_list(char *args[], int arg_count) {
             return -1;
         }
     } else {
-        if (check_path(args[0]) != 0) {
-            send_string("err-Invalid path");
-            return -1;
-        }
-        dir_fd = openat(current_dir_fd, args[0], O_RDONLY | O_DIRECTORY);
+        dir_fd = beneath_open(BENEATH_ROOT, path, O_RDONLY | O_DIRECTORY, 0);
         if (dir_fd == -1) {
             perror("openat failed");
-            send_string("err-Error listing directory");
+            send_string(errno == EXDEV ? "err-Invalid path" : "err-Error listing directory");
             return -1;
         }
     }
 
-    // open directory
-    DIR *d = fdopendir(dir_fd);
-    if (!d) {
-        perror("fdopendir failed");
+    // Generation of the directory, it changes whenever the listing does
+    if (generation) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "ok-generation: %llu", dircache_generation(dir_fd, path));
+        send_string(msg);
         close(dir_fd);
-        send_string("err-Error listing directory");
-        return -1;
+        return 0;
     }
 
-    struct dirent *dir;
-    struct stat st;
-    char buffer[1024];
-    char line[512];
-    
-    // Initialize buffer
-    buffer[0] = '\0';
-    strcat(buffer, "ok-\n");
-
-    // Read directory and store information in buffer
-    while ((dir = readdir(d)) != NULL) {
-        if (fstatat(dir_fd, dir->d_name, &st, 0) == -1) {
-            continue;
+    // Full listings come from the shared cache when it is up to date, and fill it otherwise
+    int fill_slot = -1;
+    if (limit == 0 && cursor == 0) {
+        if (dircache_list(dir_fd) == 0) {
+            close(dir_fd);
+            return 0;
         }
-        
-        snprintf(line, sizeof(line), "%s\tSize: %ld\tPerms: %o\n", dir->d_name, st.st_size, st.st_mode & 0777);
-                 
-        if (strlen(buffer) + strlen(line) < sizeof(buffer) - 1) {
-            strcat(buffer, line);
+        fill_slot = dircache_begin(dir_fd, path);
+    }
+
+    int ret = list_stream(dir_fd, limit, cursor, fill_slot);
+    close(dir_fd);
+    return ret;
+}
+
+/*
+ * Parses the optional -offset=<num> and -length=<num> flags that precede the path.
+ * A length of 0 means "up to the end of the file".
+ * Returns the path argument, NULL if the arguments are malformed.
+ */
+static char *parse_range_args(char *args[], int arg_count, long *offset, long *length, int *has_offset) {
+    int i;
+    *offset = 0;
+    *length = 0;
+    *has_offset = 0;
+
+    for (i = 0; i < arg_count - 1; i++) {
+        if (strncmp(args[i], "-offset=", 8) == 0) {
+            *offset = atol(args[i] + 8);
+            *has_offset = 1;
+        } else if (strncmp(args[i], "-length=", 8) == 0) {
+            *length = atol(args[i] + 8);
         } else {
-            send_string(buffer);
-            buffer[0] = '\0';
-            strcat(buffer, line); 
+            return NULL;
         }
     }
-    
-    // Send buffer if it's not empty
-    if (strlen(buffer) > 0) {
-        send_string(buffer);
+    if (arg_count - i != 1 || *offset < 0 || *length < 0) {
+        return NULL;
     }
-    
-    closedir(d); // Closes dir_fd
-    return 0;
+    return args[i];
+}
+
+/*
+ * Serves a read of a small file without taking the lock.
+ * The data is read, then the slot version is checked: if a writer got in, the read is retried.
+ * Returns 0 if the read was served, -1 if the caller must fall back to the locked path.
+ */
+static int optimistic_read(char *path, char *resolved, long offset, long length) {
+    char buf[OPTIMISTIC_READ_MAX + 1];
+    struct stat st;
+
+    int fd = beneath_open(BENEATH_HOME, path, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > OPTIMISTIC_READ_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    size_t want = sizeof(buf); // one extra byte detects a file that grew past the limit
+    if (length > 0 && (size_t)length < want) want = length;
+
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_RETRIES; attempt++) {
+        ReadTicket ticket;
+        if (optimistic_read_begin(resolved, &ticket) != 0) {
+            break; // a writer holds the file
+        }
+
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 || n > OPTIMISTIC_READ_MAX) {
+            break;
+        }
+        if (optimistic_read_validate(&ticket) != 0) {
+            continue; // raced with a writer, read again
+        }
+
+        close(fd);
+        send_string("ok-\n");
+        if (n > 0) {
+            write(sockfd, buf, n);
+            if (buf[n-1] != '\n') {
+                write(sockfd, "\n", 1);
+            }
+        }
+        return 0;
+    }
+
+    close(fd);
+    return -1;
 }
 
 /*
  * Reads a file at the specified path.
+ * Small files are first read optimistically, without the lock.
  * If an offset is provided, reads from that offset.
+ * If a length is provided, reads at most that many bytes.
+ * Only the byte range being read is locked.
  */
 int op_read(char *args[], int arg_count) {
-    char *path = args[0];
-    long offset = 0;
+    long offset, length;
+    int has_offset;
+    char *path = parse_range_args(args, arg_count, &offset, &length, &has_offset);
 
-    // Check arguments for offset
-    if (arg_count == 2) {
-        if (strncmp(args[0], "-offset=", 8) == 0) {
-            offset = atol(args[0] + 8);
-            path = args[1];
-        } else {
-            send_string("err-Usage: read [-offset=<num>] <path>");
-            return -1;
-        }
-    } else if (arg_count != 1) {
-        send_string("err-Usage: read [-offset=<num>] <path>");
+    if (path == NULL) {
+        send_string("err-Usage: read [-offset=<num>] [-length=<num>] <path>");
         return -1;
     }
 
-    if (check_path_mine(path) != 0) {
+    char resolved[2048];
+    if (resolve_path_mine(path, resolved, sizeof(resolved)) != 0) {
         send_string("err-Invalid path");
         return -1;
     }
 
-    char resolved[2048];
-    resolve_path(current_dir_path, path, resolved);
+    // Fast path: no lock round trips for small files nobody is writing
+    if (optimistic_read(path, resolved, offset, length) == 0) {
+        return 0;
+    }
 
-    // Get file lock and acquire reader lock
+    // Get file lock and acquire a shared lock on the requested range
     FileLock *lock = get_file_lock(resolved);
-    reader_lock(lock);
+    if (range_lock(lock, offset, length, 0, READ_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        send_string("err-Timed out waiting for the file lock");
+        return -1;
+    }
 
     // Open file
-    int fd = openat(current_dir_fd, path, O_RDONLY);
+    int fd = beneath_open(BENEATH_HOME, path, O_RDONLY, 0);
     if (fd == -1) {
-        reader_unlock(lock);
+        range_unlock(lock, offset, length);
         release_file_lock(lock);
         send_string("err-Error reading file");
         return -1;
@@ -711,7 +906,7 @@ int op_read(char *args[], int arg_count) {
     // Seek to offset if provided
     if (offset > 0) {
         if (lseek(fd, offset, SEEK_SET) == -1) {
-            reader_unlock(lock);
+            range_unlock(lock, offset, length);
             release_file_lock(lock);
             close(fd);
             send_string("err-Error seeking file");
@@ -722,13 +917,18 @@ int op_read(char *args[], int arg_count) {
     // Send header (ok-)
     send_string("ok-\n");
 
-    // Read file and send it to client
+    // Read file and send it to client, stopping at the end of the range
     char buf[1024];
     int n;
+    long remaining = length;
     char last_char = '\n';
-    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    while ((n = read(fd, buf, (length > 0 && remaining < (long)sizeof(buf)) ? (size_t)remaining : sizeof(buf))) > 0) {
         write(sockfd, buf, n);
         last_char = buf[n-1];
+        if (length > 0) {
+            remaining -= n;
+            if (remaining == 0) break;
+        }
     }
     
     // Add newline if last character was not a newline
@@ -738,45 +938,86 @@ int op_read(char *args[], int arg_count) {
     
     // Close file and release lock
     close(fd);
-    reader_unlock(lock);
+    range_unlock(lock, offset, length);
     release_file_lock(lock);
     return 0;
 }
 
+/*
+ * Writes a chunk of op_write() at the current offset of fd, ending at end,
+ * and charges the bytes it adds past the end of the file.
+ * Writers of disjoint ranges can extend the file at the same time, so the
+ * size is read, charged and grown while holding the RANGE_GROW byte, which
+ * the caller already holds when its range runs to the end of the file:
+ * each byte is charged once.
+ * Returns 0, -1 if the write failed, -2 if it would go over the quota.
+ */
+static int write_charged(FileLock *lock, int holds_grow, int fd, const char *buf, int n, long end){
+    struct stat st;
+    if (fstat(fd, &st) == 0 && end <= st.st_size) {
+        return write(fd, buf, n) == n ? 0 : -1; // inside the file, its size cannot shrink under our lock
+    }
+
+    if (!holds_grow && range_lock(lock, RANGE_GROW, 1, 1, WRITE_LOCK_TIMEOUT) != 0) {
+        return -1;
+    }
+    int ret = 0;
+    long long before = (fstat(fd, &st) == 0) ? st.st_size : end;
+    long long charged = (end > before) ? end - before : 0;
+    if (charged > 0 && quota_charge(username, charged, 0) < 0) {
+        ret = -2;
+    } else {
+        if (write(fd, buf, n) != n) {
+            perror("write failed");
+            ret = -1;
+        }
+        // Charge what the file actually grew by
+        long long after = (fstat(fd, &st) == 0) ? st.st_size : before + charged;
+        if (after - before != charged) {
+            quota_charge(username, (after - before) - charged, 0);
+        }
+    }
+    if (!holds_grow) {
+        range_unlock(lock, RANGE_GROW, 1);
+    }
+    return ret;
+}
+
 /*
  * Writes to a file at the specified path.
- * If an offset is provided, writes from that offset.
+ * If an offset is provided, writes from that offset and locks only [offset, offset + length),
+ * so writers of disjoint regions proceed in parallel.
+ * Without an offset the file is truncated, which needs the whole-file lock.
+ * If a length is provided, data beyond it is discarded.
  */
 int op_write(char *args[], int arg_count) {
-    char *path = args[0];
-    long offset = 0;
-    int has_offset = 0;
-
-    // Check arguments for offset
-    if (arg_count == 2) {
-        if (strncmp(args[0], "-offset=", 8) == 0) {
-            offset = atol(args[0] + 8);
-            path = args[1];
-            has_offset = 1;
-        } else {
-            send_string("err-Usage: write [-offset=<num>] <path>");
-            return -1;
-        }
-    } else if (arg_count != 1) {
-        send_string("err-Usage: write [-offset=<num>] <path>");
+    long offset, length;
+    int has_offset;
+    char *path = parse_range_args(args, arg_count, &offset, &length, &has_offset);
+
+    if (path == NULL) {
+        send_string("err-Usage: write [-offset=<num>] [-length=<num>] <path>");
         return -1;
     }
 
-    if (check_path_mine(path) != 0) {
+    char resolved[2048];
+    if (resolve_path_mine(path, resolved, sizeof(resolved)) != 0) {
         send_string("err-Invalid path");
         return -1;
     }
-    char resolved[2048];
-    resolve_path(current_dir_path, path, resolved);
 
-    // Get file lock and acquire writer lock
+    // Truncating touches every byte, so it locks the whole file
+    long lock_offset = has_offset ? offset : 0;
+    long lock_length = has_offset ? length : 0;
+    int holds_grow = lock_length <= 0 || lock_offset > RANGE_GROW - lock_length; // the range covers RANGE_GROW
+
+    // Get file lock and acquire an exclusive lock on the range
     FileLock *lock = get_file_lock(resolved);
-    writer_lock(lock);
+    if (range_lock(lock, lock_offset, lock_length, 1, WRITE_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        send_string("err-Timed out waiting for the file lock");
+        return -1;
+    }
 
     // if offset is not provided, truncate file
     int flags = O_WRONLY | O_CREAT;
@@ -784,10 +1025,21 @@ int op_write(char *args[], int arg_count) {
         flags |= O_TRUNC;
     }
     
+    // Charge a new file, a truncated one gives its size back
+    struct stat old_st;
+    int existed = beneath_stat(BENEATH_HOME, path, &old_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(old_st.st_mode);
+    if (!existed && quota_charge(username, 0, 1) < 0) {
+        range_unlock(lock, lock_offset, lock_length);
+        release_file_lock(lock);
+        send_string("err-Quota exceeded");
+        return -1;
+    }
+
     // if the file does not exist it is created with permission 0700
-    int fd = openat(current_dir_fd, path, flags, 0700);
+    int fd = beneath_open(BENEATH_HOME, path, flags, 0700);
     if (fd == -1) {
-        writer_unlock(lock);
+        if (!existed) quota_charge(username, 0, -1);
+        range_unlock(lock, lock_offset, lock_length);
         release_file_lock(lock);
         send_string("err-Error opening file for writing");
         return -1;
@@ -796,7 +1048,7 @@ int op_write(char *args[], int arg_count) {
     // if offset is provided, seek to offset
     if (has_offset && offset > 0) {
         if (lseek(fd, offset, SEEK_SET) == -1) {
-            writer_unlock(lock);
+            range_unlock(lock, lock_offset, lock_length);
             release_file_lock(lock);
             close(fd);
             send_string("err-Error seeking file");
@@ -804,30 +1056,61 @@ int op_write(char *args[], int arg_count) {
         }
     }
 
+    // Only the bytes written past the end of the file grow the usage, see write_charged()
+    if (existed && !has_offset) {
+        quota_charge(username, -old_st.st_size, 0);
+    }
+
     send_string("ok-Waiting for data... (Type 'EOF' to finish)");
 
     // receive data from client and write to file
     char buf[1024];
     int n;
+    long written = 0;
+    int discarded = 0;
+    int failed = 0;
+    int over_quota = 0;
     while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
         if (n >= 4 && strncmp(buf, "EOF\n", 4) == 0) {
             break;
         }
-        if (write(fd, buf, n) != n) {
-            writer_unlock(lock);
-            release_file_lock(lock);
-            close(fd);
-            perror("write failed");
-            break; 
+        if (failed) continue; // drain the data until EOF
+
+        // Keep the write inside the locked range
+        if (length > 0 && written + n > length) {
+            n = length - written;
+            discarded = 1;
+        }
+        long end = (has_offset ? offset : 0) + written + n;
+        int ret = (n > 0) ? write_charged(lock, holds_grow, fd, buf, n, end) : 0;
+        if (ret == -2) {
+            over_quota = 1;
+        }
+        if (ret < 0) {
+            failed = 1;
+            continue;
         }
+        written += n;
     }
     
     // close file and release lock
     close(fd);
-    writer_unlock(lock);
+    range_unlock(lock, lock_offset, lock_length);
     release_file_lock(lock);
 
-    send_string("ok-File written successfully.");
+    if (over_quota) {
+        send_string("err-Quota exceeded, write incomplete");
+        return -1;
+    }
+    if (failed) {
+        send_string("err-Error writing file");
+        return -1;
+    }
+    if (discarded) {
+        send_string("ok-File written successfully (data beyond -length discarded).");
+    } else {
+        send_string("ok-File written successfully.");
+    }
     return 0;
 }
 
@@ -842,30 +1125,51 @@ int op_delete(char *args[], int arg_count) {
     
     char *path = args[0];
     
-    if (check_path_mine(path) != 0) {
+    char resolved[2048];
+    if (resolve_path_mine(path, resolved, sizeof(resolved)) != 0) {
         send_string("err-Invalid path");
         return -1;
     }
 
-    char resolved[2048];
-    resolve_path(current_dir_path, path, resolved);
-
     // Get file lock and acquire writer lock
     FileLock *lock = get_file_lock(resolved);
-    writer_lock(lock);
+    if (writer_lock(lock, DELETE_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        send_string("err-Timed out waiting for the file lock");
+        return -1;
+    }
+
+    char name[NAME_MAX + 1];
+    int parent_fd = beneath_parent(BENEATH_HOME, path, name, sizeof(name));
+    if (parent_fd == -1) {
+        writer_unlock(lock);
+        release_file_lock(lock);
+        send_string("err-Invalid path");
+        return -1;
+    }
+
+    // What the entry counts for in the quota, given back once it is gone
+    struct stat st;
+    long long freed_bytes = 0;
+    int is_file = fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+    if (is_file) {
+        freed_bytes = st.st_size;
+    }
 
     // Try to remove as file
-    if (unlinkat(current_dir_fd, path, 0) == -1) {
+    if (unlinkat(parent_fd, name, 0) == -1) {
         // If it fails because it is a directory, try to remove as directory
         if (errno == EISDIR) {
-            if (unlinkat(current_dir_fd, path, AT_REMOVEDIR) == -1) {
+            if (unlinkat(parent_fd, name, AT_REMOVEDIR) == -1) {
                 perror("unlinkat dir failed");
+                close(parent_fd);
                 send_string("err-Error deleting directory");
                 writer_unlock(lock);
                 release_file_lock(lock);
                 return -1;
             }
         } else {
+            close(parent_fd);
             writer_unlock(lock);
             release_file_lock(lock);
             perror("unlinkat file failed");
@@ -873,7 +1177,13 @@ int op_delete(char *args[], int arg_count) {
             return -1;
         }
     }
-    
+    close(parent_fd);
+    if (!is_file) {
+        tree_changed(); // cached directory handles may point elsewhere now
+    }
+
+    quota_charge(username, -freed_bytes, -1);
+
     // close file and release lock
     writer_unlock(lock);
     release_file_lock(lock);
@@ -886,38 +1196,107 @@ int op_delete(char *args[], int arg_count) {
     return 0;
 }
 
+/*
+ * Checks that a glob matches at least one entry of its directory.
+ */
+static int glob_has_match(const char *path){
+    char dir[PATH_LENGTH];
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+
+    char *slash = strrchr(dir, '/');
+    const char *pattern = path;
+    const char *dir_path = ".";
+    if (slash != NULL) {
+        *slash = '\0';
+        pattern = slash + 1;
+        dir_path = (dir[0] != '\0') ? dir : "/";
+    }
+    if (strpbrk(dir_path, "*?[") != NULL) return 0; // only the last component may be a pattern
+
+    int fd = beneath_open(BENEATH_HOME, dir_path, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0) return 0;
+    DIR *d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return 0;
+    }
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(d)) != NULL) {
+        found = strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+                fnmatch(pattern, entry->d_name, FNM_PERIOD) == 0;
+    }
+    closedir(d);
+    return found;
+}
+
 /*
  * Sends a transfer request to the destination user.
  */
 int op_transfer_request(char *args[], int arg_count){
     char path[PATH_LENGTH];
     
+    char *receivers[TRANSFER_MAX_RECIPIENTS];
+    int receiver_count = 0;
+    
     if(arg_count != 2){
-        send_string("err-Usage: transfer_request <path> <dest_user>");
+        send_string("err-Usage: transfer_request <path> <dest_user>[,<dest_user>...]");
         return -1;
     }
 
-    if(check_path_mine(args[0]) != 0){
+    if(resolve_path_mine(args[0], path, sizeof(path)) != 0){
         send_string("err-Invalid path");
         return -1;
     }
 
-    if(user_exists(args[1])){
+    // recipients are comma separated, each is checked before any request is sent
+    for (char *save, *name = strtok_r(args[1], ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        int dup = 0;
+        for (int k = 0; k < receiver_count; k++) {
+            dup |= strcmp(receivers[k], name) == 0;
+        }
+        if (dup) continue;
+        if (receiver_count == TRANSFER_MAX_RECIPIENTS) {
+            send_string("err-Too many recipients");
+            return -1;
+        }
+        if(user_exists(name)){
+            send_string("err-Invalid user");
+            return -1;
+        }
+        receivers[receiver_count++] = name;
+    }
+    if (receiver_count == 0) {
         send_string("err-Invalid user");
         return -1;
     }
-    resolve_path(current_dir_path, args[0], path);
 
-    // Get file lock and acquire reader lock
-    FileLock *lock = get_file_lock(path);
-    reader_lock(lock);
-
-    // create request
-    create_request(username, path, args[1]);
+    // A file, a directory (copied recursively) or a glob on the last component
+    struct stat st;
+    if (copy_is_glob(args[0])) {
+        if (!glob_has_match(args[0])) {
+            send_string("err-No file matches the pattern");
+            return -1;
+        }
+    } else if (beneath_stat(BENEATH_HOME, args[0], &st, 0) == -1 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+        send_string("err-Not a regular file or directory");
+        return -1;
+    }
 
-    // close file and release lock
-    reader_unlock(lock);
-    release_file_lock(lock);
+    // create one request per recipient, the copy worker locks the files when a receiver accepts.
+    // Several recipients form a group whose acceptances share one staged copy, named after
+    // the first request: if that one cannot be queued the command fails as a whole.
+    int group = (receiver_count > 1) ? -1 : 0;
+    for (int k = 0; k < receiver_count; k++) {
+        int id = create_request(username, path, receivers[k], group);
+        if (id < 0 && k == 0) {
+            return -1;
+        }
+        if (group == -1) {
+            group = id;
+        }
+    }
     
     return 0;
 }
@@ -939,12 +1318,11 @@ int op_accept(char *args[], int arg_count){
         return -1;
     }
 
-    if(check_path_mine(args[0]) != 0){
+    if(resolve_path_mine(args[0], path, sizeof(path)) != 0){
         send_string("err-Invalid path");
         return -1;
     }
 
-    resolve_path(current_dir_path, args[0], path);
     accept_req(id, path);
 
     return 0;
@@ -968,4 +1346,154 @@ int op_reject(char *args[], int arg_count){
     reject_req(id);
 
     return 0;
-}
\ No newline at end of file
+}
+/*
+ * Lists the transfer requests waiting for the user.
+ */
+int op_pending(char *args[], int arg_count){
+    (void)args;
+    if(arg_count != 0){
+        send_string("err-Usage: pending");
+        return -1;
+    }
+
+    pending_req();
+
+    return 0;
+}
+
+/*
+ * Shows the outstanding transfer requests sent by the user.
+ */
+int op_status(char *args[], int arg_count){
+    if(arg_count > 1){
+        send_string("err-Usage: status [req_id]");
+        return -1;
+    }
+
+    int id = 0;
+    if (arg_count == 1) {
+        id = atoi(args[0]);
+        if(id <= 0){
+            send_string("err-Invalid request id");
+            return -1;
+        }
+    }
+
+    status_req(id);
+
+    return 0;
+}
+
+/*
+ * Cancels a transfer request sent by the user.
+ */
+int op_cancel(char *args[], int arg_count){
+    if(arg_count != 1){
+        send_string("err-Usage: cancel <req_id>");
+        return -1;
+    }
+
+    int id = atoi(args[0]);
+    if(id <= 0){
+        send_string("err-Invalid request id");
+        return -1;
+    }
+
+    cancel_req(id);
+
+    return 0;
+}
+
+/*
+ * Parses the argument of -size: [<|>]N with an optional k, M or G suffix.
+ */
+static int parse_size(const char *arg, int *cmp, long long *size){
+    *cmp = (*arg == '<') ? -1 : (*arg == '>') ? 1 : 0;
+    if (*cmp != 0) arg++;
+    char *end;
+    *size = strtoll(arg, &end, 10);
+    if (end == arg || *size < 0) return -1;
+    switch (*end) {
+        case 'k': *size <<= 10; end++; break;
+        case 'M': *size <<= 20; end++; break;
+        case 'G': *size <<= 30; end++; break;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Searches a tree on the server, see find.c.
+ * find [path] [-name glob] [-size [<|>]N[k|M|G]] [-newer <seconds since the epoch>|<file>]
+ */
+int op_find(char *args[], int arg_count){
+    find_job *job = calloc(1, sizeof(find_job));
+    if (job == NULL) {
+        send_string("err-Out of memory");
+        return -1;
+    }
+    const char *path = ".";
+    job->size_cmp = 2;
+
+    int i = 0;
+    if (arg_count > 0 && args[0][0] != '-') {
+        path = args[i++];
+    }
+    for (; i < arg_count; i += 2) {
+        if (i + 1 >= arg_count) {
+            i = -1;
+            break;
+        }
+        if (strcmp(args[i], "-name") == 0) {
+            job->name = args[i + 1];
+        } else if (strcmp(args[i], "-size") == 0) {
+            if (parse_size(args[i + 1], &job->size_cmp, &job->size) < 0) {
+                i = -1;
+                break;
+            }
+        } else if (strcmp(args[i], "-newer") == 0) {
+            char *end;
+            long long seconds = strtoll(args[i + 1], &end, 10);
+            struct stat st;
+            if (*end == '\0' && end != args[i + 1]) {
+                job->newer_than.tv_sec = seconds;
+            } else if (beneath_stat(BENEATH_ROOT, args[i + 1], &st, 0) == 0) {
+                job->newer_than = st.st_mtim;
+            } else {
+                free(job);
+                send_string("err-Reference file not found");
+                return -1;
+            }
+            job->newer = 1;
+        } else {
+            i = -1;
+            break;
+        }
+    }
+    if (i < 0) {
+        free(job);
+        send_string("err-Usage: find [path] [-name glob] [-size [<|>]N[k|M|G]] [-newer seconds|file]");
+        return -1;
+    }
+
+    // Anywhere list can go
+    job->root_fd = beneath_open(BENEATH_ROOT, path, O_RDONLY | O_DIRECTORY, 0);
+    if (job->root_fd == -1) {
+        free(job);
+        send_string(errno == EXDEV ? "err-Invalid path" : "err-Error opening directory");
+        return -1;
+    }
+
+    // Printed as given, without the trailing slashes
+    char prefix[PATH_RESOLVED_MAX];
+    snprintf(prefix, sizeof(prefix), "%s", path);
+    size_t len = strlen(prefix);
+    while (len > 1 && prefix[len - 1] == '/') prefix[--len] = '\0';
+    job->prefix = prefix;
+
+    int ret = find_run(job);
+    printf("[PID: %d] find %s: %lld matches in %lld directories\n", getpid(), path, job->matches, job->dirs);
+    close(job->root_fd);
+    free(job);
+    return ret;
+}
@@ -0,0 +1,52 @@
+#include "path.h"
+#include <string.h>
+
+/*
+ * Resolves path against base in a single pass, without allocating:
+ * "." and empty components are dropped, ".." removes the last component
+ * written (never above "/"). base must already be resolved.
+ * The result goes to out, which is also the working buffer.
+ * Returns its length, or -1 if it does not fit in size bytes.
+ */
+int canon_path(const char *base, const char *path, char *out, size_t size){
+    size_t len = strlen(base);
+    if (len == 1 && base[0] == '/') len = 0; // "/" is written as the empty prefix
+    if (len + 2 > size) {
+        if (size > 0) out[0] = '\0';
+        return -1;
+    }
+    memmove(out, base, len);
+
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        const char *start = p;
+        while (*p && *p != '/') p++;
+        size_t n = p - start;
+
+        if (n == 0 || (n == 1 && start[0] == '.')) continue;
+        if (n == 2 && start[0] == '.' && start[1] == '.') {
+            while (len > 0 && out[--len] != '/');
+            continue;
+        }
+        if (len + 1 + n + 1 > size) {
+            out[0] = '\0';
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, start, n);
+        len += n;
+    }
+
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return (int)len;
+}
+
+/*
+ * Tells whether a resolved path is prefix itself or lies below it.
+ */
+int path_within(const char *resolved, size_t len, const char *prefix, size_t prefix_len){
+    return len >= prefix_len && memcmp(resolved, prefix, prefix_len) == 0 &&
+           (len == prefix_len || resolved[prefix_len] == '/' || prefix_len == 1); // "/" contains everything
+}
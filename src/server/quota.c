@@ -0,0 +1,376 @@
+#include "server.h"
+#include "common.h"
+#include "users.h"
+#include "user_store.h"
+#include "quota.h"
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+
+extern ClientSession sessions[];
+
+static quota_table *table = NULL; // Created by the parent before any session is forked
+static int quota_dir_fd = -1;
+static unsigned long long saved_changes = 0; // Parent: table->changes at the last save
+static time_t last_save = 0;
+static time_t last_reconcile = 0;
+
+/*
+ * FNV-1a hash of a username.
+ */
+static unsigned int hash_name(const char *name){
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Finds the entry of a user, open addressing with linear probing.
+ * With create, a missing entry is claimed with a compare-and-swap, so that
+ * several processes can add users at the same time. Entries are never removed.
+ */
+static quota_entry *entry_get(const char *user, int create){
+    if (table == NULL || user[0] == '\0' || strnlen(user, USERNAME_LENGTH) >= USERNAME_LENGTH) return NULL;
+
+    unsigned int h = hash_name(user);
+    for (unsigned int i = 0; i < QUOTA_SLOTS; i++) {
+        quota_entry *e = &table->entries[(h + i) & (QUOTA_SLOTS - 1)];
+        int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+        if (state == QUOTA_EMPTY) {
+            if (!create) return NULL;
+            if (__atomic_compare_exchange_n(&e->state, &state, QUOTA_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                e->hash = h;
+                strcpy(e->name, user);
+                __atomic_store_n(&e->state, QUOTA_READY, __ATOMIC_RELEASE);
+                return e;
+            }
+            // Lost the race, state now holds the winner's value
+        }
+        while (state == QUOTA_CLAIMED) {
+            sched_yield();
+            state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        }
+        if (e->hash == h && strcmp(e->name, user) == 0) return e;
+    }
+    printf("[QUOTA] quota table full, %s is not limited\n", user);
+    return NULL;
+}
+
+/*
+ * Adds delta to a counter unless it would go over max (0 for no limit).
+ * Decreases always succeed.
+ */
+static int counter_add(long long *counter, long long delta, long long max){
+    long long cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    do {
+        if (delta > 0 && max > 0 && cur + delta > max) return -1;
+    } while (!__atomic_compare_exchange_n(counter, &cur, cur + delta, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Charges bytes and inodes to a user, negative values give them back.
+ * O(1), nothing is read from the disk.
+ * Returns -1, charging nothing, if an increase would go over the user's limits.
+ */
+int quota_charge(const char *user, long long bytes, long long inodes){
+    quota_entry *e = entry_get(user, 1);
+    if (e == NULL) return 0;
+
+    if (counter_add(&e->bytes, bytes, __atomic_load_n(&e->max_bytes, __ATOMIC_RELAXED)) < 0) {
+        return -1;
+    }
+    if (counter_add(&e->inodes, inodes, __atomic_load_n(&e->max_inodes, __ATOMIC_RELAXED)) < 0) {
+        counter_add(&e->bytes, -bytes, 0);
+        return -1;
+    }
+    __atomic_add_fetch(&table->changes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Sets the limits of a user, 0 for no limit.
+ */
+int quota_set(const char *user, long long max_bytes, long long max_inodes){
+    quota_entry *e = entry_get(user, 1);
+    if (e == NULL) return -1;
+    __atomic_store_n(&e->max_bytes, max_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->max_inodes, max_inodes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&table->changes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Tells whether a reconciliation scan is running. The scanner clears its
+ * pid when done, one that was killed is noticed here.
+ */
+static int reconcile_running(){
+    pid_t pid = __atomic_load_n(&table->reconciler, __ATOMIC_ACQUIRE);
+    if (pid != 0 && kill(pid, 0) < 0) {
+        __atomic_compare_exchange_n(&table->reconciler, &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return pid != 0;
+}
+
+static void format_limit(char *buf, size_t size, long long max){
+    if (max > 0) {
+        snprintf(buf, size, "%lld", max);
+    } else {
+        snprintf(buf, size, "unlimited");
+    }
+}
+
+void quota_print(const char *user){
+    quota_entry *e = entry_get(user, 0);
+    long long bytes = 0, inodes = 0, max_bytes = 0, max_inodes = 0;
+    if (e != NULL) {
+        bytes = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+        inodes = __atomic_load_n(&e->inodes, __ATOMIC_RELAXED);
+        max_bytes = e->max_bytes;
+        max_inodes = e->max_inodes;
+    }
+
+    char bytes_limit[32], inodes_limit[32];
+    format_limit(bytes_limit, sizeof(bytes_limit), max_bytes);
+    format_limit(inodes_limit, sizeof(inodes_limit), max_inodes);
+    printf("%s: %lld/%s bytes, %lld/%s files%s\n", user, bytes, bytes_limit, inodes, inodes_limit,
+           table != NULL && reconcile_running() ? " (reconciliation running)" : "");
+}
+
+/*
+ * Loads quotas.dat into the table.
+ */
+static void load_file(){
+    restore_privileges();
+    int fd = openat(quota_dir_fd, QUOTA_FILE, O_RDONLY);
+    minimize_privileges();
+    if (fd < 0) return;
+
+    quota_record rec;
+    int count = 0;
+    while (read(fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec)) {
+        rec.name[USERNAME_LENGTH - 1] = '\0';
+        quota_entry *e = entry_get(rec.name, 1);
+        if (e == NULL) continue;
+        e->bytes = rec.bytes;
+        e->inodes = rec.inodes;
+        e->max_bytes = rec.max_bytes;
+        e->max_inodes = rec.max_inodes;
+        count++;
+    }
+    close(fd);
+    printf("[PARENT] quotas loaded for %d users\n", count);
+}
+
+/*
+ * Creates the shared table and loads the saved usage and limits.
+ * Must be called before the sessions and workers are forked.
+ */
+int quota_init(int dir_fd){
+    table = mmap(NULL, sizeof(quota_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap quota table");
+        table = NULL;
+        return -1;
+    }
+    quota_dir_fd = dir_fd;
+    load_file();
+    saved_changes = table->changes;
+    last_save = time(NULL);
+    return 0;
+}
+
+/*
+ * Writes the table to quotas.dat, through a temporary file renamed into place.
+ * Only the parent saves.
+ */
+int quota_save(){
+    if (table == NULL) return -1;
+    unsigned long long changes = __atomic_load_n(&table->changes, __ATOMIC_RELAXED);
+
+    restore_privileges();
+    int fd = openat(quota_dir_fd, QUOTA_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    minimize_privileges();
+    if (fd < 0) {
+        perror("openat quota file");
+        return -1;
+    }
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    quota_record rec;
+    for (int i = 0; i < QUOTA_SLOTS; i++) {
+        quota_entry *e = &table->entries[i];
+        if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) != QUOTA_READY) continue;
+        memset(&rec, 0, sizeof(rec));
+        strcpy(rec.name, e->name);
+        rec.bytes = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+        rec.inodes = __atomic_load_n(&e->inodes, __ATOMIC_RELAXED);
+        rec.max_bytes = e->max_bytes;
+        rec.max_inodes = e->max_inodes;
+        fwrite(&rec, sizeof(rec), 1, f);
+    }
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+
+    restore_privileges();
+    if (!ok || renameat(quota_dir_fd, QUOTA_FILE ".tmp", quota_dir_fd, QUOTA_FILE) < 0) {
+        perror("quota file");
+        unlinkat(quota_dir_fd, QUOTA_FILE ".tmp", 0);
+        minimize_privileges();
+        return -1;
+    }
+    minimize_privileges();
+    saved_changes = changes;
+    return 0;
+}
+
+/*
+ * Adds up the files below a directory, the directory itself is not counted.
+ */
+static void scan_dir(int dir_fd, long long *bytes, long long *inodes){
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        close(dir_fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        (*inodes)++;
+        if (S_ISREG(st.st_mode)) {
+            *bytes += st.st_size;
+        } else if (S_ISDIR(st.st_mode)) {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (fd >= 0) {
+                scan_dir(fd, bytes, inodes);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Body of the reconciliation process: walks the folder of every user and
+ * corrects the counters by the difference between what it found and what
+ * they held when the walk started, so that the updates made by the sessions
+ * meanwhile are kept.
+ */
+static void reconcile_main(){
+    int fd = openat(quota_dir_fd, ".", O_RDONLY | O_DIRECTORY); // a dup() would share the parent's offset
+    DIR *root = fd >= 0 ? fdopendir(fd) : NULL;
+    if (root == NULL) {
+        perror("[QUOTA] opendir root");
+        return;
+    }
+
+    int users = 0, fixed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(root)) != NULL) {
+        if (entry->d_name[0] == '.' || user_exists(entry->d_name) != 0) continue;
+        int home_fd = openat(dirfd(root), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (home_fd < 0) continue;
+        quota_entry *e = entry_get(entry->d_name, 1);
+        if (e == NULL) {
+            close(home_fd);
+            continue;
+        }
+
+        long long start_bytes = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+        long long start_inodes = __atomic_load_n(&e->inodes, __ATOMIC_RELAXED);
+        long long bytes = 0, inodes = 0;
+        scan_dir(home_fd, &bytes, &inodes);
+
+        if (bytes != start_bytes || inodes != start_inodes) {
+            printf("[QUOTA] %s: %lld bytes and %lld files were counted, %lld and %lld found\n",
+                   entry->d_name, start_bytes, start_inodes, bytes, inodes);
+            __atomic_add_fetch(&e->bytes, bytes - start_bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&e->inodes, inodes - start_inodes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&table->changes, 1, __ATOMIC_RELAXED);
+            fixed++;
+        }
+        users++;
+    }
+    closedir(root);
+    printf("[QUOTA] reconciled %d users, %d corrected\n", users, fixed);
+}
+
+/*
+ * Starts a reconciliation scan in a forked process, at low priority.
+ * Returns -1 if one is already running.
+ */
+int quota_reconcile_start(){
+    if (table == NULL) return -1;
+    last_reconcile = time(NULL);
+    if (reconcile_running()) return -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork quota reconciler");
+        return -1;
+    }
+    if (pid == 0) {
+        // Don't keep the session channels open, their peers rely on EOF
+        for (int k = 0; k < MAX_CLIENTS; k++) {
+            if (sessions[k].pid != -1) {
+                close(sessions[k].pipe_fd_read);
+                close(sessions[k].pipe_fd_write);
+            }
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // If parent dies, send SIGKILL to this process
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1) {
+            _exit(0);
+        }
+        user_store_detach();
+        if (nice(10) == -1) {
+            perror("nice");
+        }
+        restore_privileges(); // the folders belong to their users
+        reconcile_main();
+
+        pid_t self = getpid();
+        __atomic_compare_exchange_n(&table->reconciler, &self, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    __atomic_store_n(&table->reconciler, pid, __ATOMIC_RELEASE);
+    printf("[QUOTA] reconciliation started (pid %d)\n", pid);
+    return 0;
+}
+
+/*
+ * Called by the parent from its main loop: saves the counters now and then,
+ * and reconciles them with the disk every QUOTA_RECONCILE_INTERVAL.
+ */
+void quota_tick(){
+    if (table == NULL) return;
+    time_t now = time(NULL);
+
+    if (now - last_save >= QUOTA_SAVE_INTERVAL) {
+        last_save = now;
+        if (__atomic_load_n(&table->changes, __ATOMIC_RELAXED) != saved_changes) {
+            quota_save();
+        }
+    }
+    if (now - last_reconcile >= QUOTA_RECONCILE_INTERVAL) {
+        quota_reconcile_start();
+    }
+}
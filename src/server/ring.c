@@ -0,0 +1,104 @@
+#include "ring.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+/*
+ * Empties a ring. Only valid while no process uses it.
+ */
+void ring_reset(IpcRing *ring){
+    __atomic_store_n(&ring->head, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Publishes len bytes, all or nothing (producer side).
+ * Rings the doorbell only if the consumer had emptied the ring, so a
+ * consumer that is still draining costs no syscall.
+ * Returns 0 on success, -1 if the ring does not have room.
+ */
+int ring_write(IpcRing *ring, int doorbell, const void *buf, size_t len){
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    if (IPC_RING_SIZE - (tail - head) < len) {
+        return -1;
+    }
+
+    size_t idx = tail & (IPC_RING_SIZE - 1);
+    size_t first = IPC_RING_SIZE - idx < len ? IPC_RING_SIZE - idx : len;
+    memcpy(ring->data + idx, buf, first);
+    memcpy(ring->data, (const unsigned char *)buf + first, len - first);
+
+    // seq_cst store then load, pairs with ring_consume() then ring_peek():
+    // either we see the consumer caught up, or it sees our bytes
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail) {
+        ring_doorbell(doorbell);
+    }
+    return 0;
+}
+
+/*
+ * Copies up to max published bytes without consuming them (consumer side).
+ * Returns the number of bytes copied.
+ */
+size_t ring_peek(IpcRing *ring, void *buf, size_t max){
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    size_t len = tail - head < max ? tail - head : max;
+
+    size_t idx = head & (IPC_RING_SIZE - 1);
+    size_t first = IPC_RING_SIZE - idx < len ? IPC_RING_SIZE - idx : len;
+    memcpy(buf, ring->data + idx, first);
+    memcpy((unsigned char *)buf + first, ring->data, len - first);
+    return len;
+}
+
+/*
+ * Releases len bytes returned by ring_peek() (consumer side).
+ */
+void ring_consume(IpcRing *ring, size_t len){
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_SEQ_CST);
+}
+
+int ring_empty(IpcRing *ring){
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wakes the consumer waiting on an eventfd doorbell.
+ */
+void ring_doorbell(int doorbell){
+    uint64_t one = 1;
+    while (write(doorbell, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/*
+ * Resets a (non-blocking) doorbell before draining its ring.
+ */
+void ring_clear_doorbell(int doorbell){
+    uint64_t value;
+    while (read(doorbell, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+/*
+ * Blocks until the doorbell rings, then resets it.
+ * Waits at most timeout_ms milliseconds, forever if it is negative.
+ * Returns 0 if it rang (or a signal interrupted the wait), 1 on timeout, -1 on error.
+ */
+int ring_wait_doorbell(int doorbell, int timeout_ms){
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(doorbell, &readfds);
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    int n = select(doorbell + 1, &readfds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+    if (n == 0) return 1;
+    ring_clear_doorbell(doorbell);
+    return 0;
+}
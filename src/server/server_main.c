@@ -3,6 +3,11 @@
 #include "users.h"
 #include "transfer.h"
 #include "concurrency.h"
+#include "copy.h"
+#include "user_store.h"
+#include "import.h"
+#include "quota.h"
+#include "dircache.h"
 
 //global variables
 int root_dir_fd;
@@ -11,6 +16,7 @@ int port;
 char *ip;
 char root_dir_path[1024];
 ClientSession sessions[MAX_CLIENTS];
+pid_t server_pid;
 
 int main(int argc, char *argv[]) {
     
@@ -46,6 +52,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    server_pid = getpid();
     init_shared_memory(); // Initialize shared memory for concurrency locks
     init_privileges();    // Capture original SUDO credentials
     minimize_privileges(); // Drop to non-root user for security
@@ -63,8 +70,29 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // retrive users from users file
-    retrive_users();
+    // open the user store, migrating users.dat the first time
+    if (user_store_open(root_dir_fd, 1) < 0) {
+        fprintf(stderr, "[PARENT] Failed to open the user store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // load the usage and limits of the users, reconciled with the disk in the background
+    if (quota_init(root_dir_fd) < 0) {
+        fprintf(stderr, "[PARENT] Failed to create the quota table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // share the listings of the directories, kept up to date by inotify
+    if (dircache_init() < 0) {
+        fprintf(stderr, "[PARENT] Failed to create the directory cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // reload the transfer requests still waiting for an answer
+    if (transfer_queue_init(root_dir_fd) < 0) {
+        fprintf(stderr, "[PARENT] Failed to open the transfer queue\n");
+        exit(EXIT_FAILURE);
+    }
 
     // create server socket
     int server_socket = create_server_socket(port);
@@ -83,9 +111,20 @@ int main(int argc, char *argv[]) {
         sessions[i].pid = -1;
         sessions[i].pipe_fd_read = -1;
         sessions[i].pipe_fd_write = -1;
+        sessions[i].next_session = -1;
+    }
+
+    // start the workers that copy accepted transfers
+    if (copy_pool_init() < 0) {
+        fprintf(stderr, "[PARENT] Failed to start copy workers\n");
+        exit(EXIT_FAILURE);
     }
 
-    // Initialize signal handlers
+    // Initialize signal handlers, dead children are reaped by the main loop
+    if (sigchld_init() < 0) {
+        fprintf(stderr, "[PARENT] Failed to create the SIGCHLD pipe\n");
+        exit(EXIT_FAILURE);
+    }
     signal(SIGINT, cleanup_children); // Ctrl^C
     signal(SIGTERM, cleanup_children); // kill
     signal(SIGCHLD, handle_sigchld); // Child termination
@@ -119,13 +158,34 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        // Wait for I/O events
-        if (select(max_fd + 1, &readfds, NULL, NULL, NULL) < 0){
+        // Add the pipe rung on SIGCHLD
+        sigchld_fdset(&readfds, &max_fd);
+
+        // Add copy worker channels to readfds
+        copy_pool_fdset(&readfds, &max_fd);
+
+        // Add the channel of a running user import
+        import_fdset(&readfds, &max_fd);
+
+        // Add the watches of the cached directories
+        dircache_fdset(&readfds, &max_fd);
+
+        // Wait for I/O events, waking up now and then to expire old transfer requests,
+        // and soon if messages wait for room in a session's ring
+        struct timeval tv = { TRANSFER_EXPIRY_SWEEP, 0 };
+        if (transfer_backlogged()) {
+            tv.tv_sec = 0;
+            tv.tv_usec = RING_FULL_WAIT_US;
+        }
+        if (select(max_fd + 1, &readfds, NULL, NULL, &tv) < 0){
             if (errno == EINTR) continue; // Handle interrupted syscall
             perror("select");
             exit(EXIT_FAILURE);
         }
 
+        // Reap dead children, freeing their locks and session slots
+        reap_children(&readfds);
+
         // Handle new connections
         if (FD_ISSET(server_socket, &readfds)){
             handle_client(server_socket);
@@ -139,17 +199,18 @@ int main(int argc, char *argv[]) {
             buf[strcspn(buf, "\n")] = 0; // Remove trailing newline
 
             // Parse input
-            char *args[3];
+            char *args[4];
             int arg_count = 0;
             char *token = strtok(buf, " ");
             while (token != NULL) {
-                if (arg_count >= 3) break;
+                if (arg_count >= 4) break;
                 args[arg_count++] = token;
                 token = strtok(NULL, " ");
             }
 
             // Handle commands
             if (arg_count == 1 && strcmp(args[0], "exit") == 0){ // exit
+                quota_save();
                 cleanup_children(0);
                 exit(0);
             } else if (arg_count == 3 && strcmp(args[0], "create_user") == 0) { // create user
@@ -165,6 +226,37 @@ int main(int argc, char *argv[]) {
                         printf("user created\n");
                     }
                 }
+            } else if (arg_count >= 1 && arg_count <= 2 && strcmp(args[0], "import_users") == 0) { // bulk user creation
+                if (arg_count == 1) {
+                    import_status();
+                } else if (import_start(args[1]) < 0) {
+                    printf("err-import not started\n");
+                }
+            } else if (arg_count == 1 && strcmp(args[0], "quota_reconcile") == 0) { // recount the folders now
+                if (quota_reconcile_start() < 0) {
+                    printf("err-a reconciliation is already running\n");
+                }
+            } else if ((arg_count == 2 || arg_count == 4) && strcmp(args[0], "quota") == 0) { // show or set a quota
+                if (arg_count == 4) {
+                    char *end_bytes, *end_inodes;
+                    long long max_bytes = strtoll(args[2], &end_bytes, 10);
+                    long long max_inodes = strtoll(args[3], &end_inodes, 10);
+                    if (*end_bytes != '\0' || *end_inodes != '\0' || max_bytes < 0 || max_inodes < 0) {
+                        printf("err-invalid limits\n");
+                    } else if (user_exists(args[1]) != 0) {
+                        printf("err-user does not exist\n");
+                    } else if (quota_set(args[1], max_bytes, max_inodes) < 0) {
+                        printf("err-quota not set\n");
+                    }
+                }
+                quota_print(args[1]);
+            } else if (arg_count >= 1 && arg_count <= 2 && strcmp(args[0], "locks") == 0) { // lock contention report
+                int top_n = (arg_count == 2) ? atoi(args[1]) : LOCK_TOP_DEFAULT;
+                if (top_n <= 0) {
+                    printf("err-invalid number of paths\n");
+                } else {
+                    dump_lock_stats(top_n);
+                }
             } else {
                 printf("err-Invalid command\n");
             }
@@ -176,6 +268,24 @@ int main(int argc, char *argv[]) {
                 parent_handle_msg(i);
             }
         }
+
+        // Deliver the messages that did not fit in the sessions' rings
+        transfer_flush_backlogs();
+
+        // Handle finished copies
+        copy_pool_handle(&readfds);
+
+        // Store the users provisioned by a running import
+        import_handle(&readfds);
+
+        // Invalidate the cached directories that changed
+        dircache_handle(&readfds);
+
+        // Drop transfer requests nobody answered
+        transfer_expire();
+
+        // Save the quota counters, reconcile them now and then
+        quota_tick();
     }
 
     return 0;
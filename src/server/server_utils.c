@@ -1,10 +1,17 @@
+#define _GNU_SOURCE // pipe2()
 #include "server.h"
 #include "common.h"
+#include "concurrency.h"
+#include "transfer.h"
+#include "path.h"
 
 extern char root_dir_path[];
 extern char current_dir_path[];
+extern char home_path[];
+extern size_t home_len;
 extern char username[];
 extern ClientSession sessions[];
+extern pid_t server_pid;
 
 /*
  * Kills all child processes and exits the server.
@@ -24,23 +31,74 @@ void cleanup_children(int sig) {
     exit(0);
 }
 
+static int sigchld_pipe[2] = {-1, -1}; // Written by the SIGCHLD handler, read by the main loop
+
+/*
+ * Creates the pipe through which the SIGCHLD handler wakes up the main loop.
+ */
+int sigchld_init() {
+    if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    return 0;
+}
+
 /*
- * Handles SIGCHLD signal by reaping dead children.
+ * Handles SIGCHLD signal.
+ * In the server it only wakes up the main loop, which reaps the children in
+ * reap_children(): the locks and session slots they leave behind are shared
+ * with the rest of the loop. Sessions inherit this handler and reap their
+ * background jobs right away.
  */
 void handle_sigchld(int sig) {
     (void)sig; // unused
+    int saved_errno = errno;
+
+    if (getpid() == server_pid) {
+        ssize_t ret = write(sigchld_pipe[1], "", 1); // a full pipe already has a wake-up pending
+        (void)ret;
+    } else {
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+    }
+    errno = saved_errno;
+}
+
+/*
+ * Adds the SIGCHLD pipe to the set the main loop waits on.
+ */
+void sigchld_fdset(fd_set *set, int *max_fd) {
+    FD_SET(sigchld_pipe[0], set);
+    if (sigchld_pipe[0] > *max_fd) {
+        *max_fd = sigchld_pipe[0];
+    }
+}
+
+/*
+ * Reaps the dead children once the SIGCHLD handler rang the pipe.
+ * Locks left behind by a killed child are released right away and its
+ * session slot is freed.
+ */
+void reap_children(fd_set *set) {
+    if (!FD_ISSET(sigchld_pipe[0], set)) return;
+
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+
     int status;
     pid_t pid;
-
-    // Reap all dead children
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
         printf("[Server] Child process %d died\n", pid);
-        
+
+        // Release the file locks it was holding
+        release_locks_of(pid);
+
         // Find and free session
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (sessions[i].pid == pid) {
                 close(sessions[i].pipe_fd_read);
                 close(sessions[i].pipe_fd_write);
+                presence_leave(i);
                 sessions[i].pid = -1;
                 memset(sessions[i].username, 0, USERNAME_LENGTH);
                 printf("[Server] Freed session slot %d\n", i);
@@ -74,52 +132,11 @@ int find_path(char* dest, int dest_size, int fd){
 
 
 /*
- * Lexically resolves a path against a base directory.
+ * Lexically resolves a path against a base directory, see canon_path().
+ * resolved must hold PATH_RESOLVED_MAX bytes.
  */
 int resolve_path(char *base, char *path, char *resolved) {
-    char temp[2048];
-    char *tokens[256];
-    int token_count = 0;
-    
-    // Start with base
-    strncpy(temp, base, sizeof(temp) - 1);
-    temp[sizeof(temp) - 1] = '\0';
-    
-    // Add separator if needed
-    if (temp[strlen(temp) - 1] != '/') {
-        strncat(temp, "/", sizeof(temp) - strlen(temp) - 1);
-    }
-    
-    // Append input path
-    strncat(temp, path, sizeof(temp) - strlen(temp) - 1);
-    
-    // Tokenize
-    char *saveptr;
-    char *token = strtok_r(temp, "/", &saveptr);
-    while (token != NULL) {
-        if (strcmp(token, ".") == 0) {
-            // Ignore
-        } else if (strcmp(token, "..") == 0) {
-            if (token_count > 0) {
-                token_count--;
-            }
-        } else {
-            tokens[token_count++] = token;
-        }
-        token = strtok_r(NULL, "/", &saveptr);
-    }
-    
-    // Reconstruct
-    resolved[0] = '\0';
-    if (token_count == 0) {
-        strcat(resolved, "/");
-    } else {
-        for (int i = 0; i < token_count; i++) {
-            strcat(resolved, "/");
-            strcat(resolved, tokens[i]);
-        }
-    }
-    return 0;
+    return canon_path(base, path, resolved, PATH_RESOLVED_MAX) < 0 ? -1 : 0;
 }
 
 /*
@@ -127,51 +144,42 @@ int resolve_path(char *base, char *path, char *resolved) {
  * Returns 0 if the path is valid, -1 otherwise.
  */
 int check_path(char *path) {
-    char resolved[2048];
+    char resolved[PATH_RESOLVED_MAX];
 
     if (path[0] == '/') {
         return -1; // absolute path not allowed
     }
-    
-    // Resolve current_dir_path + path
-    resolve_path(current_dir_path, path, resolved);
-
-    // Check if resolved path starts with root_dir_path
-    size_t root_len = strlen(root_dir_path);
-    if (strncmp(resolved, root_dir_path, root_len) == 0) {
-        // Ensure it's an exact match or a subdirectory
-        if (resolved[root_len] == '\0' || resolved[root_len] == '/') {
-            return 0;
-        }
+
+    // Resolve current_dir_path + path and check that it is below root_dir_path
+    int len = canon_path(current_dir_path, path, resolved, sizeof(resolved));
+    if (len < 0 || !path_within(resolved, len, root_dir_path, strlen(root_dir_path))) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Resolves a path of the command line and checks that it falls within the
+ * logged-in user's directory, in one pass against the prefix computed at login.
+ * Returns 0 and the path in resolved if it is valid, -1 otherwise.
+ */
+int resolve_path_mine(char *path, char *resolved, size_t size){
+    if (path[0] == '/' || home_len == 0) {
+        return -1; // absolute path not allowed, or not logged in
     }
-    
-    return -1;
- }
+
+    int len = canon_path(current_dir_path, path, resolved, size);
+    if (len < 0 || !path_within(resolved, len, home_path, home_len)) {
+        return -1;
+    }
+    return 0;
+}
 
 /*
  * Verifies that the requested path falls within the logged-in user's dedicated directory.
  * Returns 0 if the path is valid, -1 otherwise.
  */
 int check_path_mine(char *path){
-    char my_path[2048];
-    resolve_path(root_dir_path, username, my_path);
-    char resolved[2048];
-
-    if (path[0] == '/') {
-        return -1; // absolute path not allowed
-    }
-    
-    // Resolve current_dir_path + path
-    resolve_path(current_dir_path, path, resolved);
-
-    // Check if resolved path starts with root_dir_path
-    size_t my_len = strlen(my_path);
-    if (strncmp(resolved, my_path, my_len) == 0) {
-        // Ensure it's an exact match or a subdirectory
-        if (resolved[my_len] == '\0' || resolved[my_len] == '/') {
-            return 0;
-        }
-    }
-    
-    return -1;
+    char resolved[PATH_RESOLVED_MAX];
+    return resolve_path_mine(path, resolved, sizeof(resolved));
 }
\ No newline at end of file
@@ -2,106 +2,281 @@
 #include "common.h"
 #include "users.h"
 #include "transfer.h"
+#include "copy.h"
+#include "concurrency.h"
+#include "transfer_log.h"
+#include "quota.h"
+#include "dircache.h"
 #include <fcntl.h>
 #include <pwd.h>
+#include <dirent.h>
 
-dict *dict_head = NULL;
-req_list *req_list_head = NULL;
+extern char root_dir_path[];
+
+presence *presence_table[PRESENCE_BUCKETS];
+req_list *req_index[REQ_INDEX_BUCKETS]; // Live requests (pending or being copied) by id
+int live_requests = 0;
+time_t last_expiry_sweep = 0;
 int req_counter = 0;
+static int queue_dir_fd = -1; // Root directory, holds the log and the staged copies
 
 /*
- * Appends a key-value pair to the dictionary. 
+ * Hashes a username into a presence bucket (djb2).
  */
-int append_dict(int key, int value){
-    dict *new_dict = malloc(sizeof(dict));
-    new_dict->key = key;
-    new_dict->value = value;
-    new_dict->next = dict_head;
-    dict_head = new_dict;
-    return 0;
+static unsigned int presence_hash(const char *usern){
+    unsigned int h = 5381;
+    while (*usern) {
+        h = h * 33 + (unsigned char)*usern++;
+    }
+    return h % PRESENCE_BUCKETS;
 }
 
 /*
- * Removes a key-value pair from the dictionary.
+ * Returns the presence entry of a user, creating it if create is set.
+ * Entries are kept after logout so that requests can wait for the user.
  */
-int pop_dict(int key, int *value){
-    dict *curr = dict_head;
-    dict *prev = NULL;
+static presence *presence_get(const char *usern, int create){
+    unsigned int h = presence_hash(usern);
+    for (presence *p = presence_table[h]; p != NULL; p = p->next) {
+        if (strcmp(p->username, usern) == 0) {
+            return p;
+        }
+    }
+    if (!create) return NULL;
 
-    while (curr != NULL) {
-        if (curr->key == key) {
-            *value = curr->value;
-            if (prev == NULL) {
-                dict_head = curr->next;
-            } else {
-                prev->next = curr->next;
-            }
-            free(curr);
-            return 0;
+    presence *p = calloc(1, sizeof(presence));
+    if (p == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    strncpy(p->username, usern, USERNAME_LENGTH - 1);
+    p->first_session = -1;
+    p->next = presence_table[h];
+    presence_table[h] = p;
+    return p;
+}
+
+/*
+ * Registers a session under a username.
+ */
+static void presence_join(int session, const char *usern){
+    presence *p = presence_get(usern, 1);
+    if (p == NULL) return;
+
+    strncpy(sessions[session].username, usern, USERNAME_LENGTH - 1);
+    sessions[session].next_session = p->first_session;
+    p->first_session = session;
+}
+
+/*
+ * Unlinks a session from its user's presence entry.
+ * Called when the session identifies again, and by reap_children() once it died.
+ */
+void presence_leave(int session){
+    if (sessions[session].username[0] == '\0') return;
+    presence *p = presence_get(sessions[session].username, 0);
+    if (p == NULL) return;
+
+    int *link = &p->first_session;
+    while (*link != -1) {
+        if (*link == session) {
+            *link = sessions[session].next_session;
+            break;
         }
-        prev = curr;
-        curr = curr->next;
+        link = &sessions[*link].next_session;
     }
-    return -1;
+    sessions[session].next_session = -1;
 }
 
 /*
- * Appends a transfer request to the list.
+ * Finds a live request by ID.
  */
-int append_req(transfer_request req){
-    req_list *new_req = malloc(sizeof(req_list));
-    memcpy(&new_req->req, &req, sizeof(transfer_request));
-    new_req->next = req_list_head;
-    req_list_head = new_req;
-    return 0;
+static req_list *index_find(int id){
+    for (req_list *node = req_index[(unsigned int)id % REQ_INDEX_BUCKETS]; node != NULL; node = node->next_id) {
+        if (node->req.id == id) return node;
+    }
+    return NULL;
+}
+
+static void index_remove(req_list *node){
+    req_list **link = &req_index[(unsigned int)node->req.id % REQ_INDEX_BUCKETS];
+    while (*link != NULL) {
+        if (*link == node) {
+            *link = node->next_id;
+            live_requests--;
+            return;
+        }
+        link = &(*link)->next_id;
+    }
 }
 
 /*
- * Removes a transfer request from the list by username.
+ * Appends a request to the receiver's pending queue and to the id index.
+ * origin is -1 for requests replayed from the log.
  */
-int pop_req_username(char *usern, transfer_request *req) {
-    req_list *curr = req_list_head;
-    req_list *prev = NULL;
+static req_list *enqueue_req(presence *p, transfer_request *req, int origin, time_t created){
+    req_list *node = calloc(1, sizeof(req_list));
+    if (node == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    memcpy(&node->req, req, sizeof(transfer_request));
+    node->origin = origin;
+    node->origin_pid = (origin >= 0) ? sessions[origin].pid : -1;
+    node->created = created;
 
-    while (curr != NULL) {
-        if (strcmp(curr->req.receiver, usern) == 0) {
-            memcpy(req, &curr->req, sizeof(transfer_request));
-            if (prev == NULL) {
-                req_list_head = curr->next;
-            } else {
-                prev->next = curr->next;
-            }
-            free(curr);
-            return 0;
+    node->prev = p->pending_tail;
+    if (p->pending_tail == NULL) {
+        p->pending_head = node;
+    } else {
+        p->pending_tail->next = node;
+    }
+    p->pending_tail = node;
+
+    unsigned int h = (unsigned int)req->id % REQ_INDEX_BUCKETS;
+    node->next_id = req_index[h];
+    req_index[h] = node;
+    live_requests++;
+    return node;
+}
+
+/*
+ * Takes a request out of its receiver's pending queue, it stays in the index.
+ */
+static void unlink_pending(req_list *node){
+    presence *p = presence_get(node->req.receiver, 0);
+    if (p == NULL) return;
+
+    if (node->prev == NULL) {
+        p->pending_head = node->next;
+    } else {
+        node->prev->next = node->next;
+    }
+    if (node->next == NULL) {
+        p->pending_tail = node->prev;
+    } else {
+        node->next->prev = node->prev;
+    }
+    node->next = node->prev = NULL;
+}
+
+/*
+ * Rewrites the log as a snapshot of the live requests once it is mostly dead records.
+ */
+static void maybe_compact(){
+    if (!tlog_should_compact(live_requests)) return;
+    if (tlog_compact_begin(req_counter) < 0) return;
+
+    for (int b = 0; b < REQ_INDEX_BUCKETS; b++) {
+        for (req_list *node = req_index[b]; node != NULL; node = node->next_id) {
+            tlog_compact_add(&node->req, node->created);
+        }
+    }
+    tlog_compact_end();
+}
+
+/*
+ * Tells whether a request of a fan-out group is still pending or being copied.
+ */
+static int group_live(int group){
+    for (int b = 0; b < REQ_INDEX_BUCKETS; b++) {
+        for (req_list *node = req_index[b]; node != NULL; node = node->next_id) {
+            if (node->req.group == group) return 1;
         }
-        prev = curr;
-        curr = curr->next;
     }
-    return -1;
+    return 0;
 }
 
 /*
- * Removes a transfer request from the list by ID.
+ * Deletes the staged copy of a fan-out group, once its last request is gone.
  */
-int pop_req_id(int id, transfer_request *req) {
-    req_list *curr = req_list_head;
-    req_list *prev = NULL;
+static void drop_staged(int group){
+    char name[64];
+    snprintf(name, sizeof(name), TRANSFER_STAGING_DIR "/%d", group);
 
-    while (curr != NULL) {
-        if (curr->req.id == id) {
-            memcpy(req, &curr->req, sizeof(transfer_request));
-            if (prev == NULL) {
-                req_list_head = curr->next;
-            } else {
-                prev->next = curr->next;
-            }
-            free(curr);
-            return 0;
+    restore_privileges();
+    if (unlinkat(queue_dir_fd, name, 0) < 0 && errno != ENOENT) {
+        perror("unlinkat staged copy");
+    }
+    minimize_privileges();
+}
+
+/*
+ * Forgets a request that was accepted, rejected or expired.
+ */
+static void finish_req(req_list *node){
+    int group = node->req.group;
+    index_remove(node);
+    tlog_del(node->req.id);
+    free(node);
+    if (group != 0 && !group_live(group)) {
+        drop_staged(group);
+    }
+    maybe_compact();
+}
+
+/*
+ * Log replay callbacks, see tlog_open().
+ */
+static void replay_add(transfer_request *req, time_t created){
+    if (index_find(req->id) != NULL) return;
+    presence *p = presence_get(req->receiver, 1);
+    if (p != NULL) {
+        enqueue_req(p, req, -1, created);
+    }
+    if (req->id > req_counter) {
+        req_counter = req->id;
+    }
+}
+
+static void replay_del(int id){
+    if (id > req_counter) {
+        req_counter = id;
+    }
+    req_list *node = index_find(id);
+    if (node == NULL) return;
+    unlink_pending(node);
+    index_remove(node);
+    free(node);
+}
+
+/*
+ * Deletes the staged copies left by groups that no longer have live requests
+ * (e.g. the server stopped between the last copy and the cleanup).
+ */
+static void sweep_staged(){
+    restore_privileges();
+    int fd = openat(queue_dir_fd, TRANSFER_STAGING_DIR, O_RDONLY | O_DIRECTORY);
+    minimize_privileges();
+    if (fd < 0) return;
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        int group = atoi(entry->d_name);
+        if (group <= 0 || !group_live(group) || strchr(entry->d_name, '.') != NULL) {
+            printf("[PARENT] removing stale staged copy %s\n", entry->d_name);
+            restore_privileges();
+            unlinkat(dirfd(dir), entry->d_name, 0);
+            minimize_privileges();
         }
-        prev = curr;
-        curr = curr->next;
     }
-    return -1;
+    closedir(dir);
+}
+
+/*
+ * Loads the pending requests saved in the root directory.
+ */
+int transfer_queue_init(int dir_fd){
+    queue_dir_fd = dir_fd;
+    int ret = tlog_open(dir_fd, replay_add, replay_del);
+    sweep_staged();
+    return ret;
 }
 
 /*
@@ -152,59 +327,419 @@ int read_n(int fd, void *vptr, size_t n) {
 }
 
 /*
- * send a transfer message.
+ * Fields carried on the wire by each message type.
  */
-int send_transfer_msg(int fd, transfer_msg *msg){
-    return write_n(fd, msg, sizeof(transfer_msg));
-}
+static const unsigned char msg_fields[] = {
+    [TRANSF_REQ]  = MSG_F_ID | MSG_F_SENDER | MSG_F_RECEIVER | MSG_F_PATH,
+    [ACCEPT]      = MSG_F_ID | MSG_F_PATH,
+    [REJECT]      = MSG_F_ID,
+    [I_M_USER]    = MSG_F_SENDER,
+    [NEW_REQ]     = MSG_F_RECEIVER | MSG_F_PATH | MSG_F_ARG, // group to join
+    [HANDLED]     = MSG_F_ID,
+    [REJECTED]    = MSG_F_ID,
+    [WHO_ARE_YOU] = 0,
+    [PENDING]     = 0,
+    [PENDING_END] = MSG_F_ID | MSG_F_ARG, // requests listed, requests pending
+    [REQ_CREATED] = MSG_F_ID | MSG_F_ARG,
+    [STATUS]      = MSG_F_ID, // 0 for every request of the user
+    [STATUS_INFO] = MSG_F_ID | MSG_F_RECEIVER | MSG_F_PATH | MSG_F_ARG,
+    [STATUS_END]  = MSG_F_ID | MSG_F_ARG, // requests listed, requests outstanding
+    [CANCEL]      = MSG_F_ID,
+    [CANCELLED]   = MSG_F_ID | MSG_F_SENDER | MSG_F_ARG,
+    [PROGRESS]    = MSG_F_ID | MSG_F_ARG | MSG_F_ARG2,
+    [WATCH_DIR]   = MSG_F_ID | MSG_F_PATH, // directory cache slot, path relative to the root directory
+};
 
 /*
- * receive a transfer message.
+ * Writes v as a LEB128 varint, returns the number of bytes used.
  */
-int receive_transfer_msg(int fd, transfer_msg *msg){
-    int n = read_n(fd, msg, sizeof(transfer_msg));
-    if (n < 0) return -1;
-    if (n == 0) return 0; // EOF
-    if ((size_t)n < sizeof(transfer_msg)) return -1; // Partial read treated as error
+static size_t put_varint(unsigned char *p, unsigned long v){
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
     return n;
 }
 
+/*
+ * Reads a LEB128 varint.
+ * Returns the number of bytes used, 0 if more bytes are needed, -1 if malformed.
+ */
+static int get_varint(const unsigned char *p, size_t len, unsigned long *v){
+    *v = 0;
+    for (size_t n = 0; n < len && n < MSG_VARINT_MAX; n++) {
+        *v |= (unsigned long)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) return n + 1;
+    }
+    return len < MSG_VARINT_MAX ? 0 : -1;
+}
+
+static size_t put_string(unsigned char *p, const char *s, size_t max){
+    size_t len = strnlen(s, max - 1);
+    size_t n = put_varint(p, len);
+    memcpy(p + n, s, len);
+    return n + len;
+}
+
+static int get_string(const unsigned char *p, size_t len, char *s, size_t max){
+    unsigned long slen;
+    int n = get_varint(p, len, &slen);
+    if (n <= 0 || slen >= max || slen > len - n) return -1;
+    memcpy(s, p + n, slen);
+    s[slen] = '\0';
+    return n + slen;
+}
+
+/*
+ * Encodes a message as a frame: varint body length, status byte, then
+ * only the fields of that status. Returns the frame length.
+ */
+static size_t encode_transfer_msg(transfer_msg *msg, unsigned char *frame){
+    unsigned char body[MSG_FRAME_MAX];
+    size_t len = 0;
+    unsigned char fields = msg_fields[msg->status];
+
+    body[len++] = (unsigned char)msg->status;
+    if (fields & MSG_F_ID) len += put_varint(body + len, (unsigned int)msg->req.id);
+    if (fields & MSG_F_SENDER) len += put_string(body + len, msg->req.sender, USERNAME_LENGTH);
+    if (fields & MSG_F_RECEIVER) len += put_string(body + len, msg->req.receiver, USERNAME_LENGTH);
+    if (fields & MSG_F_PATH) len += put_string(body + len, msg->req.path, PATH_LENGTH);
+    if (fields & MSG_F_ARG) len += put_varint(body + len, (unsigned int)msg->arg);
+    if (fields & MSG_F_ARG2) len += put_varint(body + len, (unsigned int)msg->arg2);
+
+    size_t n = put_varint(frame, len);
+    memcpy(frame + n, body, len);
+    return n + len;
+}
+
+/*
+ * Decodes one frame from buf.
+ * Returns the bytes consumed, 0 if the frame is incomplete, -1 if malformed.
+ */
+static int decode_transfer_msg(const unsigned char *buf, size_t len, transfer_msg *msg){
+    unsigned long body_len;
+    int n = get_varint(buf, len, &body_len);
+    if (n <= 0) return n;
+    if (body_len == 0 || body_len > MSG_FRAME_MAX) return -1;
+    if (len - n < body_len) return 0;
+
+    const unsigned char *p = buf + n;
+    size_t left = body_len;
+    memset(msg, 0, sizeof(*msg));
+    if (p[0] >= sizeof(msg_fields)) return -1;
+    msg->status = (transfer_status)p[0];
+    p++; left--;
+
+    unsigned char fields = msg_fields[msg->status];
+    int k;
+    if (fields & MSG_F_ID) {
+        unsigned long id;
+        if ((k = get_varint(p, left, &id)) <= 0) return -1;
+        msg->req.id = (int)id;
+        p += k; left -= k;
+    }
+    if (fields & MSG_F_SENDER) {
+        if ((k = get_string(p, left, msg->req.sender, USERNAME_LENGTH)) < 0) return -1;
+        p += k; left -= k;
+    }
+    if (fields & MSG_F_RECEIVER) {
+        if ((k = get_string(p, left, msg->req.receiver, USERNAME_LENGTH)) < 0) return -1;
+        p += k; left -= k;
+    }
+    if (fields & MSG_F_PATH) {
+        if ((k = get_string(p, left, msg->req.path, PATH_LENGTH)) < 0) return -1;
+        p += k; left -= k;
+    }
+    if (fields & MSG_F_ARG) {
+        unsigned long arg;
+        if ((k = get_varint(p, left, &arg)) <= 0) return -1;
+        msg->arg = (int)(unsigned int)arg;
+        p += k; left -= k;
+    }
+    if (fields & MSG_F_ARG2) {
+        unsigned long arg;
+        if ((k = get_varint(p, left, &arg)) <= 0) return -1;
+        msg->arg2 = (int)(unsigned int)arg;
+        p += k; left -= k;
+    }
+    if (left != 0) return -1;
+    return n + body_len;
+}
+
+/*
+ * Send a transfer message from a session to the parent.
+ * Waits for room if the parent is behind on its ring.
+ */
+int send_to_parent(transfer_msg *msg){
+    unsigned char frame[MSG_FRAME_MAX + MSG_VARINT_MAX];
+    size_t len = encode_transfer_msg(msg, frame);
+    IpcRing *ring = &session_channel(session_slot)->to_parent;
+
+    while (ring_write(ring, pipe_write, frame, len) < 0) {
+        usleep(RING_FULL_WAIT_US);
+    }
+    return 0;
+}
+
+/*
+ * Frames for a session that did not fit in its ring, in order.
+ * The parent never waits for a session, it moves them to the ring later,
+ * see transfer_flush_backlogs().
+ */
+typedef struct {
+    pid_t pid;             // Session the frames are for, dropped if another one takes the slot
+    unsigned char *frames;
+    size_t len;
+    size_t capacity;
+} session_backlog;
+
+static session_backlog backlogs[MAX_CLIENTS];
+static int backlogged = 0; // Sessions with frames in their backlog
+
+static void backlog_clear(session_backlog *b){
+    if (b->len == 0) return;
+    b->len = 0;
+    backlogged--;
+}
+
+/*
+ * Queues a frame for a session, in its ring or, behind the frames already
+ * waiting, in its backlog.
+ * A reply is always queued, since the session blocks until it arrives.
+ * A notification is dropped once the backlog holds SESSION_BACKLOG_MAX bytes.
+ */
+static int deliver(int session, transfer_msg *msg, int reply){
+    unsigned char frame[MSG_FRAME_MAX + MSG_VARINT_MAX];
+    size_t len = encode_transfer_msg(msg, frame);
+    session_backlog *b = &backlogs[session];
+
+    if (b->len > 0 && b->pid != sessions[session].pid) {
+        backlog_clear(b); // left by the previous session of the slot
+    }
+    if (b->len == 0 && ring_write(&session_channel(session)->to_child, sessions[session].pipe_fd_write, frame, len) == 0) {
+        return 0;
+    }
+
+    if (!reply && b->len + len > SESSION_BACKLOG_MAX) {
+        printf("[MAIN] session %d is not reading its messages, message %d dropped\n", session, msg->status);
+        return -1;
+    }
+    if (b->len + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : IPC_RING_SIZE;
+        while (capacity < b->len + len) capacity *= 2;
+        unsigned char *grown = realloc(b->frames, capacity);
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        b->frames = grown;
+        b->capacity = capacity;
+    }
+    if (b->len == 0) {
+        b->pid = sessions[session].pid;
+        backlogged++;
+    }
+    memcpy(b->frames + b->len, frame, len);
+    b->len += len;
+    return 0;
+}
+
+/*
+ * Send a notification from the parent to a session.
+ * Never waits, see deliver().
+ */
+int send_to_session(int session, transfer_msg *msg){
+    return deliver(session, msg, 0);
+}
+
+/*
+ * Send the answer to a command the session is waiting for.
+ */
+static int reply_to_session(int session, transfer_msg *msg){
+    return deliver(session, msg, 1);
+}
+
+/*
+ * Moves the backlogged frames of the sessions to their rings, as far as they fit.
+ * The main loop calls it in a short loop while transfer_backlogged() is set.
+ */
+void transfer_flush_backlogs(){
+    if (backlogged == 0) return;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        session_backlog *b = &backlogs[i];
+        if (b->len == 0) continue;
+        if (sessions[i].pid == -1 || b->pid != sessions[i].pid) {
+            backlog_clear(b);
+            continue;
+        }
+
+        size_t off = 0;
+        while (off < b->len) {
+            unsigned long body_len;
+            int n = get_varint(b->frames + off, b->len - off, &body_len);
+            if (ring_write(&session_channel(i)->to_child, sessions[i].pipe_fd_write, b->frames + off, n + body_len) < 0) {
+                break;
+            }
+            off += n + body_len;
+        }
+        memmove(b->frames, b->frames + off, b->len - off);
+        b->len -= off;
+        if (b->len == 0) {
+            backlogged--;
+        }
+    }
+}
+
+/*
+ * Tells whether messages wait for room in a session's ring.
+ */
+int transfer_backlogged(){
+    return backlogged > 0;
+}
+
+/*
+ * receive a transfer message sent by the parent.
+ * Waits at most timeout_ms milliseconds for one, not at all if it is 0, forever if negative.
+ * Returns the frame length, 0 if no message came in time, -1 on error.
+ */
+int receive_transfer_msg(transfer_msg *msg, int timeout_ms){
+    unsigned char frame[MSG_FRAME_MAX + MSG_VARINT_MAX];
+    IpcRing *ring = &session_channel(session_slot)->to_child;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1) {
+        size_t len = ring_peek(ring, frame, sizeof(frame));
+        if (len > 0) {
+            int n = decode_transfer_msg(frame, len, msg);
+            if (n <= 0) {
+                ring_consume(ring, len); // frames are published whole, this one is garbage
+                return -1;
+            }
+            ring_consume(ring, n);
+
+            // The doorbell only rings on empty -> non-empty, keep it up for the rest
+            if (timeout_ms != 0 && !ring_empty(ring)) {
+                ring_doorbell(pipe_read);
+            }
+            return n;
+        }
+        if (timeout_ms == 0) return 0;
+
+        int left = -1;
+        if (timeout_ms > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed_ms >= timeout_ms) return 0;
+            left = timeout_ms - (int)elapsed_ms;
+        }
+        if (ring_wait_doorbell(pipe_read, left) < 0) return -1;
+    }
+}
+
+/*
+ * Handles a message the parent sent on its own (not a reply the session waits for).
+ */
+static void handle_parent_msg(transfer_msg *msg){
+    char buf[2048];
+
+    printf("Child received message:\n id: %d\n status: %d\n sender: %s\n receiver: %s\n path: %s\n", msg->req.id, msg->status, msg->req.sender, msg->req.receiver, msg->req.path);
+
+    // handle different message types
+    switch (msg->status){
+        case TRANSF_REQ:
+            snprintf(buf, sizeof(buf), "Transfer request id: %d from %s to %s for file %s\n", msg->req.id, msg->req.sender, msg->req.receiver, msg->req.path);
+            send_string(buf);
+            break;
+        case HANDLED:
+            snprintf(buf, sizeof(buf), "Transfer request %d handled successfully\n", msg->req.id);
+            send_string(buf);
+            break;
+        case REJECTED:
+            snprintf(buf, sizeof(buf), "Transfer request %d rejected\n", msg->req.id);
+            send_string(buf);
+            break;
+        case CANCELLED:
+            snprintf(buf, sizeof(buf), "Transfer request %d cancelled by %s\n", msg->req.id, msg->req.sender);
+            send_string(buf);
+            break;
+        case PROGRESS:
+            snprintf(buf, sizeof(buf), "Transfer request %d: %d/%d files copied\n", msg->req.id, msg->arg, msg->arg2);
+            send_string(buf);
+            break;
+        case WHO_ARE_YOU:
+            i_am_user();
+            break;
+        default:
+            printf("Invalid message status: %d\n", msg->status);
+            break;
+    }
+}
+
+/*
+ * Receives the next message while the session waits for a reply.
+ * Returns 0, or -1 after telling the client if the parent did not answer
+ * within PARENT_REPLY_TIMEOUT_MS.
+ */
+static int receive_reply_msg(transfer_msg *msg){
+    int n = receive_transfer_msg(msg, PARENT_REPLY_TIMEOUT_MS);
+    if (n < 0) {
+        perror("receive_transfer_msg");
+        exit(EXIT_FAILURE);
+    }
+    if (n == 0) {
+        send_string("err-The server did not answer, try again\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Waits for the parent's reply of type want.
+ * Notifications that arrive in the meantime are handled as usual.
+ * Returns 0, or -1 if the reply did not come (see receive_reply_msg()).
+ */
+static int wait_parent_reply(transfer_status want, transfer_msg *msg){
+    while (1) {
+        if (receive_reply_msg(msg) < 0) return -1;
+        if (msg->status == want) return 0;
+        handle_parent_msg(msg);
+    }
+}
+
 /*
  * create a transfer request.
- * Initializes a transfer_msg with the status NEW_REQ, sends it via pipe_write,
- * and blocks until a response is received via pipe_read.
+ * Initializes a transfer_msg with the status NEW_REQ and sends it to the parent.
+ * Returns as soon as the parent has queued it, the outcome arrives later
+ * as a HANDLED or REJECTED notification.
+ * group is 0 for a lone request, -1 to start a fan-out group, or the id
+ * returned for the first request of the group.
  */
-int create_request(char *sender, char *path, char *receiver){
+int create_request(char *sender, char *path, char *receiver, int group){
     transfer_msg msg;
     memset(&msg, 0, sizeof(msg));
     msg.status = NEW_REQ;
     msg.req.id = 0;
+    msg.arg = group;
     strcpy(msg.req.sender, sender);
     strcpy(msg.req.receiver, receiver);
     strcpy(msg.req.path, path);
 
-    int ret = send_transfer_msg(pipe_write, &msg);
-    if (ret < 0){
-        perror("send_transfer_msg");
-        exit(EXIT_FAILURE);
-    }
-    send_string("Transfer request sent successfully\n");
-    send_string("Waiting for response... I'm blocking\n");
-    while (1) {
-        if (receive_transfer_msg(pipe_read, &msg) <= 0) {
-            perror("receive_transfer_msg");
-            exit(EXIT_FAILURE);
-        }
-        if (msg.status == REJECTED){
-            send_string("Transfer request rejected\n");
-            break;
-        }else if (msg.status == HANDLED){
-            send_string("Transfer request handled successfully\n");
-            break;
-        }
+    send_to_parent(&msg);
+    if (wait_parent_reply(REQ_CREATED, &msg) < 0) return -1;
+
+    char buf[512];
+    if (msg.arg < 0) {
+        send_string("err-Transfer request could not be queued\n");
+        return -1;
     }
-    
-    return 0;
+    snprintf(buf, sizeof(buf), "ok-Transfer request %d sent to %s\n", msg.req.id, receiver);
+    send_string(buf);
+    return msg.req.id;
 }
 
 /*
@@ -219,12 +754,7 @@ int accept_req(int id, char *dest){
     strcpy(msg.req.sender, username);
     strcpy(msg.req.path, dest);
 
-    int ret = send_transfer_msg(pipe_write, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
-    }
-
-    return 0;
+    return send_to_parent(&msg);
 }
 
 /*
@@ -240,300 +770,697 @@ int reject_req(int id){
     strcpy(msg.req.sender, username);
     strcpy(msg.req.receiver, "\0");
 
-    int ret = send_transfer_msg(pipe_write, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
-    }
+    return send_to_parent(&msg);
+}
 
+/*
+ * List the requests waiting for this user.
+ * Sends PENDING and prints every request the parent lists until PENDING_END.
+ */
+int pending_req(){
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.status = PENDING;
+    send_to_parent(&msg);
+
+    char buf[2048];
+    while (1) {
+        if (receive_reply_msg(&msg) < 0) return -1;
+        if (msg.status == PENDING_END) {
+            if (msg.arg > msg.req.id) {
+                snprintf(buf, sizeof(buf), "ok-%d pending transfer request(s), only %d listed\n", msg.arg, msg.req.id);
+            } else {
+                snprintf(buf, sizeof(buf), "ok-%d pending transfer request(s)\n", msg.req.id);
+            }
+            send_string(buf);
+            break;
+        }
+        handle_parent_msg(&msg); // the listed requests are TRANSF_REQ messages
+    }
     return 0;
 }
 
 /*
- * Send a message to the server to let it know it's own username
+ * Show the requests this user sent that are not finished yet, or only request id if not 0.
  */
-int i_am_user(){
+int status_req(int id){
     transfer_msg msg;
     memset(&msg, 0, sizeof(msg));
-    msg.status = I_M_USER;
-    msg.req.id = 0;
-    strcpy(msg.req.sender, username);
-    strcpy(msg.req.receiver, "");
-    strcpy(msg.req.path, "");
+    msg.status = STATUS;
+    msg.req.id = id;
+    send_to_parent(&msg);
 
-    int ret = send_transfer_msg(pipe_write, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
+    char buf[2048];
+    while (1) {
+        if (receive_reply_msg(&msg) < 0) return -1;
+        if (msg.status == STATUS_INFO) {
+            snprintf(buf, sizeof(buf), "Transfer request %d to %s for file %s: %s\n", msg.req.id, msg.req.receiver, msg.req.path, msg.arg ? "copying" : "waiting for an answer");
+            send_string(buf);
+        } else if (msg.status == STATUS_END) {
+            if (id != 0 && msg.arg == 0) {
+                snprintf(buf, sizeof(buf), "err-No outstanding transfer request %d\n", id);
+            } else if (msg.arg > msg.req.id) {
+                snprintf(buf, sizeof(buf), "ok-%d outstanding transfer request(s), only %d listed\n", msg.arg, msg.req.id);
+            } else {
+                snprintf(buf, sizeof(buf), "ok-%d outstanding transfer request(s)\n", msg.req.id);
+            }
+            send_string(buf);
+            break;
+        } else {
+            handle_parent_msg(&msg);
+        }
     }
-
     return 0;
 }
 
 /*
- * Send a message to the server to let it know the transfer request was handled.
+ * Withdraw a request this user sent, as long as it was not accepted yet.
  */
-int send_handled_msg(int session){
+int cancel_req(int id){
     transfer_msg msg;
     memset(&msg, 0, sizeof(msg));
-    msg.status = HANDLED;
-    msg.req.id = 0;
-    strcpy(msg.req.path, "");
-    strcpy(msg.req.sender, "");
-    strcpy(msg.req.receiver, "");
+    msg.status = CANCEL;
+    msg.req.id = id;
+    send_to_parent(&msg);
 
-    int ret = send_transfer_msg(sessions[session].pipe_fd_write, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
+    // CANCELLED for another id is a notification about a request sent to us
+    while (1) {
+        if (wait_parent_reply(CANCELLED, &msg) < 0) return -1;
+        if (msg.req.id == id && strcmp(msg.req.sender, username) == 0) break;
+        handle_parent_msg(&msg);
     }
 
+    if (msg.arg < 0) {
+        send_string("err-Request not found, not yours or already accepted\n");
+        return -1;
+    }
+    send_string("ok-Transfer request cancelled\n");
     return 0;
 }
 
 /*
- * Send a message to the server to let it know the transfer request was rejected.
+ * Send a message to the server to let it know it's own username
  */
-int send_rejected_msg(int session){
+int i_am_user(){
     transfer_msg msg;
     memset(&msg, 0, sizeof(msg));
-    msg.status = REJECTED;
+    msg.status = I_M_USER;
     msg.req.id = 0;
-    strcpy(msg.req.path, "");
-    strcpy(msg.req.sender, "");
+    strcpy(msg.req.sender, username);
     strcpy(msg.req.receiver, "");
+    strcpy(msg.req.path, "");
 
-    int ret = send_transfer_msg(sessions[session].pipe_fd_write, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
-    }
-
-    return 0;
+    return send_to_parent(&msg);
 }
 
 /*
  * Child handle message.
- * Receives a message from the pipe and handles it.
- * The messages can be: TRANSF_REQ, WHO_ARE_YOU
+ * Drains the messages the parent put in the session's ring and handles them.
+ * The messages can be: TRANSF_REQ, HANDLED, REJECTED, CANCELLED, PROGRESS, WHO_ARE_YOU
  */
 int child_handle_msg(){
-
-    printf("hellooo im child handle message function\n");
     transfer_msg msg;
-    int ret = receive_transfer_msg(pipe_read, &msg);
-    if (ret < 0){
-        exit(EXIT_FAILURE);
-    }
-    if (ret == 0){
-        printf("[CHILD]: pipe closed\n");
-    }
+    int ret;
 
-    printf("Child received message:\n id: %d\n status: %d\n sender: %s\n receiver: %s\n path: %s\n", msg.req.id, msg.status, msg.req.sender, msg.req.receiver, msg.req.path);
-    
-    // handle different message types
-    switch (msg.status){
-        case TRANSF_REQ:
-            char buf[2048];    
-            snprintf(buf, sizeof(buf), "Transfer request id: %d from %s to %s for file %s\n", msg.req.id, msg.req.sender, msg.req.receiver, msg.req.path);
-            send_string(buf);
-
-            break;
-        case WHO_ARE_YOU:
-            i_am_user();
-            
-            break;
-        default:
-            perror("Invalid message status");
-            return -1;
+    ring_clear_doorbell(pipe_read);
+    while ((ret = receive_transfer_msg(&msg, 0)) > 0) {
+        handle_parent_msg(&msg);
     }
-    return 0;
+    return ret;
 }
 
 /*
- * Perform a transfer.
- * Opens the source file and creates the destination file.
- * Reads the source file and writes it to the destination file.
- * (Performed by parent process)
+ * Copies src_fd, the opened source, to dest and gives dest to the receiver.
+ * The caller closes src_fd.
  */
-int perform_transfer(char *source, char *dest, char *receiver){
-    int src_fd, dest_fd;
-    ssize_t nread;
-    char buffer[4096];
+static int perform_copy(int src_fd, char *source, char *dest, char *receiver){
+    int dest_fd;
     struct passwd *pwd;
 
     restore_privileges();
 
     printf("[PARENT] Transferring %s to %s for user %s\n", source, dest, receiver);
 
-    // Open source file
-    src_fd = open(source, O_RDONLY);
-    if (src_fd < 0) {
-        perror("[PARENT] Error opening source file");
-        minimize_privileges();
-        return -1;
-    }
-
-    // Open/Create destination file
+    // Open the destination before charging, so the charge is based on the
+    // file actually written to and not on an earlier look at the path.
+    // It is opened beneath the receiver's folder without following symlinks:
+    // root writes it, and the receiver controls what is on the way
+    struct stat src_st, dest_st;
+    long long size = fstat(src_fd, &src_st) == 0 ? src_st.st_size : 0;
+    long long bytes, inodes;
     printf("[PARENT] Opening destination file %s\n", dest);
-    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0664);
-    if (dest_fd < 0) {
-        perror("[PARENT] Error opening destination file");
-        close(src_fd);
-        minimize_privileges();
-        return -1;
-    }
-
-    // Copy loop
-    while ((nread = read(src_fd, buffer, sizeof(buffer))) > 0) {
-        if (write(dest_fd, buffer, nread) != nread) {
-            perror("[PARENT] Error writing to destination file");
-            close(src_fd);
+    dest_fd = copy_open_dest(dest, receiver, O_WRONLY | O_NONBLOCK, 0);
+    if (dest_fd >= 0) {
+        if (fstat(dest_fd, &dest_st) < 0 || !S_ISREG(dest_st.st_mode)) {
+            printf("[PARENT] %s is not a regular file, %s not copied\n", dest, source);
+            close(dest_fd);
+            minimize_privileges();
+            return -1;
+        }
+        // Replacing a file: charge the difference, truncate only once charged
+        bytes = size - dest_st.st_size;
+        inodes = 0;
+        if (quota_charge(receiver, bytes, inodes) < 0) {
+            printf("[PARENT] Quota of %s exceeded, %s not copied\n", receiver, source);
             close(dest_fd);
             minimize_privileges();
             return -1;
         }
+        if (ftruncate(dest_fd, 0) < 0) {
+            perror("[PARENT] Error truncating destination file");
+            quota_charge(receiver, -bytes, -inodes);
+            close(dest_fd);
+            minimize_privileges();
+            return -1;
+        }
+    } else if (errno == ENOENT) {
+        // New file: charge it before it is created
+        bytes = size;
+        inodes = 1;
+        if (quota_charge(receiver, bytes, inodes) < 0) {
+            printf("[PARENT] Quota of %s exceeded, %s not copied\n", receiver, source);
+            minimize_privileges();
+            return -1;
+        }
+        dest_fd = copy_open_dest(dest, receiver, O_WRONLY | O_CREAT | O_EXCL, 0664);
+        if (dest_fd < 0) {
+            perror("[PARENT] Error creating destination file");
+            quota_charge(receiver, -bytes, -inodes);
+            minimize_privileges();
+            return -1;
+        }
+    } else {
+        perror("[PARENT] Error opening destination file");
+        minimize_privileges();
+        return -1;
     }
 
-    if (nread < 0) {
-        perror("[PARENT] Error reading source file");
+    // Copy, reflink or in-kernel when the filesystem allows it
+    if (copy_fd_data(src_fd, dest_fd) < 0) {
+        perror("[PARENT] Error copying file");
+        // The destination stays with whatever was written: the receiver
+        // keeps paying for that and gets the rest of the charge back
+        if (fstat(dest_fd, &dest_st) == 0) {
+            quota_charge(receiver, dest_st.st_size - size, 0);
+        }
+        close(dest_fd);
+        minimize_privileges();
+        return -1;
     }
 
-    close(src_fd);
-    close(dest_fd);
-
     // Change ownership of the destination file to the receiver
     pwd = getpwnam(receiver);
     if (pwd != NULL) {
-        if (chown(dest, pwd->pw_uid, pwd->pw_gid) < 0) {
+        if (fchown(dest_fd, pwd->pw_uid, pwd->pw_gid) < 0) {
             perror("[PARENT] Error changing ownership");
         }
     } else {
         printf("[PARENT] Warning: Receiver user '%s' not found, ownership not changed\n", receiver);
     }
-    
+
+    close(dest_fd);
     minimize_privileges();
     return 0;
 }
 
 /*
- * Parent handle message.
- * Receives a message from the pipe and handles it.
- * The messages can be: NEW_REQ, ACCEPT, REJECT, I_M_USER
+ * Copies a directory, or the entries matching a glob, into the dest directory
+ * and gives the copies to the receiver.
  */
-int parent_handle_msg(int i){
+static int perform_tree_copy(char *source, char *dest, char *sender, char *receiver){
+    struct passwd *pwd = getpwnam(receiver);
+    if (pwd == NULL) {
+        printf("[PARENT] Receiver user '%s' not found\n", receiver);
+        return -1;
+    }
 
-    transfer_msg msg;
-    int ret = receive_transfer_msg(sessions[i].pipe_fd_read, &msg);
-    if (ret < 0 || ret == 0){
+    printf("[PARENT] Transferring tree %s to %s for user %s\n", source, dest, receiver);
+    restore_privileges();
+    int ret = copy_tree(source, dest, sender, receiver, pwd->pw_uid, pwd->pw_gid);
+    minimize_privileges();
+    return ret;
+}
+
+/*
+ * Opens the source of a transfer in the sender's folder, see copy_open_source().
+ * The sender can change the path while the request waits, so it is opened
+ * without following symlinks and checked through the descriptor.
+ * Returns the descriptor and fills st, or -1 if the source cannot be opened
+ * or is neither a regular file nor a directory.
+ */
+static int open_source(char *source, char *sender, struct stat *st){
+    restore_privileges();
+    int fd = copy_open_source(source, sender, O_RDONLY | O_NONBLOCK);
+    minimize_privileges();
+    if (fd < 0) {
+        perror("[COPY] Error opening source");
+        return -1;
+    }
+    if (fstat(fd, st) < 0 || !(S_ISREG(st->st_mode) || S_ISDIR(st->st_mode))) {
+        printf("[COPY] %s is not a regular file or a directory\n", source);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Makes sure the staged copy of a fan-out group exists, creating it from
+ * source for the first acceptance. The recipients are then served from it,
+ * so the source is read once and, where the filesystem shares extents
+ * (FICLONE, copy_file_range), the copies share its blocks.
+ * The staged copy never changes and lives until the group's last request ends.
+ */
+static int stage_source(int group, char *source, char *sender, char *staged){
+    char tmp[PATH_LENGTH + 8];
+    char dir[PATH_LENGTH];
+
+    snprintf(dir, sizeof(dir), "%s/%s", root_dir_path, TRANSFER_STAGING_DIR);
+    if (snprintf(staged, PATH_LENGTH, "%s/%d", dir, group) >= PATH_LENGTH) return -1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", staged);
+
+    // Acceptances of the same group can run in several workers at once
+    FileLock *lock = get_file_lock(staged);
+    if (writer_lock(lock, COPY_LOCK_TIMEOUT) != 0) {
+        release_file_lock(lock);
+        return -1;
+    }
+
+    int ret = 0;
+    restore_privileges();
+    if (access(staged, F_OK) != 0) {
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            perror("[COPY] mkdir staging");
+        }
+
+        ret = -1;
+        struct stat st;
+        int src_fd = copy_open_source(source, sender, O_RDONLY | O_NONBLOCK);
+        if (src_fd >= 0 && (fstat(src_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+            close(src_fd); // a directory is copied as a tree, not staged
+            src_fd = -1;
+        }
+        if (src_fd >= 0) {
+            int tmp_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (tmp_fd >= 0) {
+                if (copy_fd_data(src_fd, tmp_fd) == 0 && rename(tmp, staged) == 0) {
+                    ret = 0;
+                } else {
+                    perror("[COPY] Error staging file");
+                    unlink(tmp);
+                }
+                close(tmp_fd);
+            }
+            close(src_fd);
+        }
+        if (ret == 0) {
+            printf("[COPY] Staged %s for group %d\n", source, group);
+        }
+    }
+    minimize_privileges();
+
+    writer_unlock(lock);
+    release_file_lock(lock);
+    return ret;
+}
+
+/*
+ * Perform a transfer.
+ * Holds a read lock on the source and a write lock on the destination while
+ * perform_copy() copies the file, so the sender can keep working meanwhile.
+ * For a directory or a glob only these two top-level paths are locked.
+ * The requests of a fan-out group are copied from the group's staged copy,
+ * see stage_source().
+ * (Performed by a copy worker, see copy.c)
+ */
+int perform_transfer(char *source, char *dest, char *sender, char *receiver, int group){
+    FileLock *src_lock = get_file_lock(source);
+    if (reader_lock(src_lock, COPY_LOCK_TIMEOUT) != 0) {
+        printf("[COPY] Timed out waiting for the lock of %s\n", source);
+        release_file_lock(src_lock);
         return -1;
     }
-    
-    printf("Parent received message:\n id: %d\n status: %d\n sender: %s\n receiver: %s\n path: %s\n", msg.req.id, msg.status, msg.req.sender, msg.req.receiver, msg.req.path);
+    FileLock *dest_lock = get_file_lock(dest);
+    if (writer_lock(dest_lock, COPY_LOCK_TIMEOUT) != 0) {
+        printf("[COPY] Timed out waiting for the lock of %s\n", dest);
+        release_file_lock(dest_lock);
+        reader_unlock(src_lock);
+        release_file_lock(src_lock);
+        return -1;
+    }
+
+    char staged[PATH_LENGTH];
+    struct stat st;
+    int ret = -1;
+    if (copy_is_glob(source)) {
+        ret = perform_tree_copy(source, dest, sender, receiver);
+    } else if (group > 0 && stage_source(group, source, sender, staged) == 0) {
+        restore_privileges();
+        int staged_fd = open(staged, O_RDONLY | O_CLOEXEC);
+        minimize_privileges();
+        if (staged_fd >= 0) {
+            ret = perform_copy(staged_fd, staged, dest, receiver);
+            close(staged_fd);
+        } else {
+            perror("[COPY] Error opening staged file");
+        }
+    } else {
+        int src_fd = open_source(source, sender, &st);
+        if (src_fd >= 0) {
+            if (S_ISDIR(st.st_mode)) {
+                ret = perform_tree_copy(source, dest, sender, receiver);
+            } else {
+                ret = perform_copy(src_fd, source, dest, receiver);
+            }
+            close(src_fd);
+        }
+    }
+
+    writer_unlock(dest_lock);
+    release_file_lock(dest_lock);
+    reader_unlock(src_lock);
+    release_file_lock(src_lock);
+    return ret;
+}
+
+/*
+ * Forwards a pending request to one of the receiver's sessions.
+ */
+static int send_req_msg(int session, transfer_request *req){
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.status = TRANSF_REQ;
+    memcpy(&msg.req, req, sizeof(transfer_request));
+
+    return send_to_session(session, &msg);
+}
+
+/*
+ * Checks that the session that created a request is still the one in its slot.
+ */
+static int origin_alive(req_list *node){
+    return node->origin >= 0 && sessions[node->origin].pid != -1 && sessions[node->origin].pid == node->origin_pid;
+}
+
+/*
+ * Tells the sender how a request ended: the session that created it if it is
+ * still there, otherwise every session of the sender (e.g. after a restart).
+ */
+static void notify_sender(req_list *node, transfer_status status, int arg, int arg2){
+    transfer_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.status = status;
+    msg.req.id = node->req.id;
+    msg.arg = arg;
+    msg.arg2 = arg2;
+
+    if (origin_alive(node)) {
+        send_to_session(node->origin, &msg);
+        return;
+    }
+    presence *p = presence_get(node->req.sender, 0);
+    for (int k = (p != NULL) ? p->first_session : -1; k != -1; k = sessions[k].next_session) {
+        send_to_session(k, &msg);
+    }
+}
+
+/*
+ * Lists the state of a request to session i if its user sent it, and counts
+ * it in end (STATUS_END). Once a request did not fit, the rest are only counted.
+ */
+static void send_status_info(int i, req_list *node, transfer_msg *end){
+    if (node == NULL || strcmp(node->req.sender, sessions[i].username) != 0) {
+        return;
+    }
+
+    transfer_msg info;
+    memset(&info, 0, sizeof(info));
+    info.status = STATUS_INFO;
+    memcpy(&info.req, &node->req, sizeof(transfer_request));
+    info.arg = node->copying;
+    if (end->req.id == end->arg && send_to_session(i, &info) == 0) {
+        end->req.id++;
+    }
+    end->arg++;
+}
+
+/*
+ * Finds a pending request addressed to the user of session i.
+ */
+static req_list *find_pending(int i, int id){
+    req_list *node = index_find(id);
+    if (node == NULL || node->copying || strcmp(node->req.receiver, sessions[i].username) != 0) {
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * Routes one message received from session i.
+ * The messages can be: NEW_REQ, ACCEPT, REJECT, I_M_USER
+ */
+static int route_msg(int i, transfer_msg *msg){
+    printf("Parent received message:\n id: %d\n status: %d\n sender: %s\n receiver: %s\n path: %s\n", msg->req.id, msg->status, msg->req.sender, msg->req.receiver, msg->req.path);
 
-    transfer_request item_req;
+    presence *p;
+    req_list *node;
 
     // handle different message types
-    switch (msg.status){
+    switch (msg->status){
         case NEW_REQ:
             printf("[MAIN] im handling a new request\n");
             // create a new request
             transfer_request req;
+            memset(&req, 0, sizeof(req));
             req.id = ++req_counter;
-            strcpy(req.sender, msg.req.sender);
-            strcpy(req.sender, sessions[i].username);
-            strcpy(req.receiver, msg.req.receiver);
-            strcpy(req.path, msg.req.path);
-
-            // append the request to the list
-            append_req(req);
-            append_dict(req.id, i);
-
-            // send who are you to all clients to know which client is the receiver
-            transfer_msg who_are_you_msg;
-            who_are_you_msg.status = WHO_ARE_YOU;
-            for (int k = 0; k < MAX_CLIENTS; k++) {
-                if (sessions[k].pid != -1) {
-                    printf("[MAIN] im sending who are you to %d with fd %d\n", sessions[k].pid, sessions[k].pipe_fd_write);
-                    send_transfer_msg(sessions[k].pipe_fd_write, &who_are_you_msg);
-                }
+            strncpy(req.sender, sessions[i].username, USERNAME_LENGTH - 1);
+            strncpy(req.receiver, msg->req.receiver, USERNAME_LENGTH - 1);
+            strncpy(req.path, msg->req.path, PATH_LENGTH - 1);
+
+            // a fan-out group is joined only if its first request is still there,
+            // from the same sender and for the same file
+            if (msg->arg == -1) {
+                req.group = req.id;
+            } else if (msg->arg > 0) {
+                node = index_find(msg->arg);
+                req.group = (node != NULL && node->req.group == msg->arg && strcmp(node->req.sender, req.sender) == 0 &&
+                             strcmp(node->req.path, req.path) == 0) ? msg->arg : req.id;
+            }
+
+            // queue it for the receiver and forward it to the receiver's sessions, if any
+            transfer_msg reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.status = REQ_CREATED;
+            reply.req.id = req.id;
+
+            time_t now = time(NULL);
+            p = presence_get(req.receiver, 1);
+            if (p == NULL || enqueue_req(p, &req, i, now) == NULL) {
+                reply.arg = -1;
+                reply_to_session(i, &reply);
+                break;
+            }
+            if (tlog_add(&req, now) < 0) {
+                printf("[MAIN] request %d could not be logged, it will not survive a restart\n", req.id);
+            }
+            reply_to_session(i, &reply); // the sender gets the id right away
+            for (int k = p->first_session; k != -1; k = sessions[k].next_session) {
+                printf("[MAIN] forwarding request %d to session %d (PID %d)\n", req.id, k, sessions[k].pid);
+                send_req_msg(k, &req);
             }
             
             break;
 
         case ACCEPT:
-            printf("Processing ACCEPT from %s to %s file %s\n", msg.req.sender, msg.req.receiver, msg.req.path);
-
-            // pop the request from the list
-            if (pop_req_id(msg.req.id, &item_req) == 0) {
-                // check if the sender is the receiver
-                if (strcmp(msg.req.sender, item_req.receiver) == 0) {
-                    // perform the transfer
-                    perform_transfer(item_req.path, msg.req.path, item_req.receiver);
-                    transfer_msg handled_msg;
-                    handled_msg.status = HANDLED;
-                    handled_msg.req.id = item_req.id;
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        // send the handled message to the sender
-                        if (sessions[i].pid != -1 && strcmp(sessions[i].username, item_req.sender) == 0) {
-                            send_transfer_msg(sessions[i].pipe_fd_write, &handled_msg);
-                            break;
-                        }
-                    }
-                    int resp_i;
-                    pop_dict(msg.req.id, &resp_i);
-                    send_handled_msg(resp_i);
-                }else{
-                    append_req(item_req);
+            printf("Processing ACCEPT of request %d from %s to file %s\n", msg->req.id, sessions[i].username, msg->req.path);
+
+            // only the receiver can answer a request
+            node = find_pending(i, msg->req.id);
+            if (node != NULL) {
+                unlink_pending(node);
+                node->copying = 1;
+
+                // the sender hears back when the copy worker is done
+                if (copy_pool_submit(node->req.id, node->req.group, node->req.path, msg->req.path, node->req.sender, node->req.receiver) < 0) {
+                    notify_sender(node, REJECTED, 0, 0);
+                    finish_req(node);
                 }
             }
             
             break;
 
         case REJECT:
-            if (pop_req_id(msg.req.id, &item_req) == 0) {
-                if (strcmp(msg.req.sender, item_req.receiver) == 0) {
-                    // send the rejected message to the sender
-                    transfer_msg rejected_msg;
-                    rejected_msg.status = REJECTED;
-                    rejected_msg.req.id = item_req.id;
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        if (sessions[i].pid != -1 && strcmp(sessions[i].username, item_req.sender) == 0) {
-                            send_transfer_msg(sessions[i].pipe_fd_write, &rejected_msg);
-                            break;
-                        }
-                    }
-                    int resp_i;
-                    pop_dict(msg.req.id, &resp_i);
-                    send_rejected_msg(resp_i);
-                }else{
-                    append_req(item_req);
-                }
+            node = find_pending(i, msg->req.id);
+            if (node != NULL) {
+                unlink_pending(node);
+                notify_sender(node, REJECTED, 0, 0);
+                finish_req(node);
             }
             
-            printf("Processing REJECT from %s to %s file %s\n", msg.req.sender, msg.req.receiver, msg.req.path);
+            printf("Processing REJECT of request %d from %s\n", msg->req.id, sessions[i].username);
             break;
 
         case I_M_USER:
-            transfer_request myreq;
-            int ret = pop_req_username(msg.req.sender, &myreq);
-            
-            if (ret == 0){
-                append_req(myreq);
-                transfer_msg req_msg;
-                req_msg.status = TRANSF_REQ;
-                req_msg.req.id = myreq.id;
-                strcpy(req_msg.req.sender, myreq.sender);
-                strcpy(req_msg.req.sender, sessions[i].username);
-                strcpy(req_msg.req.receiver, myreq.receiver);
-                strcpy(req_msg.req.path, myreq.path);
-                int ret = send_transfer_msg(sessions[i].pipe_fd_write, &req_msg);
-                if (ret < 0){
-                    exit(EXIT_FAILURE);
+            presence_leave(i);
+            presence_join(i, msg->req.sender);
+
+            // deliver the requests that were waiting for this user
+            p = presence_get(msg->req.sender, 0);
+            for (node = (p != NULL) ? p->pending_head : NULL; node != NULL; node = node->next) {
+                if (send_req_msg(i, &node->req) < 0) {
+                    break;
                 }
             }
-            printf("Session %d (PID %d) identifies as user: %s\n", i, sessions[i].pid, msg.req.sender);
+            printf("Session %d (PID %d) identifies as user: %s\n", i, sessions[i].pid, msg->req.sender);
+            break;
+
+        case PENDING:
+            // list the requests waiting for this user, then how many were listed out of how many,
+            // the listing stops at the first request the session has no room for
+            transfer_msg end_msg;
+            memset(&end_msg, 0, sizeof(end_msg));
+            end_msg.status = PENDING_END;
+            p = presence_get(sessions[i].username, 0);
+            for (node = (p != NULL) ? p->pending_head : NULL; node != NULL; node = node->next) {
+                if (end_msg.req.id == end_msg.arg && send_req_msg(i, &node->req) == 0) {
+                    end_msg.req.id++;
+                }
+                end_msg.arg++;
+            }
+            reply_to_session(i, &end_msg);
+            break;
+
+        case STATUS:
+            // list the requests this user sent that are still pending or copying
+            memset(&end_msg, 0, sizeof(end_msg));
+            end_msg.status = STATUS_END;
+            if (msg->req.id != 0) {
+                send_status_info(i, index_find(msg->req.id), &end_msg);
+            } else {
+                for (int b = 0; b < REQ_INDEX_BUCKETS; b++) {
+                    for (node = req_index[b]; node != NULL; node = node->next_id) {
+                        send_status_info(i, node, &end_msg);
+                    }
+                }
+            }
+            reply_to_session(i, &end_msg);
+            break;
+
+        case CANCEL:
+            // only the sender can cancel, and only before the receiver accepts
+            transfer_msg cancelled;
+            memset(&cancelled, 0, sizeof(cancelled));
+            cancelled.status = CANCELLED;
+            cancelled.req.id = msg->req.id;
+            strncpy(cancelled.req.sender, sessions[i].username, USERNAME_LENGTH - 1);
+
+            node = index_find(msg->req.id);
+            if (node == NULL || node->copying || strcmp(node->req.sender, sessions[i].username) != 0) {
+                cancelled.arg = -1;
+                reply_to_session(i, &cancelled);
+                break;
+            }
+            unlink_pending(node);
+            p = presence_get(node->req.receiver, 0);
+            for (int k = (p != NULL) ? p->first_session : -1; k != -1; k = sessions[k].next_session) {
+                if (k != i) send_to_session(k, &cancelled);
+            }
+            finish_req(node);
+            reply_to_session(i, &cancelled);
+            break;
+
+        case WATCH_DIR:
+            // a session caches the listing of a directory, report its changes
+            dircache_watch(msg->req.id, msg->req.path);
             break;
 
         default:
-            printf("Unknown message status: %d\n", msg.status);
+            printf("Unknown message status: %d\n", msg->status);
             return -1;
     }
+
     return 0;
 }
+
+/*
+ * Parent handle message.
+ * Drains the session's ring, taking up to IPC_BUFFER_SIZE bytes at a time,
+ * and routes each frame.
+ * Returns -1 if the ring carries a malformed frame.
+ */
+int parent_handle_msg(int i){
+    unsigned char buf[IPC_BUFFER_SIZE];
+    IpcRing *ring = &session_channel(i)->to_parent;
+    int ret = 0;
+
+    ring_clear_doorbell(sessions[i].pipe_fd_read);
+    size_t len;
+    while ((len = ring_peek(ring, buf, sizeof(buf))) > 0) {
+        size_t off = 0;
+        while (off < len) {
+            transfer_msg msg;
+            int k = decode_transfer_msg(buf + off, len - off, &msg);
+            if (k == 0) break; // frame continues past what was copied
+            if (k < 0) {
+                printf("[MAIN] malformed message from session %d, dropping its ring\n", i);
+                off = len;
+                ret = -1;
+                break;
+            }
+            off += k;
+            route_msg(i, &msg);
+        }
+        ring_consume(ring, off);
+        if (ret < 0 || off == 0) break;
+    }
+
+    return ret;
+}
+
+/*
+ * Called by the copy pool when the copy of an accepted request ends.
+ * Notifies the sender with HANDLED or REJECTED.
+ */
+void transfer_copy_done(int id, int status){
+    req_list *node = index_find(id);
+    if (node == NULL) return;
+
+    printf("[MAIN] copy of request %d finished with status %d\n", id, status);
+    notify_sender(node, status == 0 ? HANDLED : REJECTED, 0, 0);
+    finish_req(node);
+}
+
+/*
+ * Called by the copy pool while a directory or glob transfer is copied.
+ * Forwards the progress to the sender.
+ */
+void transfer_copy_progress(int id, int done, int total){
+    req_list *node = index_find(id);
+    if (node == NULL || !node->copying) return;
+
+    notify_sender(node, PROGRESS, done, total);
+}
+
+/*
+ * Drops the requests nobody answered within TRANSFER_TTL.
+ * Runs at most once every TRANSFER_EXPIRY_SWEEP seconds.
+ */
+void transfer_expire(){
+    time_t now = time(NULL);
+    if (now - last_expiry_sweep < TRANSFER_EXPIRY_SWEEP) return;
+    last_expiry_sweep = now;
+
+    for (int b = 0; b < REQ_INDEX_BUCKETS; b++) {
+        req_list *node = req_index[b];
+        while (node != NULL) {
+            req_list *next = node->next_id;
+            if (!node->copying && now - node->created >= TRANSFER_TTL) {
+                printf("[MAIN] request %d expired\n", node->req.id);
+                unlink_pending(node);
+                notify_sender(node, REJECTED, 0, 0);
+                finish_req(node);
+            }
+            node = next;
+        }
+    }
+}
@@ -0,0 +1,229 @@
+#include "server.h"
+#include "common.h"
+#include "transfer_log.h"
+
+static int tlog_dir_fd = -1;
+static int tlog_fd = -1;       // Log, opened with O_APPEND
+static long tlog_records = 0;  // Records in the log since the last compaction
+static FILE *tlog_snap = NULL; // Snapshot being written by a compaction
+
+/*
+ * Encodes a record in buf, returns its length.
+ */
+static size_t encode_record(unsigned char *buf, tlog_type type, transfer_request *req, time_t created){
+    tlog_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.id = req->id;
+    rec.created = created;
+    if (type == TLOG_ADD) {
+        rec.group = req->group;
+        rec.sender_len = strnlen(req->sender, USERNAME_LENGTH - 1);
+        rec.receiver_len = strnlen(req->receiver, USERNAME_LENGTH - 1);
+        rec.path_len = strnlen(req->path, PATH_LENGTH - 1);
+    }
+
+    size_t len = 0;
+    memcpy(buf, &rec, sizeof(rec));
+    len += sizeof(rec);
+    memcpy(buf + len, req->sender, rec.sender_len);
+    len += rec.sender_len;
+    memcpy(buf + len, req->receiver, rec.receiver_len);
+    len += rec.receiver_len;
+    memcpy(buf + len, req->path, rec.path_len);
+    len += rec.path_len;
+    return len;
+}
+
+/*
+ * Replays the records of a file.
+ * Returns the offset after the last complete record, a torn tail is ignored.
+ */
+static off_t replay_file(int fd, tlog_add_fn on_add, tlog_del_fn on_del, long *records){
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return 0;
+
+    unsigned char *data = malloc(st.st_size);
+    if (data == NULL) {
+        perror("malloc");
+        return 0;
+    }
+    ssize_t size = pread(fd, data, st.st_size, 0);
+    if (size < 0) {
+        perror("pread transfer log");
+        free(data);
+        return 0;
+    }
+
+    off_t off = 0;
+    while ((size_t)(size - off) >= sizeof(tlog_record)) {
+        tlog_record rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        size_t len = sizeof(rec) + rec.sender_len + rec.receiver_len + rec.path_len;
+        if ((size_t)(size - off) < len) break;
+        if ((rec.type != TLOG_ADD && rec.type != TLOG_DEL) || rec.sender_len >= USERNAME_LENGTH ||
+            rec.receiver_len >= USERNAME_LENGTH || rec.path_len >= PATH_LENGTH) {
+            printf("[PARENT] corrupted transfer log record at offset %ld\n", (long)off);
+            break;
+        }
+
+        if (rec.type == TLOG_ADD) {
+            transfer_request req;
+            memset(&req, 0, sizeof(req));
+            const unsigned char *p = data + off + sizeof(rec);
+            req.id = rec.id;
+            req.group = rec.group;
+            memcpy(req.sender, p, rec.sender_len);
+            p += rec.sender_len;
+            memcpy(req.receiver, p, rec.receiver_len);
+            p += rec.receiver_len;
+            memcpy(req.path, p, rec.path_len);
+            on_add(&req, (time_t)rec.created);
+        } else {
+            on_del(rec.id);
+        }
+        off += len;
+        (*records)++;
+    }
+
+    free(data);
+    return off;
+}
+
+/*
+ * Loads the pending requests (snapshot, then log) and opens the log for appending.
+ * Replay is idempotent: on_add must ignore known ids and on_del unknown ones,
+ * because a crash during compaction can leave records in both files.
+ */
+int tlog_open(int dir_fd, tlog_add_fn on_add, tlog_del_fn on_del){
+    long snap_records = 0;
+    tlog_dir_fd = dir_fd;
+
+    restore_privileges();
+
+    int snap_fd = openat(dir_fd, TRANSFER_SNAPSHOT_FILE, O_RDONLY);
+    if (snap_fd >= 0) {
+        replay_file(snap_fd, on_add, on_del, &snap_records);
+        close(snap_fd);
+    }
+
+    tlog_fd = openat(dir_fd, TRANSFER_LOG_FILE, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (tlog_fd < 0) {
+        perror("openat transfer log");
+        minimize_privileges();
+        return -1;
+    }
+    off_t end = replay_file(tlog_fd, on_add, on_del, &tlog_records);
+
+    // Drop a record torn by a crash, appends continue after the last good one
+    struct stat st;
+    if (fstat(tlog_fd, &st) == 0 && st.st_size > end) {
+        printf("[PARENT] truncating transfer log from %ld to %ld bytes\n", (long)st.st_size, (long)end);
+        if (ftruncate(tlog_fd, end) < 0) {
+            perror("ftruncate transfer log");
+        }
+    }
+
+    minimize_privileges();
+    printf("[PARENT] transfer queue loaded: %ld snapshot and %ld log records\n", snap_records, tlog_records);
+    return 0;
+}
+
+/*
+ * Appends a record to the log and waits for it to reach the disk.
+ */
+static int append_record(tlog_type type, transfer_request *req, time_t created){
+    unsigned char buf[sizeof(tlog_record) + 2 * USERNAME_LENGTH + PATH_LENGTH];
+    if (tlog_fd < 0) return -1;
+
+    size_t len = encode_record(buf, type, req, created);
+    if (write_n(tlog_fd, buf, len) < 0) {
+        return -1;
+    }
+    if (fdatasync(tlog_fd) < 0) {
+        perror("fdatasync transfer log");
+        return -1;
+    }
+    tlog_records++;
+    return 0;
+}
+
+int tlog_add(transfer_request *req, time_t created){
+    return append_record(TLOG_ADD, req, created);
+}
+
+int tlog_del(int id){
+    transfer_request req;
+    memset(&req, 0, sizeof(req));
+    req.id = id;
+    return append_record(TLOG_DEL, &req, 0);
+}
+
+/*
+ * Tells whether the log has grown enough past the live requests to be compacted.
+ */
+int tlog_should_compact(int live){
+    return tlog_records >= TRANSFER_COMPACT_MIN && tlog_records > 2 * (long)live;
+}
+
+/*
+ * Starts writing a new snapshot, next to the current one.
+ * It opens with a DEL of the last id given out, so that ids are not reused
+ * after a restart even when that request is gone.
+ */
+int tlog_compact_begin(int last_id){
+    restore_privileges();
+    int fd = openat(tlog_dir_fd, TRANSFER_SNAPSHOT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    minimize_privileges();
+    if (fd < 0) {
+        perror("openat transfer snapshot");
+        return -1;
+    }
+    tlog_snap = fdopen(fd, "w");
+    if (tlog_snap == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char buf[sizeof(tlog_record)];
+    transfer_request req;
+    memset(&req, 0, sizeof(req));
+    req.id = last_id;
+    size_t len = encode_record(buf, TLOG_DEL, &req, 0);
+    fwrite(buf, 1, len, tlog_snap);
+    return 0;
+}
+
+int tlog_compact_add(transfer_request *req, time_t created){
+    unsigned char buf[sizeof(tlog_record) + 2 * USERNAME_LENGTH + PATH_LENGTH];
+    size_t len = encode_record(buf, TLOG_ADD, req, created);
+    return fwrite(buf, 1, len, tlog_snap) == len ? 0 : -1;
+}
+
+/*
+ * Makes the new snapshot durable, swaps it in and empties the log.
+ * On failure the old snapshot and the log are left as they were.
+ */
+int tlog_compact_end(){
+    int ok = fflush(tlog_snap) == 0 && fsync(fileno(tlog_snap)) == 0;
+    fclose(tlog_snap);
+    tlog_snap = NULL;
+
+    restore_privileges();
+    if (!ok || renameat(tlog_dir_fd, TRANSFER_SNAPSHOT_FILE ".tmp", tlog_dir_fd, TRANSFER_SNAPSHOT_FILE) < 0) {
+        perror("transfer snapshot");
+        unlinkat(tlog_dir_fd, TRANSFER_SNAPSHOT_FILE ".tmp", 0);
+        minimize_privileges();
+        return -1;
+    }
+    fsync(tlog_dir_fd);
+    minimize_privileges();
+
+    if (ftruncate(tlog_fd, 0) < 0) {
+        perror("ftruncate transfer log");
+        return -1;
+    }
+    printf("[PARENT] transfer log compacted (%ld records)\n", tlog_records);
+    tlog_records = 0;
+    return 0;
+}
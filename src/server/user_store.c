@@ -0,0 +1,731 @@
+#include "common.h"
+#include "users.h"
+#include "user_store.h"
+#include <sys/mman.h>
+#include <stdint.h>
+
+#define USTORE_ALIGN 8 // Records are padded so that they can be read in place
+
+/*
+ * The store as seen by this process. The parent opens it writable and is its
+ * only writer; sessions inherit it across fork() and only read it.
+ */
+static struct {
+    int dir_fd;
+    int log_fd;
+    int idx_fd;
+    int writable;
+    unsigned long long gen;     // Generation of the open log
+    unsigned char *log_map;
+    size_t log_map_len;         // Mapped bytes, may extend past the end of the file
+    size_t log_size;            // Bytes of valid records that can be read
+    ustore_index_header *idx;
+    size_t idx_len;
+    ino_t log_ino;
+    ino_t idx_ino;
+    ustore_shared *shared;          // Created by the parent before any session is forked
+    unsigned long long seen_gen;    // Sessions: generation their view matches
+    unsigned long long seen_files_gen;
+} store = { -1, -1, -1, 0, 0, NULL, 0, 0, NULL, 0, 0, 0, NULL, 0, 0 };
+
+/*
+ * FNV-1a hash of a username.
+ */
+static unsigned int hash_name(const char *name, size_t len){
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static size_t record_size(size_t name_len){
+    return (sizeof(ustore_record) + name_len + USTORE_ALIGN - 1) & ~(size_t)(USTORE_ALIGN - 1);
+}
+
+static ustore_slot *slots_of(ustore_index_header *idx){
+    return (ustore_slot *)(idx + 1);
+}
+
+static size_t index_size(unsigned int capacity){
+    return sizeof(ustore_index_header) + (size_t)capacity * sizeof(ustore_slot);
+}
+
+/*
+ * Returns the record at off in the mapped log, NULL if it is not entirely below end.
+ */
+static ustore_record *record_at(unsigned long long off, size_t end){
+    if (off < sizeof(ustore_log_header) || off % USTORE_ALIGN != 0 || off + sizeof(ustore_record) > end) return NULL;
+    ustore_record *rec = (ustore_record *)(store.log_map + off);
+    if ((rec->type != USTORE_ADD && rec->type != USTORE_DEL) || rec->name_len == 0 ||
+        rec->name_len >= USERNAME_LENGTH || off + record_size(rec->name_len) > end) {
+        return NULL;
+    }
+    return rec;
+}
+
+/*
+ * Maps the log up to size bytes, with room to grow so that appends rarely remap.
+ */
+static int map_log(size_t size){
+    if (size > store.log_map_len) {
+        size_t len = (size + size / 2 + USER_MAP_CHUNK) & ~(size_t)(USER_MAP_CHUNK - 1);
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, store.log_fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap users log");
+            return -1;
+        }
+        if (store.log_map != NULL) {
+            munmap(store.log_map, store.log_map_len);
+        }
+        store.log_map = map;
+        store.log_map_len = len;
+    }
+    store.log_size = size;
+    return 0;
+}
+
+/*
+ * Parent side: tells the sessions that the store changed.
+ * files is set when the log or the index was replaced by a new file.
+ */
+static void publish(int files){
+    if (store.shared == NULL) return;
+    store.shared->log_size = store.log_size;
+    if (files) {
+        store.shared->files_gen++;
+    }
+    __atomic_add_fetch(&store.shared->gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Looks a name up in an index, returns its slot or NULL.
+ * If free_slot is given, it receives the slot where the name would be inserted.
+ * Writers set the hash before publishing the offset, so readers can run
+ * concurrently with the parent.
+ */
+static ustore_slot *index_lookup(ustore_index_header *idx, const char *name, size_t len, unsigned int h, ustore_slot **free_slot){
+    ustore_slot *slots = slots_of(idx);
+    unsigned int mask = idx->capacity - 1;
+
+    if (free_slot != NULL) *free_slot = NULL;
+    for (unsigned int n = 0, i = h & mask; n < idx->capacity; n++, i = (i + 1) & mask) {
+        unsigned long long off = __atomic_load_n(&slots[i].off, __ATOMIC_ACQUIRE);
+        if (off == USTORE_SLOT_EMPTY || off == USTORE_SLOT_DELETED) {
+            if (free_slot != NULL && *free_slot == NULL) *free_slot = &slots[i];
+            if (off == USTORE_SLOT_EMPTY) return NULL;
+            continue;
+        }
+        if (slots[i].hash != h) continue;
+        ustore_record *rec = record_at(off, store.log_size);
+        if (rec != NULL && rec->name_len == len && memcmp(rec + 1, name, len) == 0) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Applies the record at off to an index. Replaying a record twice is harmless.
+ * Returns the slot changed, NULL if none.
+ */
+static ustore_slot *index_apply(ustore_index_header *idx, unsigned long long off, ustore_record *rec){
+    const char *name = (const char *)(rec + 1);
+    unsigned int h = hash_name(name, rec->name_len);
+    ustore_slot *free_slot;
+    ustore_slot *slot = index_lookup(idx, name, rec->name_len, h, &free_slot);
+
+    if (rec->type == USTORE_ADD) {
+        if (slot == NULL && free_slot != NULL) {
+            if (free_slot->off == USTORE_SLOT_EMPTY) idx->used++;
+            free_slot->hash = h;
+            slot = free_slot;
+            idx->live++;
+        } else if (slot != NULL && slot->off != off) {
+            idx->dead++; // replaced
+        }
+        if (slot != NULL) {
+            __atomic_store_n(&slot->off, off, __ATOMIC_RELEASE);
+        }
+    } else if (slot != NULL) {
+        __atomic_store_n(&slot->off, USTORE_SLOT_DELETED, __ATOMIC_RELEASE);
+        idx->live--;
+        idx->dead += 2; // the ADD and this DEL
+    } else {
+        idx->dead++;
+    }
+    if (rec->id >= idx->next_id) {
+        idx->next_id = rec->id + 1;
+    }
+    return slot;
+}
+
+/*
+ * Returns the end of the valid records found from off, a torn or corrupted tail is left out.
+ * count receives the number of ADD records.
+ */
+static size_t scan_log(size_t off, size_t end, unsigned int *count){
+    ustore_record *rec;
+    *count = 0;
+    while ((rec = record_at(off, end)) != NULL) {
+        if (rec->type == USTORE_ADD) (*count)++;
+        off += record_size(rec->name_len);
+    }
+    return off;
+}
+
+/*
+ * Recomputes the counters of an index from its slots and the log.
+ * They are only written to the mapping, not synced like the slots, and a
+ * replayed DEL counts as dead again, so the writer recounts them at open.
+ * Every record that does not hold a live user is dead.
+ */
+static void index_recount(ustore_index_header *idx){
+    ustore_slot *slots = slots_of(idx);
+    unsigned int live = 0, used = 0, records = 0;
+    int next_id = 1;
+
+    for (unsigned int i = 0; i < idx->capacity; i++) {
+        if (slots[i].off != USTORE_SLOT_EMPTY) used++;
+        if (slots[i].off > USTORE_SLOT_DELETED) live++;
+    }
+    ustore_record *rec;
+    for (size_t off = sizeof(ustore_log_header); (rec = record_at(off, store.log_size)) != NULL; off += record_size(rec->name_len)) {
+        records++;
+        if (rec->id >= next_id) next_id = rec->id + 1;
+    }
+    idx->live = live;
+    idx->used = used;
+    idx->dead = records - live;
+    idx->next_id = next_id;
+}
+
+/*
+ * Writes a new index for the whole log next to the current one and swaps it in.
+ * Used when the index is missing, stale (log compacted) or half full.
+ * It is sized for extra more users than the log holds.
+ */
+static int build_index(unsigned int extra){
+    unsigned int adds;
+    scan_log(sizeof(ustore_log_header), store.log_size, &adds);
+
+    unsigned int capacity = USER_INDEX_MIN_SLOTS;
+    while (capacity < 4 * (adds + extra + 1)) {
+        capacity <<= 1;
+    }
+
+    int fd = openat(store.dir_fd, USER_INDEX_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("openat users index");
+        return -1;
+    }
+    size_t len = index_size(capacity);
+    if (ftruncate(fd, len) < 0) {
+        perror("ftruncate users index");
+        close(fd);
+        return -1;
+    }
+    ustore_index_header *idx = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (idx == MAP_FAILED) {
+        perror("mmap users index");
+        close(fd);
+        return -1;
+    }
+
+    memcpy(idx->magic, USER_INDEX_MAGIC, sizeof(idx->magic));
+    idx->gen = store.gen;
+    idx->capacity = capacity;
+    idx->next_id = 1;
+    ustore_record *rec;
+    for (size_t off = sizeof(ustore_log_header); (rec = record_at(off, store.log_size)) != NULL; off += record_size(rec->name_len)) {
+        index_apply(idx, off, rec);
+    }
+    idx->log_end = store.log_size;
+
+    struct stat st;
+    if (msync(idx, len, MS_SYNC) < 0 || fstat(fd, &st) < 0 ||
+        renameat(store.dir_fd, USER_INDEX_FILE ".tmp", store.dir_fd, USER_INDEX_FILE) < 0) {
+        perror("users index");
+        munmap(idx, len);
+        close(fd);
+        return -1;
+    }
+    fsync(store.dir_fd);
+
+    if (store.idx != NULL) {
+        munmap(store.idx, store.idx_len);
+        close(store.idx_fd);
+    }
+    store.idx = idx;
+    store.idx_len = len;
+    store.idx_fd = fd;
+    store.idx_ino = st.st_ino;
+    publish(1);
+    printf("[PARENT] users index rebuilt: %u users, %u slots\n", idx->live, capacity);
+    return 0;
+}
+
+/*
+ * Opens the index read/write if it is sound and describes the open log.
+ */
+static int open_index(int flags){
+    int fd = openat(store.dir_fd, USER_INDEX_FILE, flags);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    ustore_index_header hdr;
+    if (fstat(fd, &st) < 0 || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, USER_INDEX_MAGIC, sizeof(hdr.magic)) != 0 || hdr.gen != store.gen ||
+        hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) != 0 ||
+        (size_t)st.st_size != index_size(hdr.capacity) || hdr.log_end > store.log_size) {
+        close(fd);
+        return -1;
+    }
+
+    int prot = (flags & O_ACCMODE) == O_RDWR ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap users index");
+        close(fd);
+        return -1;
+    }
+    if (store.idx != NULL) {
+        munmap(store.idx, store.idx_len);
+        close(store.idx_fd);
+    }
+    store.idx = map;
+    store.idx_len = st.st_size;
+    store.idx_fd = fd;
+    store.idx_ino = st.st_ino;
+    return 0;
+}
+
+/*
+ * Opens the log and maps it, checking its header.
+ */
+static int open_log(int flags){
+    int fd = openat(store.dir_fd, USER_LOG_FILE, flags);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    ustore_log_header hdr;
+    if (fstat(fd, &st) < 0 || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, USER_LOG_MAGIC, sizeof(hdr.magic)) != 0) {
+        printf("[PARENT] %s is not a users log\n", USER_LOG_FILE);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (store.log_map != NULL) {
+        munmap(store.log_map, store.log_map_len);
+        store.log_map = NULL;
+        store.log_map_len = 0;
+    }
+    if (store.log_fd >= 0) {
+        close(store.log_fd);
+    }
+    store.log_fd = fd;
+    store.log_ino = st.st_ino;
+    store.gen = hdr.gen;
+    return map_log(st.st_size);
+}
+
+/*
+ * Writes a complete log (header and the given records) under a temporary
+ * name, then renames it over the current one.
+ */
+static int write_log(unsigned long long gen, const unsigned char *records, size_t len){
+    int fd = openat(store.dir_fd, USER_LOG_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("openat users log");
+        return -1;
+    }
+    ustore_log_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, USER_LOG_MAGIC, sizeof(hdr.magic));
+    hdr.gen = gen;
+
+    int ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+             (len == 0 || write(fd, records, len) == (ssize_t)len) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || renameat(store.dir_fd, USER_LOG_FILE ".tmp", store.dir_fd, USER_LOG_FILE) < 0) {
+        perror("users log");
+        unlinkat(store.dir_fd, USER_LOG_FILE ".tmp", 0);
+        return -1;
+    }
+    fsync(store.dir_fd);
+    return 0;
+}
+
+/*
+ * Creates the log, with the users of the old users.dat array if there is one.
+ * users.dat itself is left untouched.
+ */
+static int create_log(){
+    unsigned char *records = NULL;
+    size_t len = 0;
+    int count = 0;
+
+    int fd = openat(store.dir_fd, USERS_FILE, O_RDONLY);
+    if (fd >= 0) {
+        User legacy[LEGACY_MAX_USERS];
+        if (read(fd, &count, sizeof(int)) != sizeof(int) || count < 0) count = 0;
+        if (count > LEGACY_MAX_USERS) count = LEGACY_MAX_USERS;
+        ssize_t n = read(fd, legacy, sizeof(User) * count);
+        count = (n > 0) ? (int)(n / sizeof(User)) : 0;
+        close(fd);
+
+        records = calloc(count, record_size(USERNAME_LENGTH));
+        if (records == NULL && count > 0) {
+            perror("calloc");
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            size_t name_len = strnlen(legacy[i].username, USERNAME_LENGTH - 1);
+            if (name_len == 0) continue;
+            ustore_record *rec = (ustore_record *)(records + len);
+            rec->type = USTORE_ADD;
+            rec->name_len = name_len;
+            rec->id = i + 1;
+            rec->permissions = legacy[i].permissions;
+            memcpy(rec + 1, legacy[i].username, name_len);
+            len += record_size(name_len);
+        }
+        printf("[PARENT] migrating %d users from %s\n", count, USERS_FILE);
+    }
+
+    int ret = write_log(1, records, len);
+    free(records);
+    return ret;
+}
+
+/*
+ * Rewrites the log with only the live users once most of it is dead records,
+ * then rebuilds the index for it. A crash in between leaves an index of the
+ * old generation, which open rebuilds.
+ */
+static void maybe_compact(){
+    ustore_index_header *idx = store.idx;
+    if (idx->dead < USER_COMPACT_MIN || idx->dead <= idx->live) return;
+
+    unsigned char *records = malloc(store.log_size);
+    if (records == NULL) return;
+    size_t len = 0;
+    ustore_slot *slots = slots_of(idx);
+    for (unsigned int i = 0; i < idx->capacity; i++) {
+        ustore_record *rec = (slots[i].off > USTORE_SLOT_DELETED) ? record_at(slots[i].off, store.log_size) : NULL;
+        if (rec == NULL) continue;
+        memcpy(records + len, rec, record_size(rec->name_len));
+        len += record_size(rec->name_len);
+    }
+
+    restore_privileges();
+    if (write_log(store.gen + 1, records, len) == 0 && open_log(O_RDWR | O_APPEND) == 0) {
+        build_index(0);
+        printf("[PARENT] users log compacted, %u users\n", store.idx->live);
+    }
+    minimize_privileges();
+    free(records);
+}
+
+/*
+ * Parent side: loads the log (creating it from users.dat the first time),
+ * drops a torn tail, then brings the index up to date or rebuilds it.
+ */
+static int open_writer(){
+    if (open_log(O_RDWR | O_APPEND) < 0) {
+        if (errno != ENOENT || create_log() < 0 || open_log(O_RDWR | O_APPEND) < 0) {
+            perror("users log");
+            return -1;
+        }
+    }
+
+    int have_index = open_index(O_RDWR) == 0;
+    size_t from = have_index ? store.idx->log_end : sizeof(ustore_log_header);
+    unsigned int tail_adds;
+    size_t end = scan_log(from, store.log_size, &tail_adds);
+    if (end < store.log_size) {
+        printf("[PARENT] truncating users log from %zu to %zu bytes\n", store.log_size, end);
+        if (ftruncate(store.log_fd, end) < 0) {
+            perror("ftruncate users log");
+        }
+        store.log_size = end;
+    }
+
+    if (have_index && (store.idx->used + tail_adds) * 2 <= store.idx->capacity) {
+        ustore_record *rec;
+        for (size_t off = from; (rec = record_at(off, end)) != NULL; off += record_size(rec->name_len)) {
+            index_apply(store.idx, off, rec);
+        }
+        index_recount(store.idx);
+        store.idx->log_end = end;
+        return 0;
+    }
+    return build_index(0);
+}
+
+/*
+ * Session side: maps the log and the index the parent maintains.
+ */
+static int open_reader(){
+    if (open_log(O_RDONLY) < 0 || open_index(O_RDONLY) < 0) {
+        perror("users store");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Session side: catches up with the parent's last published change.
+ * Costs one shared memory read when nothing changed. Otherwise the log
+ * mapping is extended, or the files are reopened after a compaction or an
+ * index rebuild. Records are never modified once written and index slots
+ * are published atomically, so lookups see either the old or the new user set.
+ */
+static void sync_view(){
+    if (store.writable || store.shared == NULL) return;
+    unsigned long long gen = __atomic_load_n(&store.shared->gen, __ATOMIC_ACQUIRE);
+    if (gen == store.seen_gen) return;
+
+    unsigned long long files_gen = store.shared->files_gen;
+    if (files_gen != store.seen_files_gen) {
+        if (open_reader() < 0) return;
+    } else if (map_log(store.shared->log_size) < 0) {
+        return;
+    }
+    store.seen_files_gen = files_gen;
+    store.seen_gen = gen;
+}
+
+/*
+ * Opens the user store in dir_fd.
+ * The writer (the parent) also creates the page through which it publishes changes.
+ */
+int user_store_open(int dir_fd, int writable){
+    store.dir_fd = dir_fd;
+    store.writable = writable;
+
+    if (writable && store.shared == NULL) {
+        store.shared = mmap(NULL, sizeof(ustore_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (store.shared == MAP_FAILED) {
+            perror("mmap users shared page");
+            store.shared = NULL;
+            return -1;
+        }
+    }
+
+    restore_privileges();
+    int ret = writable ? open_writer() : open_reader();
+    minimize_privileges();
+    if (ret == 0) {
+        publish(1);
+        printf("User store: %u users\n", store.idx->live);
+    }
+    return ret;
+}
+
+/*
+ * Called in a session right after fork(): from now on the store is only read.
+ */
+int user_store_detach(){
+    if (store.shared == NULL) return -1;
+    store.writable = 0;
+    store.seen_gen = __atomic_load_n(&store.shared->gen, __ATOMIC_ACQUIRE);
+    store.seen_files_gen = store.shared->files_gen;
+    return 0;
+}
+
+/*
+ * Looks a user up. Returns 0 and fills user (if not NULL) when it exists, -1 otherwise.
+ */
+int user_store_find(const char *name, User *user){
+    if (store.idx == NULL) return -1;
+    size_t len = strnlen(name, USERNAME_LENGTH);
+    if (len == 0 || len >= USERNAME_LENGTH) return -1;
+
+    unsigned int h = hash_name(name, len);
+    sync_view();
+    unsigned long long gen = store.seen_gen;
+    ustore_slot *slot = index_lookup(store.idx, name, len, h, NULL);
+    if (slot == NULL && !store.writable) {
+        sync_view();
+        if (store.seen_gen != gen) {
+            slot = index_lookup(store.idx, name, len, h, NULL); // created during the first lookup
+        }
+    }
+    if (slot == NULL) return -1;
+
+    if (user != NULL) {
+        ustore_record *rec = record_at(slot->off, store.log_size);
+        if (rec == NULL) return -1;
+        memset(user, 0, sizeof(User));
+        user->id = rec->id;
+        user->permissions = rec->permissions;
+        memcpy(user->username, rec + 1, rec->name_len);
+    }
+    return 0;
+}
+
+/*
+ * Encodes a record in buf, returns its padded length.
+ */
+static size_t encode_record(unsigned char *buf, ustore_type type, const char *name, size_t name_len, int id, int permissions){
+    size_t len = record_size(name_len);
+    memset(buf, 0, len);
+
+    ustore_record *rec = (ustore_record *)buf;
+    rec->type = type;
+    rec->name_len = name_len;
+    rec->id = id;
+    rec->permissions = permissions;
+    memcpy(rec + 1, name, name_len);
+    return len;
+}
+
+/*
+ * Appends a record to the log and waits for it to reach the disk.
+ */
+static int append_record(ustore_type type, const char *name, size_t name_len, int id, int permissions, unsigned long long *off){
+    unsigned char buf[sizeof(ustore_record) + USERNAME_LENGTH + USTORE_ALIGN];
+    size_t len = encode_record(buf, type, name, name_len, id, permissions);
+
+    *off = store.log_size;
+    if (write(store.log_fd, buf, len) != (ssize_t)len || fdatasync(store.log_fd) < 0) {
+        perror("write users log");
+        if (ftruncate(store.log_fd, store.log_size) < 0) {
+            perror("ftruncate users log");
+        }
+        return -1;
+    }
+    return map_log(store.log_size + len);
+}
+
+/*
+ * Applies a record just appended and makes the index durable up to it:
+ * the slot reaches the disk before log_end moves past the record.
+ */
+static void index_commit(unsigned long long off){
+    ustore_slot *slot = index_apply(store.idx, off, record_at(off, store.log_size));
+
+    if (slot != NULL) {
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t addr = (uintptr_t)slot & ~(uintptr_t)(page - 1);
+        if (msync((void *)addr, page, MS_SYNC) < 0) {
+            perror("msync users index");
+        }
+    }
+    store.idx->log_end = store.log_size;
+}
+
+/*
+ * Adds a user. Returns -1 if it exists or cannot be stored.
+ */
+int user_store_add(const char *name, int permissions){
+    size_t len = strnlen(name, USERNAME_LENGTH);
+    if (!store.writable || store.idx == NULL || len == 0 || len >= USERNAME_LENGTH) return -1;
+    if (user_store_find(name, NULL) == 0) return -1;
+
+    // Keep the index at most half full
+    if ((store.idx->used + 1) * 2 > store.idx->capacity) {
+        restore_privileges();
+        int ret = build_index(0);
+        minimize_privileges();
+        if (ret < 0) return -1;
+    }
+
+    unsigned long long off;
+    if (append_record(USTORE_ADD, name, len, store.idx->next_id, permissions, &off) < 0) return -1;
+    index_commit(off);
+    publish(0);
+    return 0;
+}
+
+/*
+ * Adds several users with a single log write and sync.
+ * Users that exist, are repeated or have an invalid name are skipped, their id
+ * is set to -1; the others get their new id. Returns the number added, -1 on failure.
+ */
+int user_store_add_batch(User *users, int count){
+    if (!store.writable || store.idx == NULL || count <= 0) return -1;
+
+    // Size the index for the whole batch up front
+    if ((store.idx->used + count) * 2 > store.idx->capacity) {
+        restore_privileges();
+        int ret = build_index(count);
+        minimize_privileges();
+        if (ret < 0) return -1;
+    }
+
+    unsigned char *buf = malloc((size_t)count * record_size(USERNAME_LENGTH));
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    size_t len = 0;
+    int added = 0;
+    int next_id = store.idx->next_id;
+    for (int i = 0; i < count; i++) {
+        size_t name_len = strnlen(users[i].username, USERNAME_LENGTH);
+        int skip = name_len == 0 || name_len >= USERNAME_LENGTH || user_store_find(users[i].username, NULL) == 0;
+        for (int k = 0; k < i && !skip; k++) {
+            skip = users[k].id > 0 && strcmp(users[k].username, users[i].username) == 0;
+        }
+        if (skip) {
+            users[i].id = -1;
+            continue;
+        }
+        users[i].id = next_id++;
+        len += encode_record(buf + len, USTORE_ADD, users[i].username, name_len, users[i].id, users[i].permissions);
+        added++;
+    }
+    if (added == 0) {
+        free(buf);
+        return 0;
+    }
+
+    size_t start = store.log_size;
+    if (write(store.log_fd, buf, len) != (ssize_t)len || fdatasync(store.log_fd) < 0) {
+        perror("write users log");
+        if (ftruncate(store.log_fd, start) < 0) {
+            perror("ftruncate users log");
+        }
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    if (map_log(start + len) < 0) return -1;
+
+    ustore_record *rec;
+    for (size_t off = start; (rec = record_at(off, store.log_size)) != NULL; off += record_size(rec->name_len)) {
+        index_apply(store.idx, off, rec);
+    }
+    if (msync(store.idx, store.idx_len, MS_SYNC) < 0) {
+        perror("msync users index");
+    }
+    store.idx->log_end = store.log_size;
+    publish(0);
+    return added;
+}
+
+/*
+ * Deletes a user. Returns -1 if it does not exist or cannot be stored.
+ */
+int user_store_del(const char *name){
+    User user;
+    if (!store.writable || user_store_find(name, &user) < 0) return -1;
+
+    unsigned long long off;
+    if (append_record(USTORE_DEL, user.username, strlen(user.username), user.id, 0, &off) < 0) return -1;
+    index_commit(off);
+    publish(0);
+    maybe_compact();
+    return 0;
+}
+
+/*
+ * Number of users.
+ */
+int user_store_count(){
+    return (store.idx != NULL) ? (int)store.idx->live : 0;
+}
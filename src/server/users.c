@@ -1,114 +1,31 @@
 #include "common.h"
 #include "users.h"
 #include "server.h"
+#include "user_store.h"
 
 extern int root_dir_fd;
 extern char root_dir_path[];
-int user_count = 0;
-User users[MAX_USERS];
 
 /*
- * Persists the current user list to disk.
- * Temporarily restores privileges to write to the protected users file.
- */
-void save_users_to_file() {
-    restore_privileges();
-    int fd = openat(root_dir_fd, USERS_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd == -1) { 
-        perror("openat users file");
-        return;
-    }
-    write(fd, &user_count, sizeof(int));
-    write(fd, users, sizeof(User) * user_count);
-    close(fd);
-    minimize_privileges();
-}
-
-/*
- * Checks if a user with the given username exists in the current user list.
+ * Checks if a user with the given username exists in the user store.
  * Returns 0 if the user exists, -1 otherwise.
  */
 int user_exists(char *username) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) return 0;
-    }
-    return -1;
+    return user_store_find(username, NULL);
 }
 
 /*
- * Creates a new user in the user list.
- * Persists the user list to disk.
+ * Adds a user to the user store (users.log/users.idx).
  */
 int create_user_persistance(char *username, int permissions) {
-    restore_privileges();
-    if (user_count >= MAX_USERS) return -1;
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) return -1;
-    }
-
-    User new_user;
-    new_user.id = user_count;
-    strncpy(new_user.username, username, USERNAME_LENGTH);
-    new_user.permissions = permissions;
-    
-    users[user_count++] = new_user;
-    save_users_to_file();
-    minimize_privileges();
-    return 0;
+    return user_store_add(username, permissions);
 }
 
 /*
- * Deletes a user from the user list.
- * Persists the user list to disk.
+ * Deletes a user from the user store.
  */
 int delete_user_persistance(char *username) {
-    restore_privileges();
-    int found = -1;
-    for (int i=0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            found = i;
-            break;
-        }
-    }
-    if (found == -1) return -1;
-    
-    // Shift
-    for (int i = found; i < user_count - 1; i++) {
-        users[i] = users[i+1];
-    }
-    user_count--;
-    save_users_to_file();
-    minimize_privileges();
-    return 0;
-}
-
-/*
- * Retrieves the list of users from the users file (user.dat).
- * Persists the current user list to disk.
- */
-void retrive_users() {
-    printf("Retrieving users...\n");
-
-    char path[2048];
-    resolve_path(root_dir_path, USERS_FILE, path); // resolve user file path in path
-    printf("Path: %s\n", path);
-
-    int fd = open(path, O_RDONLY); // open user file
-    if (fd == -1) return;
-
-    // read user count
-    if (read(fd, &user_count, sizeof(int)) != sizeof(int)) {
-        user_count = 0;
-        close(fd);
-        return;
-    }
-    if (user_count > MAX_USERS) user_count = MAX_USERS;
-
-    read(fd, users, sizeof(User) * user_count); // read user file
-
-    close(fd);
-
-    printf("Retrieved %d users.\n", user_count);
+    return user_store_del(username);
 }
 
 /*
@@ -288,10 +205,6 @@ int delete_os_user(char *username) {
  * If something fails, it will try to rollback.
  */
 int create_user(char *username, int permissions) {
-    // Check if there is space for new users
-    if (user_count >= MAX_USERS) {
-        return -1;
-    }
     // Check if user already exists
     if (user_exists(username) == 0) {
         printf("err-user already exists\n");